@@ -37,6 +37,9 @@ namespace po = boost::program_options;
 #include "deCAPTCHA/avplayer_free_decoder.hpp"
 #include "deCAPTCHA/jsdati_decoder.hpp"
 #include "deCAPTCHA/hydati_decoder.hpp"
+#include "deCAPTCHA/local_recognizer_decoder.hpp"
+#include "deCAPTCHA/cnn_decoder.hpp"
+#include "deCAPTCHA/image_preprocess.hpp"
 
 static void vc_code_decoded(boost::system::error_code ec, std::string provider, std::string vccode, boost::function<void()> reportbadvc)
 {
@@ -70,6 +73,11 @@ int main( int argc, char *argv[] )
 	//http://antigate.com/in.php
 	std::string antigate_key, antigate_host;
 	bool use_avplayer_free_vercode_decoder(false);
+	std::string dispatch;
+	std::string routing;
+	std::string local_templates;
+	std::string cnn_model;
+	bool preprocess(true);
 
 	po::variables_map vm;
 	po::options_description desc( "qqbot options" );
@@ -87,7 +95,16 @@ int main( int argc, char *argv[] )
 	( "antigate_key", po::value<std::string>( &antigate_key ),	console_out_str("antigate解码服务key").c_str() )
 	( "antigate_host", po::value<std::string>( &antigate_host )->default_value("http://antigate.com/"),	console_out_str("antigate解码服务器地址").c_str() )
 
+	( "local_templates", po::value<std::string>( &local_templates ),	console_out_str("本地识别使用的字符模板文件").c_str() )
+
+	( "cnn_model", po::value<std::string>( &cnn_model ),	console_out_str("本地卷积网络识别使用的模型文件").c_str() )
+
 	( "use_avplayer_free_vercode_decoder", po::value<bool>( &use_avplayer_free_vercode_decoder ), "don't use" )
+
+	( "preprocess", po::value<bool>( &preprocess )->default_value(true),	console_out_str("上传之前裁剪图片并转成灰度 png").c_str() )
+
+	( "dispatch", po::value<std::string>( &dispatch )->default_value("serial"),	console_out_str("解码器调度方式 serial/race/hedged").c_str() )
+	( "routing", po::value<std::string>( &routing )->default_value("static"),	console_out_str("解码器排序方式 static/fastest/cheapest").c_str() )
 	;
 
 	po::store( po::parse_command_line( argc, argv, desc ), vm );
@@ -102,12 +119,42 @@ int main( int argc, char *argv[] )
 
 	decaptcha::deCAPTCHA decaptcha(io_service);
 
+	if (dispatch == "race")
+		decaptcha.set_dispatch_policy(decaptcha::dispatch_race);
+	else if (dispatch == "hedged")
+		decaptcha.set_dispatch_policy(decaptcha::dispatch_hedged);
+
+	if (routing != "static")
+	{
+		decaptcha::routing_config config;
+		config.objective = routing == "cheapest" ? decaptcha::route_cheapest_within_sla : decaptcha::route_fastest;
+		decaptcha.set_routing(config);
+	}
+
+	if (preprocess)
+		decaptcha.set_image_preprocessor(decaptcha::image_preprocessor());
+
+	// 本地识别最先尝试, 没把握再交给后面的打码服务.
+	if(!local_templates.empty())
+	{
+		decaptcha::decoder::local_recognizer_decoder local_recognizer(io_service);
+		if (local_recognizer.load_templates(local_templates))
+			decaptcha.add_decoder(local_recognizer);
+	}
+
+	if(!cnn_model.empty())
+	{
+		decaptcha::decoder::cnn_decoder cnn(io_service, cnn_model);
+		if (cnn.is_open())
+			decaptcha.add_decoder(cnn);
+	}
+
 	if(!hydati_key.empty())
 	{
 		decaptcha.add_decoder(
 			decaptcha::decoder::hydati_decoder(
 				io_service, hydati_key
-			)
+			), 1.9 // 每 1000 个 ￥12, 折合美元
 		);
 	}
 
@@ -116,7 +163,7 @@ int main( int argc, char *argv[] )
 		decaptcha.add_decoder(
 			decaptcha::decoder::jsdati_decoder(
 				io_service, jsdati_username, jsdati_password
-			)
+			), 1.6 // 每 1000 个 ￥10, 折合美元
 		);
 	}
 
@@ -125,14 +172,14 @@ int main( int argc, char *argv[] )
 		decaptcha.add_decoder(
 			decaptcha::decoder::deathbycaptcha_decoder(
 				io_service, deathbycaptcha_username, deathbycaptcha_password
-			)
+			), 1.35
 		);
 	}
 
 	if(!antigate_key.empty())
 	{
 		decaptcha.add_decoder(
-			decaptcha::decoder::antigate_decoder(io_service, antigate_key, antigate_host)
+			decaptcha::decoder::antigate_decoder(io_service, antigate_key, antigate_host), 0.7
 		);
 	}
 
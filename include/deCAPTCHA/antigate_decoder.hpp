@@ -19,12 +19,12 @@
 #pragma once
 #include <string>
 #include <fstream>
-#include <boost/regex.hpp>
 #include <boost/random.hpp>
 #include <boost/format.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
 #include <avhttp.hpp>
 #include <avhttp/async_read_body.hpp>
 
@@ -33,7 +33,18 @@ namespace pt = boost::property_tree;
 #include <boost/property_tree/json_parser.hpp>
 namespace js = boost::property_tree::json_parser;
 
-#include <boost/timedcall.hpp>
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "http_connection_pool.hpp"
+#include "streambuf_pool.hpp"
+#include "response_parser.hpp"
+#include "concurrency_limit.hpp"
+#include "decoder_health.hpp"
+#include "poll_schedule.hpp"
+#include "timer_wheel.hpp"
+#include "poll_multiplexer.hpp"
+#include "multipart.hpp"
+#include "image_format.hpp"
 
 #ifndef BOOST_SYSTEM_NOEXCEPT
   #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
@@ -141,61 +152,56 @@ class error_category_impl
 			return "antigate ERROR";
 		}
 	}
+
+	// 图片是空的, 太大或者格式不对, 是图片的问题, 不是服务商的. antigate 在本地就先检查了.
+	virtual boost::system::error_condition default_error_condition(int e) const BOOST_SYSTEM_NOEXCEPT
+	{
+		switch (e)
+		{
+		case error::ERROR_ZERO_CAPTCHA_FILESIZE:
+		case error::ERROR_TOO_BIG_CAPTCHA_FILESIZE:
+		case error::ERROR_IMAGE_TYPE_NOT_SUPPORTED:
+			return decaptcha::health_error::not_provider_fault;
+		default:
+			return boost::system::error_condition(e, *this);
+		}
+	}
 };
 
-struct report_bad_op : boost::asio::coroutine
+struct report_bad_op
 {
-	report_bad_op(boost::asio::io_service & io_service,
-				std::string key, std::string host,
-				boost::shared_ptr<std::string> CAPTCHA_ID)
-	  : m_io_service(io_service), m_CAPTCHA_ID(CAPTCHA_ID),
- 		m_key(key), m_host(host)
+	// url 在识别成功的时候就拼好, 这样 report_bad_op 只有一个引用和一个指针,
+	// 放得进 boost::function 自带的缓冲区, 一路拷贝给调用者都不用分配内存.
+	report_bad_op(boost::asio::io_service & io_service, boost::shared_ptr<const std::string> url)
+	  : m_io_service(io_service), m_url(url)
 	{
 	}
 
 	// 调用这个开始报告错误.
 	void operator()()
 	{
-		m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-		m_buffers = boost::make_shared<boost::asio::streambuf>();
-
 		// 汇报汇报.
-		// "http://antigate.com/res.php?key=XXX&action=reportbad&id=CAPCHA_ID_HERE"
-		std::string url =  boost::str(boost::format("%sres.php?key=%s&action=reportbad&id=%s")
-			% m_host % m_key % *m_CAPTCHA_ID );
-
-		avhttp::async_read_body(*m_stream, url, *m_buffers, *this);
-	}
-
-	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
-	{
-
+		decaptcha::detail::fetch_url_op op(m_io_service, *m_url,
+			avhttp::request_opts()(avhttp::http_options::connection, "keep-alive"), decaptcha::detail::ignore_fetch_result());
 	}
 
 private:
 	boost::asio::io_service & m_io_service;
-	const std::string m_key, m_host;
-	boost::shared_ptr<std::string> m_CAPTCHA_ID;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	boost::shared_ptr<const std::string> m_url;
 };
 
 inline report_bad_op report_bad_func(boost::asio::io_service & io_service,
-				std::string key, std::string host,
-				boost::shared_ptr<std::string> CAPTCHA_ID)
+				const std::string & key, const std::string & host,
+				const std::string & CAPTCHA_ID)
 {
-	return report_bad_op(io_service, key, host, CAPTCHA_ID);
+	// "http://antigate.com/res.php?key=XXX&action=reportbad&id=CAPCHA_ID_HERE"
+	return report_bad_op(io_service, boost::make_shared<std::string>(
+		boost::str(boost::format("%sres.php?key=%s&action=reportbad&id=%s") % host % key % CAPTCHA_ID)));
 }
 
-inline boost::system::error_code process_error_result(std::string result)
+inline boost::system::error_code process_error_result(boost::string_ref result)
 {
-	boost::cmatch what;
-	boost::regex ex;
-
-	ex.set_expression("ERROR_NO_SLOT_AVAILABLE");
-
-	if (boost::regex_search(result.c_str(), what, ex))
+	if (decaptcha::detail::contains(result, "ERROR_NO_SLOT_AVAILABLE"))
 	{
 		// TODO
 		// 这个有办法,  增加 bid !
@@ -204,88 +210,237 @@ inline boost::system::error_code process_error_result(std::string result)
 	return error::ERROR_CAPTCHA_UNSOLVABLE;
 }
 
+// 批量查询返回的是 "答案|CAPCHA_NOT_READY|...", 按 | 切开, 每一段都指向响应体, 不复制.
+// 切出来的答案前面没有 OK|, process_result 两种都认.
+struct batch_result_handler
+{
+	std::size_t count;
+	decaptcha::detail::poll_multiplexer::fetch_handler handler;
+
+	void operator()(boost::system::error_code ec, boost::string_ref body) const
+	{
+		typedef decaptcha::detail::poll_multiplexer::answer_range answer_range;
+
+		if (ec || count == 1)
+		{
+			handler(ec, answer_range(&body, &body + 1));
+			return;
+		}
+
+		// 一个请求一个, 最多 100 个 string_ref.
+		std::vector<boost::string_ref> answers;
+		answers.reserve(count);
+		for (boost::string_ref rest = body;;)
+		{
+			boost::string_ref::const_iterator sep = std::find(rest.begin(), rest.end(), '|');
+			answers.push_back(rest.substr(0, sep - rest.begin()));
+			if (sep == rest.end())
+				break;
+			rest = rest.substr(sep - rest.begin() + 1);
+		}
+
+		// 整个请求出错了, 比如 key 不对, 每个验证码都是这个错误.
+		if (answers.size() != count && body.starts_with("ERROR_"))
+			answers.assign(count, body);
+
+		handler(ec, answer_range(&answers[0], &answers[0] + answers.size()));
+	}
+};
+
+inline void fetch_results(boost::asio::io_service & io_service, const std::string & key, const std::string & host,
+				const std::vector<std::string> & ids, const decaptcha::detail::poll_multiplexer::fetch_handler & handler)
+{
+	// http://antigate.com/res.php?key=XXXXX&action=get&id=CAPCHA_ID_HERE
+	// http://antigate.com/res.php?key=XXXXX&action=get&ids=ID1,ID2,ID3
+	std::string url = ids.size() == 1
+		? boost::str(boost::format("%sres.php?key=%s&action=get&id=%s") % host % key % ids[0])
+		: boost::str(boost::format("%sres.php?key=%s&action=get&ids=%s") % host % key % boost::join(ids, ","));
+
+	batch_result_handler h;
+	h.count = ids.size();
+	h.handler = handler;
+
+	decaptcha::detail::fetch_url_op op(io_service, url,
+		avhttp::request_opts()(avhttp::http_options::connection, "keep-alive"), h);
+}
+
+// 同一个账号的所有验证码共用一个, 一次最多查询 100 个.
+inline boost::shared_ptr<decaptcha::detail::poll_multiplexer> get_result_poller(
+				boost::asio::io_service & io_service, const std::string & key, const std::string & host)
+{
+	return decaptcha::detail::get_poll_multiplexer(io_service, "antigate " + host + " " + key,
+		boost::bind(&fetch_results, boost::ref(io_service), key, host, _1, _2), 100);
+}
+
+/*
+ * 一个 antigate 账号的设置, 解码器创建的时候准备好, 之后不再修改.
+ * 解码器和它启动的每一个 op 共用一份, handler 里拷贝的只是指针, 不是 key, host 和表单.
+ */
+struct account_info : boost::noncopyable
+{
+	account_info(boost::asio::io_service & io_service, const std::string & _key, const std::string & _host)
+		: key(_key), host(_host)
+	{
+		if (*host.rbegin() != '/')
+			host += "/";
+
+		form.field("method", "post")
+			.field("key", key)
+			.field("regsense", "0")
+			.file("file");
+
+		poller = get_result_poller(io_service, key, host);
+	}
+
+	std::string key, host;
+	decaptcha::detail::multipart_form form;
+	boost::shared_ptr<decaptcha::detail::poll_multiplexer> poller;
+};
+
 template<class Handler>
 class antigate_decoder_op : boost::asio::coroutine
 {
-	const std::string provider;
-	std::string generate_boundary() const
+	typedef decaptcha::wheel_timer<decaptcha::detail::wait_handler<antigate_decoder_op> > timer_type;
+
+	// 一个验证码的所有状态. op 在每一步异步操作之间被拷贝, 拷贝的只是指向它的指针.
+	struct state : boost::noncopyable
 	{
-		boost::rand48 p(time(NULL));
-		return  boost::str(boost::format("%06x%06x") % p() %  p()  ).substr(0, 12);
-	}
+		state(boost::asio::io_service & _io_service, boost::shared_ptr<const account_info> _account, Handler _handler)
+			: io_service(_io_service),
+			  cancel(get_cancel_token(_handler)),
+			  strand(boost::make_shared<decaptcha::detail::op_strand>(boost::ref(_io_service))),
+			  timer(boost::make_shared<timer_type>(boost::ref(_io_service))),
+			  poll(decaptcha::detail::get_poll_schedule(_io_service, "antigate", 15, 5, 5)),
+			  stop_tries(false),
+			  watchdog(boost::make_shared<decaptcha::detail::io_watchdog<avhttp::http_stream> >(boost::ref(_io_service), strand, stream)),
+			  buffers(decaptcha::detail::acquire_streambuf(_io_service)),
+			  image(0),
+			  CAPTCHA_ID(boost::make_shared<std::string>()),
+			  handler(_handler),
+			  account(_account), provider("antigate")
+		{
+		}
+
+		// 异步操作的 handler 内存, 和 state 一起释放.
+		decaptcha::detail::handler_arena arena;
+
+		boost::asio::io_service & io_service;
+
+		cancel_token cancel;
+		// op 的 handler, 定时器和取消都在这个 strand 里执行, 多个线程 run 的时候不会同时访问 op.
+		boost::shared_ptr<decaptcha::detail::op_strand> strand;
+		// 轮询的定时器挂在共用的时间轮上.
+		boost::shared_ptr<timer_type> timer;
+		decaptcha::detail::poll_timing poll;
+
+		bool stop_tries;
+
+		boost::shared_ptr<avhttp::http_stream> stream;
+		// 上传的每一步都限时.
+		boost::shared_ptr<decaptcha::detail::io_watchdog<avhttp::http_stream> > watchdog;
+
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		// 要上传的图片, 在 handler 被调用之前一直有效.
+		const std::string * image;
+
+		boost::shared_ptr<std::string> CAPTCHA_ID;
+
+		Handler handler;
+
+		boost::shared_ptr<const account_info> account;
+		const std::string provider;
+	};
+
 public:
 	antigate_decoder_op(boost::asio::io_service & io_service,
-			std::string key, std::string host,
-			const std::string &buffer, Handler handler)
-		: m_io_service(io_service),
-		  m_key(key), m_host(host),
-		  m_handler(handler),
-		  m_stream(boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service))),
-		  m_CAPTCHA_ID(boost::make_shared<std::string>()),
-		  m_buffers(boost::make_shared<boost::asio::streambuf>()),
-		  m_tries(0), stop_tries(false), provider("antigate")
+			boost::shared_ptr<const account_info> account, const std::string &buffer, Handler handler)
+		: m_state(boost::make_shared<state>(boost::ref(io_service), account, handler))
 	{
-		std::string boundary = generate_boundary();
- 		std::string content = build_multipart_formdata(buffer, boundary);
- 		std::string content_type = boost::str(boost::format("multipart/form-data; boundary=----------------------------%s") % boundary);
-
-		m_stream->request_options(
-			avhttp::request_opts()
-				(avhttp::http_options::request_method, "POST" )
-				(avhttp::http_options::connection, "close" )
-				(avhttp::http_options::content_length, boost::lexical_cast<std::string>(content.length()) )
-				(avhttp::http_options::content_type, content_type )
-				(avhttp::http_options::request_body, content )
-		);
-		// 处理.
-		avhttp::async_read_body(*m_stream, m_host + "in.php", *m_buffers, *this);
+		state & st = *m_state;
+
+		decaptcha::detail::cancel_on_cancel(st.cancel, st.strand, st.timer);
+		decaptcha::detail::cancel_poll_on_cancel(st.cancel, st.strand, st.account->poller, st.buffers);
+
+		// 连到服务商的连接太多的时候在连接池里排队, 借到了再上传.
+		st.image = &buffer;
+		decaptcha::detail::async_acquire_http_stream(io_service, st.account->host, st.strand->wrap(*this));
 	};
 
+	// 从连接池借到了连接, 开始上传.
+	void operator()(boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		state & st = *m_state;
+
+		st.stream = stream;
+		st.watchdog->attach(stream);
+		decaptcha::detail::close_on_cancel(st.cancel, st.strand, st.stream);
+
+		// 排队的时候已经取消了.
+		if (st.cancel.is_canceled())
+		{
+			(*this)(boost::system::error_code(boost::asio::error::operation_aborted), 0);
+			return;
+		}
+
+		// 处理.
+		decaptcha::detail::async_post_multipart(st.stream, st.watchdog, st.account->host + "in.php", avhttp::request_opts(),
+			st.account->form, decaptcha::image_file_name(*st.image), decaptcha::image_mime_type(*st.image), *st.image, *st.buffers, st.strand->wrap(*this));
+	}
+
 	// 这里是 OK|ID_HERE 格式的数据
 	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
 	{
 		using namespace boost::system::errc;
 
+		state & st = *m_state;
+
+		if (st.cancel.is_canceled())
+		{
+			st.io_service.post(
+				boost::asio::detail::bind_handler(
+					st.handler, boost::system::error_code(boost::asio::error::operation_aborted), st.provider, std::string(""), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
  		BOOST_ASIO_CORO_REENTER(this)
  		{
 			if (!process_upload_result(ec, bytes_transfered))
 			{
-				m_io_service.post(
+				st.io_service.post(
 					boost::asio::detail::bind_handler(
-						m_handler, ec, provider , std::string(""), boost::function<void()>()
+						st.handler, ec, st.provider , std::string(""), boost::function<void()>()
 					)
 				);
 
 				return;
 			}
 
-			// 延时 10s
-			BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 10, boost::asio::detail::bind_handler(*this, ec, 0) );
+			st.poll.start();
 
 			do{
-				// 延时 5s 然后重试.
-				// 这样第一次就延时 15s 了,  正好合适
+				// 等到 poll_schedule 认为结果差不多出来了再去查询.
 				BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 5, boost::asio::detail::bind_handler(*this, ec, 0) );
+					async_delay(st.poll.next_delay());
 
-				// 获取一下结果
-				m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-				m_buffers = boost::make_shared<boost::asio::streambuf>();
 
-				// http://antigate.com/res.php?key=XXXXX&action=get&id=CAPCHA_ID_HERE
+				// 获取一下结果, 同一个账号的查询合并成一个请求.
+				// 上一次的响应已经处理完了, 清空了接着用.
+				decaptcha::detail::reset_streambuf(*st.buffers);
 				BOOST_ASIO_CORO_YIELD
-					avhttp::async_read_body(*m_stream,
-											std::string(boost::str(boost::format("%sres.php?key=%s&action=get&id=%s") % m_host % m_key % *m_CAPTCHA_ID)),
-											*m_buffers, *this);
+					st.account->poller->async_poll(*st.CAPTCHA_ID, st.buffers, st.strand->wrap(*this));
 
 				if (process_result(ec, bytes_transfered))
+				{
+					st.poll.solved();
 					return;
+				}
 			}while (should_try(ec));
 
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, make_error_code(operation_canceled), provider, std::string(""), boost::function<void()>()
+					st.handler, make_error_code(operation_canceled), st.provider, std::string(""), boost::function<void()>()
 				)
 			);
  		}
@@ -295,36 +450,40 @@ private:
 	{
  		using namespace boost::system::errc;
 
-		// 检查result
-		std::string result;
-		result.resize(bytes_transfered);
-		m_buffers->sgetn(&result[0], bytes_transfered);
+		state & st = *m_state;
+
+		// 网络错误, 下次再查.
+		if (ec)
+			return false;
+
+		// 检查result, 直接在 buffers 里面找, 不复制.
+		boost::string_ref result = decaptcha::detail::response_data(*st.buffers, bytes_transfered);
 		if ( result == "CAPCHA_NOT_READY")
 		{
 			ec = error::ERROR_CAPCHA_NOT_READY;
 			return false;
 		}
 
-		boost::regex ex("OK\\|([0-9a-zA-Z]*)");
-		boost::cmatch what;
-
- 		if (boost::regex_search(result.c_str(), what, ex))
+		// OK|答案, 批量查询切出来的只有答案.
+		boost::string_ref answer;
+		if (decaptcha::detail::match_all(result, decaptcha::detail::is_ascii_alnum))
+			answer = result;
+ 		if (!answer.empty() || decaptcha::detail::find_span_after(result, "OK|", decaptcha::detail::is_ascii_alnum, answer))
 		{
 			using namespace boost::asio::detail;
-			std::string result_CAPTCHA = what[1];
-			m_io_service.post(
+			st.io_service.post(
 					bind_handler(
-						m_handler,
+						st.handler,
 						boost::system::error_code(),
-						provider,
-						result_CAPTCHA,
-						report_bad_func(m_io_service, m_key, m_host, m_CAPTCHA_ID)
+						st.provider,
+						std::string(answer.begin(), answer.end()),
+						report_bad_func(st.io_service, st.account->key, st.account->host, *st.CAPTCHA_ID)
 					)
 				);
 			return true;
 		}
 		ec = process_error_result(result);
-		stop_tries = true;
+		st.stop_tries = true;
 		return false;
 	}
 
@@ -332,76 +491,78 @@ private:
 	{
  		using namespace boost::system::errc;
 
-		// 检查result
-		std::string result;
-		result.resize(bytes_transfered);
-		m_buffers->sgetn(&result[0], bytes_transfered);
+		state & st = *m_state;
 
-		boost::regex ex("OK\\|([0-9]*)");
-		boost::cmatch what;
+		// 上传出错 (包括超时) 的时候原样交给 handler, 健康统计要看到真正的错误.
+		if (ec)
+		{
+			st.stop_tries = true;
+			return false;
+		}
 
-		if (boost::regex_search(result.c_str(), what, ex))
+		// 检查result, OK|ID
+		boost::string_ref result = decaptcha::detail::response_data(*st.buffers, bytes_transfered);
+		boost::string_ref id;
+
+		if (decaptcha::detail::find_span_after(result, "OK|", decaptcha::detail::is_ascii_digit, id))
 		{
-			* m_CAPTCHA_ID = what[1];
+			st.CAPTCHA_ID->assign(id.begin(), id.end());
 			return true;
 		}
 
 		ec = process_error_result(result);
-		stop_tries = true;
+		st.stop_tries = true;
 		return false;
 	}
 
-	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 1min
+	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 poll_schedule 的 max_wait
 	bool should_try(boost::system::error_code ec)
 	{
-		return stop_tries==false && (m_tries ++ < 5);
+		state & st = *m_state;
+
+		return st.stop_tries==false && st.poll.should_poll();
 	}
 
 private:
-	std::string build_multipart_formdata(const std::string &buffer, const std::string & boundary) const
+	void async_delay(boost::posix_time::time_duration delay)
 	{
-		std::stringstream content_body;
-
-
-		content_body << "------------------------------" << boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"method\"" <<  "\r\n\r\n"
-					 << "post" << "\r\n";
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"key\"" <<  "\r\n\r\n"
-					 << m_key << "\r\n";
+		state & st = *m_state;
 
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"regsense\"" <<  "\r\n\r\n"
-					 << "0" << "\r\n";
+		// 等待的时候不占着连接, 还回连接池给别人用.
+		st.stream.reset();
 
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"file\"; filename=\"vercode.jpeg\"" << "\r\n"
-					 << "Content-Type: image/jpeg" <<  "\r\n\r\n";
-
-		content_body.write(buffer.data(), buffer.length());
-			content_body << "\r\n";
-
-		content_body << "------------------------------" <<  boundary << "--" << "\r\n";
-
-		return content_body.str();
+		st.timer->expires_from_now(delay);
+		st.timer->async_wait(decaptcha::detail::wait_handler<antigate_decoder_op>(*this, st.strand));
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-
-	int m_tries;
-	bool stop_tries;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
+	// 这个验证码所有异步操作的 handler 内存都从 state 里的 arena 分配.
+	friend void * asio_handler_allocate(std::size_t size, antigate_decoder_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
 
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	friend void asio_handler_deallocate(void * pointer, std::size_t, antigate_decoder_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
 
-	boost::shared_ptr<std::string> m_CAPTCHA_ID;
+private:
+	boost::shared_ptr<state> m_state;
+};
 
-	Handler m_handler;
+// 哪些错误说明服务商忙不过来了.
+inline bool is_overload(const boost::system::error_code & ec)
+{
+	return ec == error::ERROR_NO_SLOT_AVAILABLE || decaptcha::detail::is_http_overload(ec);
+}
 
-	const std::string m_key, m_host;
-};
+template<class Handler>
+void start_decoder_op(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account,
+	const std::string * buffer, Handler handler)
+{
+	antigate_decoder_op<Handler> op(io_service, account, *buffer, handler);
+}
 
 } // namespace detail
 } // namespace antigate
@@ -410,22 +571,45 @@ class antigate_decoder{
 public:
 	antigate_decoder(boost::asio::io_service & io_service,
 		const std::string &key, const std::string & host = "http://antigate.com/")
-	  : m_io_service(io_service), m_key(key), m_host(host)
+	  : m_io_service(io_service),
+	    m_account(boost::make_shared<antigate::detail::account_info>(boost::ref(io_service), key, host)),
+	    m_limiter(decaptcha::detail::get_concurrency_limiter(io_service, "antigate"))
 	{
-		if ( * m_host.rbegin() != '/' ){
-			m_host += "/";
-		}
 	}
 
+	// buffer 在 handler 被调用之前必须一直有效.
 	template <class Handler>
 	void operator()(const std::string &buffer, Handler handler)
 	{
-		antigate::detail::antigate_decoder_op<Handler>
-				op(m_io_service, m_key, m_host, buffer, handler);
+		// antigate 不收空的和超过 100KB 的图片, 不用上传就知道结果.
+		boost::system::error_code ec;
+		if (buffer.empty())
+			ec = antigate::error::ERROR_ZERO_CAPTCHA_FILESIZE;
+		else if (buffer.size() > 100 * 1024)
+			ec = antigate::error::ERROR_TOO_BIG_CAPTCHA_FILESIZE;
+		else if (decaptcha::sniff_image_format(buffer) == decaptcha::image_unknown)
+			ec = antigate::error::ERROR_IMAGE_TYPE_NOT_SUPPORTED;
+
+		if (ec)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(
+					handler, ec, std::string("antigate"), std::string(), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
+		// 拿到 antigate 的并发名额才上传, 拿不到就是 provider_busy, 交给下一个解码器.
+		decaptcha::detail::async_limited(m_limiter, &antigate::detail::is_overload, handler,
+			boost::bind(&antigate::detail::start_decoder_op<decaptcha::detail::limited_handler<Handler> >,
+				boost::ref(m_io_service), m_account, &buffer, _1));
 	}
 private:
 	boost::asio::io_service & m_io_service;
-	std::string m_key, m_host;
+	boost::shared_ptr<const antigate::detail::account_info> m_account;
+	// 同一个服务商的所有解码器共用.
+	boost::shared_ptr<concurrency_limiter> m_limiter;
 };
 
 }
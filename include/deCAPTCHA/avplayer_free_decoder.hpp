@@ -24,22 +24,61 @@
 
 #include <boost/avproxy.hpp>
 
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "io_watchdog.hpp"
+#include "streambuf_pool.hpp"
+
 namespace decaptcha{
 namespace decoder{
 namespace detail{
 
 template<class Handler>
 class avplayer_free_decoder_op : boost::asio::coroutine {
+	// 一个验证码的所有状态. op 在每一步异步操作之间被拷贝, 拷贝的只是指向它的指针.
+	struct state : boost::noncopyable
+	{
+		state(boost::asio::io_service & _io_service, const std::string & _buffer, Handler _handler)
+			: io_service(_io_service),
+			  socket(boost::make_shared<boost::asio::ip::tcp::socket>(boost::ref(_io_service))),
+			  buffers(decaptcha::detail::acquire_streambuf(_io_service)),
+			  vercodebuf(_buffer),
+			  handler(_handler),
+			  cancel(get_cancel_token(_handler)),
+			  strand(boost::make_shared<decaptcha::detail::op_strand>(boost::ref(_io_service))),
+			  watchdog(boost::make_shared<decaptcha::detail::io_watchdog<boost::asio::ip::tcp::socket> >(boost::ref(_io_service), strand, socket))
+		{
+		}
+
+		// 异步操作的 handler 内存, 和 state 一起释放.
+		decaptcha::detail::handler_arena arena;
+
+		boost::asio::io_service & io_service;
+
+		boost::shared_ptr<boost::asio::ip::tcp::socket> socket;
+
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		// 和其他解码器一样, 图片在 handler 被调用之前一直有效, 不用复制.
+		const std::string & vercodebuf;
+
+		Handler handler;
+		cancel_token cancel;
+		boost::shared_ptr<decaptcha::detail::op_strand> strand;
+		// 连接, 发送和等待结果都限时. 要用到 socket 和 strand, 放在它们后面.
+		boost::shared_ptr<decaptcha::detail::io_watchdog<boost::asio::ip::tcp::socket> > watchdog;
+	};
+
 public:
 	avplayer_free_decoder_op(boost::asio::io_service & io_service,
 			const std::string &buffer, Handler handler)
-		: m_io_service(io_service),
-		  m_handler(handler),
-		  m_vercodebuf(buffer),
-		  m_socket(boost::make_shared<boost::asio::ip::tcp::socket>(boost::ref(m_io_service))),
-		  m_buffers(boost::make_shared<boost::asio::streambuf>())
+		: m_state(boost::make_shared<state>(boost::ref(io_service), boost::cref(buffer), handler))
 	{
-		avproxy::async_connect(*m_socket, boost::asio::ip::tcp::resolver::query("avlog.avplayer.org", "8013"), *this);
+		state & st = *m_state;
+
+		decaptcha::detail::close_on_cancel(st.cancel, st.strand, st.socket);
+
+		st.watchdog->arm(st.watchdog->timeouts().connect);
+		avproxy::async_connect(*st.socket, boost::asio::ip::tcp::resolver::query("avlog.avplayer.org", "8013"), st.strand->wrap(*this));
 	};
 
 	// 开始!
@@ -47,10 +86,18 @@ public:
 	{
 		using namespace boost::system::errc;
 		using namespace boost::asio;
+
+		state & st = *m_state;
+
+		// 上一步结束了, 超时关闭的连接返回 timed_out.
+		ec = st.watchdog->complete(ec);
+		if (st.cancel.is_canceled())
+			ec = boost::asio::error::operation_aborted;
+
 		if (ec){
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, ec, std::string("avplayer 免费验证码解码服务"), std::string(""), boost::function<void()>()
+					st.handler, ec, std::string("avplayer 免费验证码解码服务"), std::string(""), boost::function<void()>()
 				)
 			);
 			return;
@@ -61,53 +108,61 @@ public:
 
  		BOOST_ASIO_CORO_REENTER(this)
  		{
+			st.watchdog->arm(st.watchdog->timeouts().send);
 			BOOST_ASIO_CORO_YIELD
-				async_write(*m_socket, buffer("c8d1f3b2c5c006cef00a4acdd44ebd32\n", 33), transfer_exactly(33), *this);
+				async_write(*st.socket, buffer("c8d1f3b2c5c006cef00a4acdd44ebd32\n", 33), transfer_exactly(33), st.strand->wrap(*this));
 
-			l = htonl(m_vercodebuf.length());
-			buffer_copy(m_buffers->prepare(4), buffer(&l, 4));
-			m_buffers->commit(4);
+			l = htonl(st.vercodebuf.length());
+			buffer_copy(st.buffers->prepare(4), buffer(&l, 4));
+			st.buffers->commit(4);
 
+			st.watchdog->arm(st.watchdog->timeouts().send);
 			BOOST_ASIO_CORO_YIELD
-				async_write(*m_socket, *m_buffers, transfer_exactly(4), *this);
+				async_write(*st.socket, *st.buffers, transfer_exactly(4), st.strand->wrap(*this));
 
-			m_buffers->consume(bytes_transfered);
-
-			buffer_copy( m_buffers->prepare(m_vercodebuf.length()), buffer(m_vercodebuf, m_vercodebuf.length()));
-			m_buffers->commit(m_vercodebuf.length());
+			st.buffers->consume(bytes_transfered);
 
+			// 图片直接从 vercodebuf 发送, 不再复制进 buffers.
+			st.watchdog->arm(st.watchdog->timeouts().send);
 			BOOST_ASIO_CORO_YIELD
-				async_write(*m_socket, *m_buffers, transfer_all(), *this);
+				async_write(*st.socket, buffer(st.vercodebuf), transfer_all(), st.strand->wrap(*this));
 
+			// 人工识别, 要等一会儿才有结果.
+			st.watchdog->arm(st.watchdog->timeouts().first_byte);
 			BOOST_ASIO_CORO_YIELD
-				async_read(*m_socket, *m_buffers, transfer_exactly(4), *this);
+				async_read(*st.socket, *st.buffers, transfer_exactly(4), st.strand->wrap(*this));
 
 			// 获取
 			strbuf.resize(bytes_transfered);
-			m_buffers->sgetn(&strbuf[0], bytes_transfered);
+			st.buffers->sgetn(&strbuf[0], bytes_transfered);
 
 			if (strbuf.empty())
 				ec = make_error_code(bad_message);
 			else
 				ec = boost::system::error_code();
 
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, ec, std::string("avplayer 免费验证码解码服务"), strbuf, boost::function<void()>()
+					st.handler, ec, std::string("avplayer 免费验证码解码服务"), strbuf, boost::function<void()>()
 				)
 			);
  		}
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-
-	boost::shared_ptr<boost::asio::ip::tcp::socket> m_socket;
+	// 这个验证码所有异步操作的 handler 内存都从 state 里的 arena 分配.
+	friend void * asio_handler_allocate(std::size_t size, avplayer_free_decoder_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
 
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
-	std::string m_vercodebuf;
+	friend void asio_handler_deallocate(void * pointer, std::size_t, avplayer_free_decoder_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
 
-	Handler m_handler;
+private:
+	boost::shared_ptr<state> m_state;
 };
 
 }
@@ -119,6 +174,7 @@ public:
 	{
 	}
 
+	// buffer 在 handler 被调用之前必须一直有效.
 	template <class Handler>
 	void operator()(const std::string &buffer, Handler handler)
 	{
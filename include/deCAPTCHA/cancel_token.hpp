@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/detail/mutex.hpp>
+
+namespace decaptcha{
+
+/*
+ * cancel_token 是一个可以拷贝的取消信号, 拷贝之间共享同一个状态.
+ *
+ * 默认构造的 cancel_token 永远不会被取消, 用 make_cancel_token() 创建一个可以取消的.
+ * 调用 cancel() 后, 所有用 on_cancel() 注册的回调会被立即调用, 且只调用一次.
+ * 可以在任意线程调用, 回调在调用 cancel() 的线程里执行.
+ *
+ * 一个 token 可能在很多次识别之间共用, 一直不取消. 注册的时候给出回调的 owner,
+ * owner 释放之后回调就没用了, 再注册的时候会被清理掉, 不会越攒越多.
+ */
+class cancel_token{
+	struct slot_type{
+		boost::function<void()> slot;
+		boost::weak_ptr<void> owner;
+		bool owned;
+
+		bool expired() const
+		{
+			return owned && owner.expired();
+		}
+	};
+
+	struct impl{
+		// 一个识别通常挂着连接, 定时器和子 token 几个回调, 先留好位置.
+		impl() : canceled(false), prune_at(4) { slots.reserve(4); }
+		boost::asio::detail::mutex mutex;
+		bool canceled;
+		std::vector<slot_type> slots;
+		// 回调攒到这么多的时候清理一次, 清理之后设成剩下的两倍, 平摊下来每次注册 O(1).
+		std::size_t prune_at;
+	};
+
+	explicit cancel_token(boost::shared_ptr<impl> p)
+		: m_impl(p)
+	{
+	}
+
+	static void cancel_child(boost::weak_ptr<impl> child)
+	{
+		cancel_token(child.lock()).cancel();
+	}
+
+	friend cancel_token make_cancel_token();
+	friend cancel_token make_cancel_token(const cancel_token & parent);
+
+public:
+	cancel_token()
+	{
+	}
+
+	void cancel()
+	{
+		if (!m_impl)
+			return;
+
+		// 先换出来, 回调里可能会再注册.
+		std::vector<slot_type> slots;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_impl->mutex);
+			if (m_impl->canceled)
+				return;
+			m_impl->canceled = true;
+			slots.swap(m_impl->slots);
+		}
+
+		for (std::size_t i = 0; i < slots.size(); i++)
+		{
+			if (!slots[i].expired())
+				slots[i].slot();
+		}
+	}
+
+	bool is_canceled() const
+	{
+		if (!m_impl)
+			return false;
+
+		boost::asio::detail::mutex::scoped_lock l(m_impl->mutex);
+		return m_impl->canceled;
+	}
+
+	// 已经取消了的话, slot 会被立即调用. 这样注册的 slot 在 token 取消或者销毁之前一直保留.
+	void on_cancel(const boost::function<void()> & slot) const
+	{
+		slot_type s;
+		s.slot = slot;
+		s.owned = false;
+		add_slot(s);
+	}
+
+	// owner 释放之后 slot 不再调用, 也不再占着位置.
+	void on_cancel(const boost::function<void()> & slot, const boost::weak_ptr<void> & owner) const
+	{
+		slot_type s;
+		s.slot = slot;
+		s.owner = owner;
+		s.owned = true;
+		add_slot(s);
+	}
+
+	void swap(cancel_token & other)
+	{
+		m_impl.swap(other.m_impl);
+	}
+
+private:
+	void add_slot(const slot_type & s) const
+	{
+		if (!m_impl)
+			return;
+
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_impl->mutex);
+			if (!m_impl->canceled)
+			{
+				std::vector<slot_type> & slots = m_impl->slots;
+				if (slots.size() >= m_impl->prune_at)
+				{
+					slots.erase(std::remove_if(slots.begin(), slots.end(),
+						boost::bind(&slot_type::expired, _1)), slots.end());
+					m_impl->prune_at = (std::max)(slots.size() * 2, std::size_t(4));
+				}
+				slots.push_back(s);
+				return;
+			}
+		}
+		if (!s.expired())
+			s.slot();
+	}
+
+private:
+	boost::shared_ptr<impl> m_impl;
+};
+
+inline cancel_token make_cancel_token()
+{
+	return cancel_token(boost::make_shared<cancel_token::impl>());
+}
+
+// 创建一个子 token, parent 被取消的时候子 token 也会被取消, 反之不会.
+inline cancel_token make_cancel_token(const cancel_token & parent)
+{
+	cancel_token child = make_cancel_token();
+	parent.on_cancel(
+		boost::function<void()>(
+			boost::bind(&cancel_token::cancel_child, boost::weak_ptr<cancel_token::impl>(child.m_impl))
+		),
+		child.m_impl
+	);
+	return child;
+}
+
+/*
+ * 解码器通过 get_cancel_token(handler) 获取 handler 所关联的 cancel_token.
+ *
+ * 和 asio_handler_invoke 一样, 这是一个通过 ADL 查找的 hook,
+ * deCAPTCHA 传给解码器的 handler 会重载这个函数. 其他 handler 则永远不会被取消.
+ */
+template<class Handler>
+cancel_token get_cancel_token(const Handler &)
+{
+	return cancel_token();
+}
+
+namespace detail{
+
+typedef boost::asio::io_service::strand op_strand;
+
+template<class Stream>
+struct close_on_cancel_op
+{
+	close_on_cancel_op(boost::shared_ptr<Stream> stream)
+		: m_stream(stream)
+	{
+	}
+
+	void operator()()
+	{
+		if (boost::shared_ptr<Stream> stream = m_stream.lock())
+		{
+			boost::system::error_code ignore_ec;
+			stream->close(ignore_ec);
+		}
+	}
+
+	boost::weak_ptr<Stream> m_stream;
+};
+
+template<class Timer>
+struct cancel_on_cancel_op
+{
+	cancel_on_cancel_op(boost::shared_ptr<Timer> timer)
+		: m_timer(timer)
+	{
+	}
+
+	void operator()()
+	{
+		if (boost::shared_ptr<Timer> timer = m_timer.lock())
+		{
+			boost::system::error_code ignore_ec;
+			timer->cancel(ignore_ec);
+		}
+	}
+
+	boost::weak_ptr<Timer> m_timer;
+};
+
+// cancel() 可能在别的线程调用, 转到 op 的 strand 里执行, 不和 op 自己的 handler 同时访问 stream.
+template<class Op>
+struct dispatch_on_cancel_op
+{
+	dispatch_on_cancel_op(boost::shared_ptr<op_strand> strand, const Op & op)
+		: m_strand(strand), m_op(op)
+	{
+	}
+
+	void operator()()
+	{
+		m_strand->dispatch(m_op);
+	}
+
+	boost::shared_ptr<op_strand> m_strand;
+	Op m_op;
+};
+
+// 取消的时候关闭 stream, 让挂在上面的异步操作立即返回.
+template<class Stream>
+void close_on_cancel(const cancel_token & token, boost::shared_ptr<op_strand> strand, boost::shared_ptr<Stream> stream)
+{
+	token.on_cancel(dispatch_on_cancel_op<close_on_cancel_op<Stream> >(strand, close_on_cancel_op<Stream>(stream)), stream);
+}
+
+// 取消的时候取消 timer.
+template<class Timer>
+void cancel_on_cancel(const cancel_token & token, boost::shared_ptr<op_strand> strand, boost::shared_ptr<Timer> timer)
+{
+	token.on_cancel(dispatch_on_cancel_op<cancel_on_cancel_op<Timer> >(strand, cancel_on_cancel_op<Timer>(timer)), timer);
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -20,18 +20,19 @@
 #include <string>
 #include <fstream>
 #include <boost/asio.hpp>
-#include <boost/regex.hpp>
+
+#include "cancel_token.hpp"
+#include "response_parser.hpp"
 
 namespace decaptcha{
 namespace decoder{
 
 namespace detail{
 
-inline bool is_vc(std::string str)
+// 4 个字母或者数字.
+inline bool is_vc(const std::string & str)
 {
-	boost::cmatch what;
-	boost::regex ex("[a-z0-9A-Z][a-z0-9A-Z][a-z0-9A-Z][a-z0-9A-Z]");
-	return boost::regex_match(str.c_str(), what, ex);
+	return str.length() == 4 && decaptcha::detail::match_all(str, decaptcha::detail::is_ascii_alnum);
 }
 
 template<class Sender, class AsyncInputer, class Handler>
@@ -40,7 +41,8 @@ public:
 	channel_friend_decoder_op(boost::asio::io_service & io_service,
 			Sender sender, AsyncInputer async_inputer,
 			const std::string & buffer, Handler handler)
-		: m_io_service(io_service), m_sender(sender), m_async_inputer(async_inputer), m_handler(handler)
+		: m_io_service(io_service), m_sender(sender), m_async_inputer(async_inputer), m_handler(handler),
+		  m_cancel(get_cancel_token(handler))
 	{
 		// send to xmpp and irc.
 		// 向 频道广播消息.
@@ -65,6 +67,18 @@ public:
 	void operator()(error_code ec, std::string str)
 	{
 		std::string tmp;
+
+		// 输入是外部的, 没法中断, 只能等输入回来以后不再继续等下去.
+		if (m_cancel.is_canceled())
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(
+					m_handler, boost::system::error_code(boost::asio::error::operation_aborted), std::string("IRC/XMPP 好友辅助验证码解码器"), std::string(), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
 		BOOST_ASIO_CORO_REENTER(this)
 		{
 			while (!ec){
@@ -99,21 +113,20 @@ public:
 		}
 	}
 private:
-	bool check_qqbot_vc(std::string message, std::string & out)
+	// 整条消息是 ".qqbot vc XXXX", 开头的 . 可以是任意字符.
+	bool check_qqbot_vc(const std::string & message, std::string & out)
 	{
-		boost::cmatch what;
-		static boost::regex ex(".qqbot vc ([^ ]*)");
-		std::string _vccode;
+		boost::string_ref text(message);
 
-		if(boost::regex_match(message.c_str(), what, ex))
-		{
-			_vccode = what[1];
+		if (text.size() < 1 || !text.substr(1).starts_with("qqbot vc "))
+			return false;
 
-			if(_vccode.length() == 4)
-			{
-				out = _vccode;
-				return true;
-			}
+		boost::string_ref _vccode = text.substr(10);
+
+		if(_vccode.length() == 4 && _vccode.find(' ') == boost::string_ref::npos)
+		{
+			out.assign(_vccode.begin(), _vccode.end());
+			return true;
 		}
 
 		return false;
@@ -123,6 +136,7 @@ private:
 	Sender m_sender;
 	AsyncInputer m_async_inputer;
 	Handler m_handler;
+	cancel_token m_cancel;
 };
 
 }
@@ -0,0 +1,688 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <cmath>
+#include <deque>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#if defined(__AVX512BW__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "cancel_token.hpp"
+#include "decoder_health.hpp"
+#include "gray_image.hpp"
+
+#ifndef BOOST_SYSTEM_NOEXCEPT
+  #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
+#endif
+
+namespace decaptcha{
+namespace decoder{
+namespace cnn{
+namespace detail {
+	class error_category_impl;
+}
+
+template<class error_category>
+const boost::system::error_category& error_category_single()
+{
+	static error_category error_category_instance;
+	return reinterpret_cast<const boost::system::error_category&>(error_category_instance);
+}
+
+inline const boost::system::error_category& error_category()
+{
+	return error_category_single<detail::error_category_impl>();
+}
+
+namespace error{
+enum errc_t{
+	model_not_loaded = 1,
+	image_not_supported,
+	low_confidence,
+};
+
+inline boost::system::error_code make_error_code(errc_t e)
+{
+	return boost::system::error_code(static_cast<int>(e), error_category());
+}
+
+} // namespace error
+} // namespace cnn
+} // namespace decoder
+} // namespace decaptcha
+
+namespace boost {
+namespace system {
+
+template <>
+struct is_error_code_enum<decaptcha::decoder::cnn::error::errc_t>
+{
+  static const bool value = true;
+};
+
+} // namespace system
+} // namespace boost
+
+namespace decaptcha{
+namespace decoder{
+namespace cnn{
+namespace detail{
+
+class error_category_impl
+  : public boost::system::error_category
+{
+	virtual const char* name() const BOOST_SYSTEM_NOEXCEPT
+	{
+		return "cnn decoder";
+	}
+
+	virtual std::string message(int e) const
+	{
+		switch (e)
+		{
+		case error::model_not_loaded:
+			return "no usable model file was loaded";
+		case error::image_not_supported:
+			return "image format is not supported by the cnn decoder";
+		case error::low_confidence:
+			return "recognition confidence is too low";
+		default:
+			return "cnn decoder ERROR";
+		}
+	}
+
+	// 没把握, 认不出图片, 模型没加载, 都是交给下一个解码器的正常情况, 不计入熔断.
+	virtual boost::system::error_condition default_error_condition(int e) const BOOST_SYSTEM_NOEXCEPT
+	{
+		switch (e)
+		{
+		case error::model_not_loaded:
+		case error::image_not_supported:
+		case error::low_confidence:
+			return health_error::not_provider_fault;
+		default:
+			return boost::system::error_condition(e, *this);
+		}
+	}
+};
+
+// int8 向量点积, 累加到 int32. 编译器打开 AVX-512BW 或 AVX2 的时候用对应的指令.
+inline boost::int32_t dot_s8(const signed char * a, const signed char * b, std::size_t n)
+{
+	std::size_t i = 0;
+	boost::int32_t sum = 0;
+#if defined(__AVX512BW__)
+	__m512i acc = _mm512_setzero_si512();
+	for (; i + 32 <= n; i += 32)
+	{
+		__m512i a16 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+		__m512i b16 = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+		acc = _mm512_add_epi32(acc, _mm512_madd_epi16(a16, b16));
+	}
+	sum = _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i a16 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+		__m256i b16 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a16, b16));
+	}
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_hadd_epi32(s, s);
+	s = _mm_hadd_epi32(s, s);
+	sum = _mm_cvtsi128_si32(s);
+#endif
+	for (; i < n; i++)
+		sum += static_cast<boost::int32_t>(a[i]) * b[i];
+	return sum;
+}
+
+inline signed char quantize(float v, float scale)
+{
+	float q = v / scale;
+	q = q > 127.0f ? 127.0f : (q < -127.0f ? -127.0f : q);
+	return static_cast<signed char>(q < 0 ? q - 0.5f : q + 0.5f);
+}
+
+struct layer{
+	enum { conv = 1, dense = 2 };
+
+	int type;
+	std::size_t in, out, k;
+	// 卷积层: 后面接 2x2 最大池化. 全连接层: 后面接 ReLU.
+	bool flag;
+	float in_scale;
+	std::vector<float> w_scale, bias;
+	// out 行, 每行 k 个. 卷积层的 k = in * 3 * 3, 按 (通道, 行, 列) 排列.
+	std::vector<signed char> weights;
+};
+
+/*
+ * int8 量化的卷积网络.
+ *
+ * 模型文件 (小端):
+ *   "DCNN" u32 版本(1) u32 输入宽 u32 输入高 u32 字符数 u32 字符集大小 字符集
+ *   u32 层数, 每层 u32 类型 u32 输入 u32 输出 u32 标志 f32 输入量化系数
+ *   f32[输出] 权重量化系数 f32[输出] 偏置 i8[输出 * k] 权重
+ *
+ * 输入是灰度值 / 255, 量化系数固定为 1 / 127. 卷积层都是 3x3, 补零, 步长 1, 后接 ReLU.
+ * 最后一层必须是全连接层, 输出 字符数 x 字符集大小 个 logit.
+ */
+class model : boost::noncopyable{
+public:
+	model()
+		: m_width(0), m_height(0), m_length(0)
+	{
+	}
+
+	bool load(const std::string & filename)
+	{
+		std::ifstream file(filename.c_str(), std::ifstream::binary);
+		char magic[4];
+		if (!file.read(magic, 4) || std::string(magic, 4) != "DCNN" || read_u32(file) != 1)
+			return false;
+
+		m_width = read_u32(file);
+		m_height = read_u32(file);
+		m_length = read_u32(file);
+		std::size_t charset_size = read_u32(file);
+		// 文件截断或者损坏的时候, 大小字段可能是任意值, 先和剩下的字节数比较再分配.
+		if (!file || m_width == 0 || m_height == 0 || m_length == 0 || charset_size == 0
+			|| m_width > decaptcha::detail::max_image_dimension || m_height > decaptcha::detail::max_image_dimension
+			|| charset_size > 256 || charset_size > remaining(file))
+			return false;
+		m_charset.resize(charset_size);
+		file.read(&m_charset[0], m_charset.size());
+
+		std::size_t count = read_u32(file);
+		std::size_t channels = 1, height = m_height, width = m_width;
+		m_layers.clear();
+		for (std::size_t i = 0; file && i < count; i++)
+		{
+			layer l;
+			l.type = read_u32(file);
+			l.in = read_u32(file);
+			l.out = read_u32(file);
+			l.flag = read_u32(file) & 1;
+			file.read(reinterpret_cast<char*>(&l.in_scale), sizeof(float));
+
+			if (l.type == layer::conv)
+			{
+				if (l.in != channels || height == 0 || (l.flag && (height < 2 || width < 2)))
+					return false;
+				l.k = l.in * 9;
+				channels = l.out;
+				if (l.flag)
+				{
+					height /= 2;
+					width /= 2;
+				}
+			}
+			else if (l.type == layer::dense)
+			{
+				if (l.in != channels * height * width)
+					return false;
+				l.k = l.in;
+				channels = l.out;
+				height = width = 1;
+			}
+			else
+			{
+				return false;
+			}
+
+			if (l.out == 0 || l.k > (1u << 20) || l.out > (1u << 16))
+				return false;
+
+			// 权重量化系数和偏置各 out 个 float, 权重 out * k 字节, 分开比较免得乘法溢出.
+			std::size_t left = remaining(file);
+			if (!file || l.out > left / (2 * sizeof(float)) || l.k > (left - l.out * 2 * sizeof(float)) / l.out)
+				return false;
+
+			l.w_scale.resize(l.out);
+			l.bias.resize(l.out);
+			l.weights.resize(l.out * l.k);
+			file.read(reinterpret_cast<char*>(&l.w_scale[0]), l.out * sizeof(float));
+			file.read(reinterpret_cast<char*>(&l.bias[0]), l.out * sizeof(float));
+			file.read(reinterpret_cast<char*>(&l.weights[0]), l.weights.size());
+			m_layers.push_back(l);
+		}
+
+		return file && !m_layers.empty() && m_layers.back().type == layer::dense
+			&& m_layers.back().out == m_length * m_charset.size();
+	}
+
+	std::size_t width() const { return m_width; }
+	std::size_t height() const { return m_height; }
+	std::size_t length() const { return m_length; }
+	const std::string & charset() const { return m_charset; }
+
+	/*
+	 * 一次推理一批图片, 图片已经缩放到输入大小.
+	 * 同一层的权重一行一行地和整批的数据做点积, 权重只从内存里读一次.
+	 */
+	void forward(const std::vector<gray_image> & images, std::vector<float> & logits) const
+	{
+		std::size_t batch = images.size();
+		std::size_t channels = 1, height = m_height, width = m_width;
+
+		std::vector<signed char> act(batch * height * width), next, cols;
+		for (std::size_t b = 0; b < batch; b++)
+			for (std::size_t i = 0; i < height * width; i++)
+				act[b * height * width + i] = static_cast<signed char>((images[b].pixels[i] * 127 + 127) / 255);
+
+		for (std::size_t n = 0; n < m_layers.size(); n++)
+		{
+			const layer & l = m_layers[n];
+			bool last = n + 1 == m_layers.size();
+			float next_scale = last ? 1.0f : m_layers[n + 1].in_scale;
+
+			if (l.type == layer::conv)
+			{
+				std::size_t pixels = height * width;
+				im2col(act, batch, channels, height, width, cols);
+
+				next.resize(batch * l.out * pixels);
+				for (std::size_t o = 0; o < l.out; o++)
+				{
+					const signed char * w = &l.weights[o * l.k];
+					float scale = l.in_scale * l.w_scale[o];
+					for (std::size_t r = 0; r < batch * pixels; r++)
+					{
+						float v = dot_s8(w, &cols[r * l.k], l.k) * scale + l.bias[o];
+						std::size_t b = r / pixels, p = r % pixels;
+						next[(b * l.out + o) * pixels + p] = quantize(v > 0 ? v : 0, next_scale);
+					}
+				}
+
+				channels = l.out;
+				if (l.flag)
+				{
+					max_pool(next, batch * channels, height, width, act);
+					height /= 2;
+					width /= 2;
+				}
+				else
+				{
+					act.swap(next);
+				}
+			}
+			else
+			{
+				if (last)
+					logits.resize(batch * l.out);
+				else
+					next.resize(batch * l.out);
+
+				for (std::size_t o = 0; o < l.out; o++)
+				{
+					const signed char * w = &l.weights[o * l.k];
+					float scale = l.in_scale * l.w_scale[o];
+					for (std::size_t b = 0; b < batch; b++)
+					{
+						float v = dot_s8(w, &act[b * l.k], l.k) * scale + l.bias[o];
+						if (last)
+							logits[b * l.out + o] = v;
+						else
+							next[b * l.out + o] = quantize(l.flag && v < 0 ? 0 : v, next_scale);
+					}
+				}
+
+				act.swap(next);
+				channels = l.out;
+				height = width = 1;
+			}
+		}
+	}
+
+private:
+	// 文件里还剩多少字节没读.
+	static std::size_t remaining(std::istream & file)
+	{
+		std::istream::pos_type pos = file.tellg();
+		if (pos < 0)
+			return 0;
+		file.seekg(0, std::istream::end);
+		std::istream::pos_type end = file.tellg();
+		file.seekg(pos);
+		return end < pos ? 0 : static_cast<std::size_t>(end - pos);
+	}
+
+	static std::size_t read_u32(std::istream & file)
+	{
+		unsigned char b[4] = { 0 };
+		file.read(reinterpret_cast<char*>(b), 4);
+		return b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<boost::uint32_t>(b[3]) << 24);
+	}
+
+	// 每个输出像素一行, 一行是它的 3x3 邻域, 这样卷积就是权重行和数据行的点积.
+	static void im2col(const std::vector<signed char> & act, std::size_t batch,
+		std::size_t channels, std::size_t height, std::size_t width, std::vector<signed char> & cols)
+	{
+		std::size_t k = channels * 9, pixels = height * width;
+		cols.assign(batch * pixels * k, 0);
+		for (std::size_t b = 0; b < batch; b++)
+		{
+			const signed char * src = &act[b * channels * pixels];
+			for (std::size_t y = 0; y < height; y++)
+			{
+				for (std::size_t x = 0; x < width; x++)
+				{
+					signed char * row = &cols[(b * pixels + y * width + x) * k];
+					for (std::size_t c = 0; c < channels; c++)
+					{
+						for (int ky = 0; ky < 3; ky++)
+						{
+							long yy = static_cast<long>(y) + ky - 1;
+							if (yy < 0 || yy >= static_cast<long>(height))
+								continue;
+							for (int kx = 0; kx < 3; kx++)
+							{
+								long xx = static_cast<long>(x) + kx - 1;
+								if (xx >= 0 && xx < static_cast<long>(width))
+									row[c * 9 + ky * 3 + kx] = src[(c * height + yy) * width + xx];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	static void max_pool(const std::vector<signed char> & src, std::size_t planes,
+		std::size_t height, std::size_t width, std::vector<signed char> & dst)
+	{
+		std::size_t h = height / 2, w = width / 2;
+		dst.resize(planes * h * w);
+		for (std::size_t p = 0; p < planes; p++)
+		{
+			const signed char * s = &src[p * height * width];
+			for (std::size_t y = 0; y < h; y++)
+			{
+				for (std::size_t x = 0; x < w; x++)
+				{
+					const signed char * q = s + 2 * y * width + 2 * x;
+					dst[(p * h + y) * w + x] = (std::max)((std::max)(q[0], q[1]), (std::max)(q[width], q[width + 1]));
+				}
+			}
+		}
+	}
+
+private:
+	std::size_t m_width, m_height, m_length;
+	std::string m_charset;
+	std::vector<layer> m_layers;
+};
+
+/*
+ * 推理引擎, 自己一个线程.
+ *
+ * 验证码提交进队列, 工作线程每次把队列里的 (最多 max_batch 个) 一起解码, 缩放, 推理,
+ * 然后调用每个验证码的 completion. 这样 io_service 的线程从来不做计算.
+ * 析构的时候等队列里已经提交的都处理完再退出线程.
+ *
+ * completion 里拿着 handler, handler 可能间接拿着 engine 自己 (deCAPTCHA 的设置里有 cnn_decoder),
+ * 所以 engine 可能在工作线程里析构. 队列和模型由工作线程共同持有,
+ * 在工作线程里析构的时候不能 join 自己, 只通知它停下, 它处理完剩下的再自己退出.
+ */
+class engine : boost::noncopyable{
+public:
+	typedef boost::function<void (boost::system::error_code, const std::string &)> completion;
+
+	engine(boost::shared_ptr<const model> m, std::size_t max_batch)
+		: m_queue(boost::make_shared<queue>(m, max_batch)),
+		  m_thread(boost::bind(&engine::run, m_queue))
+	{
+	}
+
+	~engine()
+	{
+		{
+			boost::mutex::scoped_lock l(m_queue->mutex);
+			m_queue->stop = true;
+		}
+		m_queue->cond.notify_all();
+
+		if (boost::this_thread::get_id() == m_thread.get_id())
+			m_thread.detach();
+		else
+			m_thread.join();
+	}
+
+	// 排队的时候 cancel 被取消了的话, 推理之前就以 operation_aborted 结束, 不占这一批的位置.
+	void submit(const std::string & buffer, float min_confidence, const cancel_token & cancel, const completion & done)
+	{
+		job j;
+		j.buffer = buffer;
+		j.min_confidence = min_confidence;
+		j.cancel = cancel;
+		j.done = done;
+		{
+			boost::mutex::scoped_lock l(m_queue->mutex);
+			m_queue->jobs.push_back(j);
+		}
+		m_queue->cond.notify_one();
+	}
+
+private:
+	struct job{
+		std::string buffer;
+		float min_confidence;
+		cancel_token cancel;
+		completion done;
+	};
+
+	struct queue : boost::noncopyable{
+		queue(boost::shared_ptr<const model> m, std::size_t max_batch)
+			: network(m), max_batch((std::max)(max_batch, std::size_t(1))), stop(false)
+		{
+		}
+
+		const boost::shared_ptr<const model> network;
+		const std::size_t max_batch;
+
+		boost::mutex mutex;
+		boost::condition_variable cond;
+		std::deque<job> jobs;
+		bool stop;
+	};
+
+	static void run(boost::shared_ptr<queue> q)
+	{
+		for (;;)
+		{
+			// 每一批的 completion 在锁外面释放, 释放的时候可能析构 engine.
+			std::vector<job> batch;
+			{
+				boost::mutex::scoped_lock l(q->mutex);
+				while (!q->stop && q->jobs.empty())
+					q->cond.wait(l);
+				if (q->jobs.empty())
+					return;
+				while (!q->jobs.empty() && batch.size() < q->max_batch)
+				{
+					batch.push_back(q->jobs.front());
+					q->jobs.pop_front();
+				}
+			}
+			process(*q->network, batch);
+		}
+	}
+
+	static void process(const model & m, std::vector<job> & batch)
+	{
+		std::vector<gray_image> images;
+		std::vector<job*> jobs;
+
+		for (std::size_t i = 0; i < batch.size(); i++)
+		{
+			if (batch[i].cancel.is_canceled())
+			{
+				batch[i].done(boost::asio::error::operation_aborted, std::string());
+				continue;
+			}
+
+			gray_image image;
+			if (!decode_image(batch[i].buffer, image))
+			{
+				batch[i].done(error::image_not_supported, std::string());
+				continue;
+			}
+			images.push_back(gray_image());
+			resize_image(image, m.width(), m.height(), images.back());
+			jobs.push_back(&batch[i]);
+		}
+
+		if (images.empty())
+			return;
+
+		std::vector<float> logits;
+		m.forward(images, logits);
+
+		std::size_t classes = m.charset().size();
+		for (std::size_t i = 0; i < jobs.size(); i++)
+		{
+			std::string answer;
+			float confidence = 1.0f;
+			for (std::size_t p = 0; p < m.length(); p++)
+			{
+				const float * l = &logits[(i * m.length() + p) * classes];
+				std::size_t best = std::max_element(l, l + classes) - l;
+
+				// softmax 之后最大的那个概率.
+				float sum = 0;
+				for (std::size_t c = 0; c < classes; c++)
+					sum += std::exp(l[c] - l[best]);
+
+				confidence = (std::min)(confidence, 1.0f / sum);
+				answer += m.charset()[best];
+			}
+
+			if (confidence < jobs[i]->min_confidence)
+				jobs[i]->done(error::low_confidence, std::string());
+			else
+				jobs[i]->done(boost::system::error_code(), answer);
+		}
+	}
+
+private:
+	boost::shared_ptr<queue> m_queue;
+	boost::thread m_thread;
+};
+
+// 在推理线程里调用, 把结果 post 回 io_service.
+template <class Handler>
+struct post_result{
+	post_result(boost::asio::io_service & io_service, const Handler & handler)
+		: io_service(io_service), handler(handler)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, const std::string & answer)
+	{
+		io_service.post(
+			boost::asio::detail::bind_handler(
+				handler, ec, std::string("CNN识别"), answer, boost::function<void()>()
+			)
+		);
+	}
+
+	boost::asio::io_service & io_service;
+	Handler handler;
+};
+
+} // namespace detail
+} // namespace cnn
+
+/*
+ * cnn_decoder 用 int8 量化的卷积网络在本地识别验证码, 不花钱.
+ *
+ * 构造的时候加载模型文件, 启动一个推理线程. 同时提交的验证码会合并成一批推理.
+ * 整个识别过程在推理线程里做, 不会阻塞 io_service, 结果 post 回 io_service.
+ *
+ * 每个字符 softmax 后的概率都不低于 min_confidence 才算识别成功,
+ * 否则返回 low_confidence, deCAPTCHA 接着交给下一个解码器, 所以要放在打码服务前面.
+ * 模型加载失败的时候每次都返回 model_not_loaded.
+ */
+class cnn_decoder{
+public:
+	cnn_decoder(boost::asio::io_service & io_service, const std::string & model_file, std::size_t max_batch = 32)
+		: m_io_service(io_service), m_min_confidence(0.6f)
+	{
+		boost::shared_ptr<cnn::detail::model> m = boost::make_shared<cnn::detail::model>();
+		if (m->load(model_file))
+			m_engine = boost::make_shared<cnn::detail::engine>(m, max_batch);
+	}
+
+	bool is_open() const
+	{
+		return !!m_engine;
+	}
+
+	// 在 add_decoder 之前设置.
+	void set_min_confidence(float min_confidence)
+	{
+		m_min_confidence = min_confidence;
+	}
+
+	template <class Handler>
+	void operator()(const std::string &buffer, Handler handler)
+	{
+		boost::system::error_code ec;
+		cancel_token cancel = get_cancel_token(handler);
+		if (cancel.is_canceled())
+			ec = boost::asio::error::operation_aborted;
+		else if (!m_engine)
+			ec = cnn::error::model_not_loaded;
+
+		if (ec)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(
+					handler, ec, std::string("CNN识别"), std::string(), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
+		m_engine->submit(buffer, m_min_confidence, cancel, cnn::detail::post_result<Handler>(m_io_service, handler));
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	boost::shared_ptr<cnn::detail::engine> m_engine;
+	float m_min_confidence;
+};
+
+}
+}
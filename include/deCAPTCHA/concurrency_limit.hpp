@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <map>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "cancel_token.hpp"
+
+#ifndef BOOST_SYSTEM_NOEXCEPT
+  #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
+#endif
+
+namespace decaptcha{
+namespace concurrency_error{
+namespace detail {
+	class error_category_impl;
+}
+
+template<class error_category>
+const boost::system::error_category& error_category_single()
+{
+	static error_category error_category_instance;
+	return reinterpret_cast<const boost::system::error_category&>(error_category_instance);
+}
+
+inline const boost::system::error_category& error_category()
+{
+	return error_category_single<detail::error_category_impl>();
+}
+
+enum errc_t{
+	provider_busy = 1,
+};
+
+inline boost::system::error_code make_error_code(errc_t e)
+{
+	return boost::system::error_code(static_cast<int>(e), error_category());
+}
+
+} // namespace concurrency_error
+} // namespace decaptcha
+
+namespace boost {
+namespace system {
+
+template <>
+struct is_error_code_enum<decaptcha::concurrency_error::errc_t>
+{
+  static const bool value = true;
+};
+
+} // namespace system
+} // namespace boost
+
+namespace decaptcha{
+namespace concurrency_error{
+namespace detail{
+
+class error_category_impl
+  : public boost::system::error_category
+{
+	virtual const char* name() const BOOST_SYSTEM_NOEXCEPT
+	{
+		return "provider concurrency";
+	}
+
+	virtual std::string message(int e) const
+	{
+		switch (e)
+		{
+		case provider_busy:
+			return "provider is at its concurrency limit, captcha spilled to the next decoder";
+		default:
+			return "provider concurrency ERROR";
+		}
+	}
+};
+
+} // namespace detail
+} // namespace concurrency_error
+
+// 一个服务商的并发限制参数.
+struct limit_config{
+	limit_config()
+		: initial_limit(8), min_limit(1), max_limit(128), backoff(0.5), latency_tolerance(2.0),
+		  max_queue(32), max_queue_wait(boost::posix_time::seconds(2))
+	{
+	}
+
+	double initial_limit, min_limit, max_limit;
+	// 过载的时候 limit 乘以 backoff.
+	double backoff;
+	// 最近的耗时超过基线的这么多倍, 也当作过载.
+	double latency_tolerance;
+	// 超过 limit 的验证码最多排队 max_queue 个, 每个最多等 max_queue_wait,
+	// 排不上或者等太久的返回 concurrency_error::provider_busy, deCAPTCHA 就交给下一个解码器.
+	std::size_t max_queue;
+	boost::posix_time::time_duration max_queue_wait;
+};
+
+/*
+ * concurrency_limiter 按 AIMD 调整对一个服务商同时进行的验证码个数.
+ *
+ * 每个验证码完成的时候报告结果: 服务商说忙 (antigate 的 ERROR_NO_SLOT_AVAILABLE, HTTP 5xx),
+ * 或者最近的耗时明显高于基线, 就把 limit 乘以 backoff; 正常完成而且 limit 真的用满了,
+ * 每完成 limit 个加 1. 同一批过载只减一次, 免得一次高峰把 limit 砍到底.
+ * 这样并发数停在服务商实际的容量附近, 而不是一会儿全失败一会儿闲着.
+ *
+ * 所有的解码器 op 共用, 可以在多个线程里同时使用.
+ */
+class concurrency_limiter
+	: public boost::enable_shared_from_this<concurrency_limiter>, boost::noncopyable{
+public:
+	typedef boost::function<void (boost::system::error_code)> acquire_handler;
+
+	enum outcome{
+		// 正常完成, 不管答案对不对.
+		outcome_ok,
+		// 服务商过载.
+		outcome_overloaded,
+		// 取消或者其他和服务商负载无关的失败, 只还回名额.
+		outcome_ignored,
+	};
+
+private:
+	struct waiter{
+		acquire_handler handler;
+		cancel_token cancel;
+		boost::posix_time::ptime deadline;
+
+		// 在队列里挪动的时候交换而不是拷贝, handler 拷贝一次就要分配一次内存.
+		void swap(waiter & other)
+		{
+			handler.swap(other.handler);
+			cancel.swap(other.cancel);
+			std::swap(deadline, other.deadline);
+		}
+	};
+
+public:
+	concurrency_limiter(boost::asio::io_service & io_service, const std::string & name, const limit_config & config = limit_config())
+		: m_io_service(io_service), m_name(name), m_config(config), m_limit(config.initial_limit), m_in_flight(0),
+		  m_recent_latency(0), m_baseline_latency(0), m_sweep_timer(io_service), m_sweeping(false)
+	{
+	}
+
+	const std::string & name() const
+	{
+		return m_name;
+	}
+
+	void set_config(const limit_config & config)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_config = config;
+		m_limit = (std::min)((std::max)(m_limit, config.min_limit), config.max_limit);
+	}
+
+	double limit() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_limit;
+	}
+
+	std::size_t in_flight() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_in_flight;
+	}
+
+	std::size_t queued() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_waiters.size();
+	}
+
+	// 拿一个名额. 拿到了 handler 收到空的 ec, 之后必须调用一次 release.
+	void async_acquire(const cancel_token & cancel, const acquire_handler & handler)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		if (m_waiters.empty() && m_in_flight < static_cast<std::size_t>(m_limit))
+		{
+			m_in_flight ++;
+			m_io_service.post(boost::asio::detail::bind_handler(handler, boost::system::error_code()));
+			return;
+		}
+
+		if (m_waiters.size() >= m_config.max_queue)
+		{
+			m_io_service.post(boost::asio::detail::bind_handler(handler,
+				boost::system::error_code(concurrency_error::provider_busy)));
+			return;
+		}
+
+		m_waiters.push_back(waiter());
+		waiter & w = m_waiters.back();
+		w.handler = handler;
+		w.cancel = cancel;
+		w.deadline = now() + m_config.max_queue_wait;
+
+		if (!m_sweeping)
+		{
+			m_sweeping = true;
+			start_sweep();
+		}
+	}
+
+	void release(outcome o, boost::posix_time::time_duration latency)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		std::size_t was_in_flight = m_in_flight;
+		m_in_flight --;
+
+		if (o == outcome_ok)
+		{
+			double ms = static_cast<double>(latency.total_milliseconds());
+			if (m_baseline_latency == 0)
+				m_baseline_latency = m_recent_latency = ms;
+			m_recent_latency += (ms - m_recent_latency) * 0.3;
+			m_baseline_latency += (ms - m_baseline_latency) * 0.02;
+
+			if (m_recent_latency > m_baseline_latency * m_config.latency_tolerance)
+				decrease();
+			else if (was_in_flight >= static_cast<std::size_t>(m_limit) || !m_waiters.empty())
+				m_limit = (std::min)(m_limit + 1 / m_limit, m_config.max_limit);
+		}
+		else if (o == outcome_overloaded)
+		{
+			decrease();
+		}
+
+		grant_waiters();
+	}
+
+private:
+	static boost::posix_time::ptime now()
+	{
+		return boost::posix_time::microsec_clock::universal_time();
+	}
+
+	void decrease()
+	{
+		// 上次减少之后发出去的请求还没回来, 这次过载多半还是同一批造成的.
+		boost::posix_time::ptime t = now();
+		boost::posix_time::time_duration hold = boost::posix_time::milliseconds(static_cast<boost::int64_t>(m_recent_latency));
+		if (!m_last_decrease.is_special() && t - m_last_decrease < hold)
+			return;
+
+		m_last_decrease = t;
+		m_limit = (std::max)(m_limit * m_config.backoff, m_config.min_limit);
+	}
+
+	void grant_waiters()
+	{
+		while (!m_waiters.empty() && m_in_flight < static_cast<std::size_t>(m_limit))
+		{
+			waiter w;
+			w.swap(m_waiters.front());
+			m_waiters.pop_front();
+
+			if (w.cancel.is_canceled())
+			{
+				m_io_service.post(boost::asio::detail::bind_handler(w.handler,
+					boost::system::error_code(boost::asio::error::operation_aborted)));
+				continue;
+			}
+
+			m_in_flight ++;
+			m_io_service.post(boost::asio::detail::bind_handler(w.handler, boost::system::error_code()));
+		}
+	}
+
+	void start_sweep()
+	{
+		m_sweep_timer.expires_from_now(boost::posix_time::milliseconds(100));
+		m_sweep_timer.async_wait(boost::bind(&concurrency_limiter::handle_sweep,
+			boost::weak_ptr<concurrency_limiter>(shared_from_this()), _1));
+	}
+
+	// 把等太久的和取消了的从队列里拿掉.
+	static void handle_sweep(boost::weak_ptr<concurrency_limiter> weak_this, boost::system::error_code ec)
+	{
+		boost::shared_ptr<concurrency_limiter> self = weak_this.lock();
+		if (ec || !self)
+			return;
+
+		boost::asio::detail::mutex::scoped_lock l(self->m_mutex);
+
+		boost::posix_time::ptime t = now();
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < self->m_waiters.size(); i++)
+		{
+			waiter & w = self->m_waiters[i];
+			if (w.cancel.is_canceled())
+				self->m_io_service.post(boost::asio::detail::bind_handler(w.handler,
+					boost::system::error_code(boost::asio::error::operation_aborted)));
+			else if (t >= w.deadline)
+				self->m_io_service.post(boost::asio::detail::bind_handler(w.handler,
+					boost::system::error_code(concurrency_error::provider_busy)));
+			else
+			{
+				// 留下的就地往前挪.
+				if (kept != i)
+					self->m_waiters[kept].swap(w);
+				kept ++;
+			}
+		}
+		self->m_waiters.erase(self->m_waiters.begin() + kept, self->m_waiters.end());
+
+		if (self->m_waiters.empty())
+			self->m_sweeping = false;
+		else
+			self->start_sweep();
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	const std::string m_name;
+
+	mutable boost::asio::detail::mutex m_mutex;
+	limit_config m_config;
+	double m_limit;
+	std::size_t m_in_flight;
+	std::deque<waiter> m_waiters;
+
+	// 毫秒, 最近的耗时变化快, 基线变化慢.
+	double m_recent_latency, m_baseline_latency;
+	boost::posix_time::ptime m_last_decrease;
+
+	boost::asio::deadline_timer m_sweep_timer;
+	bool m_sweeping;
+};
+
+// 每个服务商一个 concurrency_limiter.
+class concurrency_limiters
+	: public boost::asio::detail::service_base<concurrency_limiters>
+{
+public:
+	explicit concurrency_limiters(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<concurrency_limiters>(io_service), m_io_service(io_service)
+	{
+	}
+
+	boost::shared_ptr<concurrency_limiter> get(const std::string & provider)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<concurrency_limiter> & limiter = m_limiters[provider];
+		if (!limiter)
+			limiter = boost::make_shared<concurrency_limiter>(boost::ref(m_io_service), provider, limit_config());
+		return limiter;
+	}
+
+private:
+	void shutdown_service()
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_limiters.clear();
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	boost::asio::detail::mutex m_mutex;
+	std::map<std::string, boost::shared_ptr<concurrency_limiter> > m_limiters;
+};
+
+namespace detail{
+
+// 同一个服务商的所有解码器共用一个, 可以通过它调整 limit_config.
+inline boost::shared_ptr<concurrency_limiter> get_concurrency_limiter(boost::asio::io_service & io_service,
+	const std::string & provider)
+{
+	return boost::asio::use_service<concurrency_limiters>(io_service).get(provider);
+}
+
+typedef boost::function<bool (const boost::system::error_code &)> overload_classifier;
+
+// 包在解码器的 handler 外面, 解码器完成的时候还回名额并报告服务商的状况.
+template<class Handler>
+class limited_handler{
+public:
+	limited_handler(boost::shared_ptr<concurrency_limiter> limiter, const overload_classifier & is_overload, Handler handler)
+		: m_limiter(limiter), m_is_overload(is_overload), m_handler(handler),
+		  m_start(boost::posix_time::microsec_clock::universal_time())
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
+	{
+		concurrency_limiter::outcome o = concurrency_limiter::outcome_ignored;
+		if (!ec)
+			o = concurrency_limiter::outcome_ok;
+		else if (m_is_overload(ec))
+			o = concurrency_limiter::outcome_overloaded;
+
+		m_limiter->release(o, boost::posix_time::microsec_clock::universal_time() - m_start);
+		m_handler(ec, provider, result, reportbad);
+	}
+
+	friend cancel_token get_cancel_token(const limited_handler & handler)
+	{
+		return get_cancel_token(handler.m_handler);
+	}
+
+private:
+	boost::shared_ptr<concurrency_limiter> m_limiter;
+	overload_classifier m_is_overload;
+	Handler m_handler;
+	boost::posix_time::ptime m_start;
+};
+
+// 拿到名额再调用 start(limited_handler) 启动解码器, 没拿到直接把错误交给 handler.
+template<class Handler, class Start>
+struct limited_start_op{
+	limited_start_op(boost::shared_ptr<concurrency_limiter> limiter, const overload_classifier & is_overload,
+		Handler handler, Start start)
+		: m_limiter(limiter), m_is_overload(is_overload), m_handler(handler), m_start(start)
+	{
+	}
+
+	void operator()(boost::system::error_code ec)
+	{
+		if (ec)
+		{
+			m_handler(ec, m_limiter->name(), std::string(), boost::function<void()>());
+			return;
+		}
+
+		m_start(limited_handler<Handler>(m_limiter, m_is_overload, m_handler));
+	}
+
+	boost::shared_ptr<concurrency_limiter> m_limiter;
+	overload_classifier m_is_overload;
+	Handler m_handler;
+	Start m_start;
+};
+
+/*
+ * 解码器的 operator() 用这个包装 op 的启动:
+ *
+ * decaptcha::detail::async_limited(limiter, is_overload, handler,
+ * 		boost::bind(&start_op<decaptcha::detail::limited_handler<Handler> >, ..., _1));
+ */
+template<class Handler, class Start>
+void async_limited(boost::shared_ptr<concurrency_limiter> limiter, const overload_classifier & is_overload,
+	Handler handler, Start start)
+{
+	limiter->async_acquire(get_cancel_token(handler),
+		limited_start_op<Handler, Start>(limiter, is_overload, handler, start));
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -27,115 +27,193 @@
 #include <avhttp.hpp>
 #include <avhttp/async_read_body.hpp>
 
-#include <boost/property_tree/ptree.hpp>
-namespace pt = boost::property_tree;
-#include <boost/property_tree/json_parser.hpp>
-namespace js = boost::property_tree::json_parser;
-
-#include <boost/timedcall.hpp>
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "http_connection_pool.hpp"
+#include "streambuf_pool.hpp"
+#include "response_parser.hpp"
+#include "concurrency_limit.hpp"
+#include "poll_schedule.hpp"
+#include "timer_wheel.hpp"
+#include "poll_multiplexer.hpp"
+#include "multipart.hpp"
+#include "image_format.hpp"
 
 namespace decaptcha{
 namespace decoder{
 namespace detail{
 
-inline std::string generate_boundary()
+/*
+ * 一个 deathbycaptcha 账号的设置, 解码器创建的时候准备好, 之后不再修改.
+ * 解码器和它启动的每一个 op 共用一份, handler 里拷贝的只是指针.
+ */
+struct account_info : boost::noncopyable
 {
-	boost::rand48 p(time(NULL));
-	return  boost::str(boost::format("%06x%06x") % p() %  p()  ).substr(0, 12);
-}
+	account_info(boost::asio::io_service & io_service, const std::string & _username, const std::string & _password)
+		: username(_username), password(_password),
+		  poller(decaptcha::detail::get_url_poll_multiplexer(io_service, "deathbycaptcha",
+				avhttp::request_opts()
+					(avhttp::http_options::accept, "application/json")
+					(avhttp::http_options::connection, "keep-alive")))
+	{
+		form.field("username", username)
+			.field("password", password)
+			.file("captchafile");
+	}
+
+	const std::string username, password;
+	decaptcha::detail::multipart_form form;
+	boost::shared_ptr<decaptcha::detail::poll_multiplexer> poller;
+};
 
 class reportbad_op
 {
 	boost::asio::io_service & m_io_service;
-	const std::string m_username, m_password;
-	const std::string m_id;
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	boost::shared_ptr<const account_info> m_account;
+	boost::shared_ptr<const std::string> m_url;
 public:
-	reportbad_op(boost::asio::io_service & io_service, std::string username, std::string password, std::string id)
-	: m_io_service(io_service), m_username(username), m_password(password), m_id(id)
+	reportbad_op(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account, boost::shared_ptr<const std::string> url)
+	: m_io_service(io_service), m_account(account), m_url(url)
 	{}
 
 	void operator()()
 	{
-		//http://api.dbcapi.me/api/captcha/%CAPTCHA_ID%/report
-		m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-		m_buffers = boost::make_shared<boost::asio::streambuf>();
-
-		std::string url = boost::str(boost::format("http://api.dbcapi.me/api/captcha/%s/report") % m_id);
+		std::string msg = boost::str(boost::format("username=%s&password=%s\r\n") % m_account->username % m_account->password);
 
-		std::string msg = boost::str(boost::format("username=%s&password=%s\r\n") % m_username % m_password);
-
-		m_stream->request_options(
+		decaptcha::detail::fetch_url_op op(m_io_service, *m_url,
 			avhttp::request_opts()
 			( avhttp::http_options::request_method, "POST" )
 			( avhttp::http_options::content_type, "application/x-www-form-urlencoded; charset=UTF-8" )
 			( avhttp::http_options::request_body, msg )
 			( avhttp::http_options::content_length, boost::lexical_cast<std::string>( msg.length() ) )
-			( avhttp::http_options::connection, "close" )
+			( avhttp::http_options::connection, "keep-alive" ),
+			decaptcha::detail::ignore_fetch_result()
 		);
-
-		avhttp::async_read_body(*m_stream, url, *m_buffers, *this);
-	}
-
-	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
-	{
-
 	}
 };
 
-reportbad_op reportbad_func(boost::asio::io_service & io_service, std::string username, std::string password, std::string id)
+inline reportbad_op reportbad_func(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account, const std::string & id)
 {
-	return reportbad_op(io_service, username, password, id);
+	//http://api.dbcapi.me/api/captcha/%CAPTCHA_ID%/report
+	return reportbad_op(io_service, account, boost::make_shared<std::string>(
+		boost::str(boost::format("http://api.dbcapi.me/api/captcha/%s/report") % id)));
 }
 
 template<class Handler>
 class deathbycaptcha_decoder_op : boost::asio::coroutine {
-	const std::string provider;
+	typedef decaptcha::wheel_timer<decaptcha::detail::wait_handler<deathbycaptcha_decoder_op> > timer_type;
+
+	// 一个验证码的所有状态. op 在每一步异步操作之间被拷贝, 拷贝的只是指向它的指针.
+	struct state : boost::noncopyable
+	{
+		state(boost::asio::io_service & _io_service, boost::shared_ptr<const account_info> _account, Handler _handler)
+			: io_service(_io_service),
+			  cancel(get_cancel_token(_handler)),
+			  strand(boost::make_shared<decaptcha::detail::op_strand>(boost::ref(_io_service))),
+			  timer(boost::make_shared<timer_type>(boost::ref(_io_service))),
+			  poll(decaptcha::detail::get_poll_schedule(_io_service, "deathbycaptcha", 11, 3, 20)),
+			  watchdog(boost::make_shared<decaptcha::detail::io_watchdog<avhttp::http_stream> >(boost::ref(_io_service), strand, stream)),
+			  location(boost::make_shared<std::string>()),
+			  buffers(decaptcha::detail::acquire_streambuf(_io_service)),
+			  image(0),
+			  handler(_handler),
+			  account(_account),
+			  provider("deathbycaptcha 阿三解码服务")
+		{
+		}
+
+		// 异步操作的 handler 内存, 和 state 一起释放.
+		decaptcha::detail::handler_arena arena;
+
+		boost::asio::io_service & io_service;
+
+		cancel_token cancel;
+		// op 的 handler, 定时器和取消都在这个 strand 里执行, 多个线程 run 的时候不会同时访问 op.
+		boost::shared_ptr<decaptcha::detail::op_strand> strand;
+		// 轮询的定时器挂在共用的时间轮上.
+		boost::shared_ptr<timer_type> timer;
+		decaptcha::detail::poll_timing poll;
+
+		boost::shared_ptr<avhttp::http_stream> stream;
+		// 上传的每一步都限时.
+		boost::shared_ptr<decaptcha::detail::io_watchdog<avhttp::http_stream> > watchdog;
+		boost::shared_ptr<std::string> location;
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		// 要上传的图片, 在 handler 被调用之前一直有效.
+		const std::string * image;
+
+		Handler handler;
+
+		boost::shared_ptr<const account_info> account;
+		const std::string provider;
+	};
+
 public:
 	deathbycaptcha_decoder_op(boost::asio::io_service & io_service,
-			std::string username, std::string password,
+			boost::shared_ptr<const account_info> account,
 			const std::string &buffer, Handler handler)
-		: m_io_service(io_service),
-		  m_username(username), m_password(password),
-		  m_handler(handler),
-		  m_stream(boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service))),
-		  m_location(boost::make_shared<std::string>()),
-		  m_buffers(boost::make_shared<boost::asio::streambuf>()),
-		  m_tries(boost::make_shared<int>(0)), provider("deathbycaptcha 阿三解码服务")
+		: m_state(boost::make_shared<state>(boost::ref(io_service), account, handler))
 	{
-		std::string boundary = generate_boundary();
- 		std::string content = build_multipart_formdata(buffer, boundary);
- 		std::string content_type = boost::str(boost::format("multipart/form-data; boundary=----------------------------%s") % boundary);
+		state & st = *m_state;
 
-		m_stream->request_options(
-			avhttp::request_opts()
-				(avhttp::http_options::request_method, "POST" )
-				(avhttp::http_options::accept, "application/json")
-				(avhttp::http_options::connection, "close" )
-				(avhttp::http_options::content_length, boost::lexical_cast<std::string>(content.length()) )
-				(avhttp::http_options::content_type, content_type )
-				(avhttp::http_options::request_body, content )
-		);
-		// 处理.
-		m_stream->async_open("http://api.dbcapi.me/api/captcha", *this);
+		decaptcha::detail::cancel_on_cancel(st.cancel, st.strand, st.timer);
+		decaptcha::detail::cancel_poll_on_cancel(st.cancel, st.strand, st.account->poller, st.buffers);
+
+		// 连到服务商的连接太多的时候在连接池里排队, 借到了再上传.
+		st.image = &buffer;
+		decaptcha::detail::async_acquire_http_stream(io_service, "http://api.dbcapi.me/api/captcha", st.strand->wrap(*this));
 	};
 
+	// 从连接池借到了连接, 开始上传.
+	void operator()(boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		state & st = *m_state;
+
+		st.stream = stream;
+		st.watchdog->attach(stream);
+		decaptcha::detail::close_on_cancel(st.cancel, st.strand, st.stream);
+
+		// 排队的时候已经取消了.
+		if (st.cancel.is_canceled())
+		{
+			(*this)(boost::system::error_code(boost::asio::error::operation_aborted));
+			return;
+		}
+
+		// 处理.
+		decaptcha::detail::async_send_multipart(st.stream, st.watchdog, "http://api.dbcapi.me/api/captcha",
+			avhttp::request_opts()(avhttp::http_options::accept, "application/json"),
+			st.account->form, decaptcha::image_file_name(*st.image), decaptcha::image_mime_type(*st.image), *st.image, *st.buffers, st.strand->wrap(*this));
+	}
+
 	void operator()(boost::system::error_code ec)
 	{
+		state & st = *m_state;
+
+		if (st.cancel.is_canceled())
+		{
+			st.io_service.post(
+				boost::asio::detail::bind_handler(
+					st.handler, boost::system::error_code(boost::asio::error::operation_aborted), st.provider, std::string(""), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
 		// 判断 ec
 		// 根据要求, ec 必须得是 303
 		if ( ec == avhttp::errc::see_other){
 			// 获取 url
-			*m_location = m_stream->location();
+			*st.location = st.stream->location();
 
 			// 继续读取,
-			boost::asio::async_read(*m_stream, *m_buffers, avhttp::transfer_response_body(m_stream->content_length()), *this);
+			st.watchdog->arm(st.watchdog->timeouts().read);
+			boost::asio::async_read(*st.stream, *st.buffers, avhttp::transfer_response_body(st.stream->content_length()), st.strand->wrap(*this));
 
 		}else{
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, ec, provider, std::string(""), boost::function<void()>()
+					st.handler, ec, st.provider, std::string(""), boost::function<void()>()
 				)
 			);
 		}
@@ -146,13 +224,26 @@ public:
 	{
 		using namespace boost::system::errc;
 
+		state & st = *m_state;
+
+		if (st.cancel.is_canceled())
+		{
+			st.io_service.post(
+				boost::asio::detail::bind_handler(
+					st.handler, boost::system::error_code(boost::asio::error::operation_aborted), st.provider, std::string(""), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
  		BOOST_ASIO_CORO_REENTER(this)
  		{
+			ec = st.watchdog->complete(ec);
 			if(ec)
 			{
-				m_io_service.post(
+				st.io_service.post(
 					boost::asio::detail::bind_handler(
-						m_handler, ec, provider, std::string(""), boost::function<void()>()
+						st.handler, ec, st.provider, std::string(""), boost::function<void()>()
 					)
 				);
 				return;
@@ -161,34 +252,28 @@ public:
 				return;
 			}
 
-			// 延时 8s 然后重试.
-			BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 8, boost::asio::detail::bind_handler(*this, ec, 0) );
+			st.poll.start();
 
 			do{
-				// 延时 3s 然后重试.
+				// 等到 poll_schedule 认为结果差不多出来了再去查询.
 				BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 3, boost::asio::detail::bind_handler(*this, ec, 0) );
-
-				// 这样第一次就总共延时了 11s,  正好是平均解码时间.
-				// 获取一下结果
-				m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-				m_buffers = boost::make_shared<boost::asio::streambuf>();
-
-				m_stream->request_options(
-					avhttp::request_opts()
-						(avhttp::http_options::accept, "application/json")
-				);
+					async_delay(st.poll.next_delay());
 
-				BOOST_ASIO_CORO_YIELD avhttp::async_read_body(*m_stream, *m_location, *m_buffers, *this);
+				// 获取一下结果, 每个查询从连接池借一个连接, 同时发出去.
+				// 上一次的响应已经处理完了, 清空了接着用.
+				decaptcha::detail::reset_streambuf(*st.buffers);
+				BOOST_ASIO_CORO_YIELD st.account->poller->async_poll(*st.location, st.buffers, st.strand->wrap(*this));
 
 				if (process_result(ec, bytes_transfered))
+				{
+					st.poll.solved();
 					return;
+				}
 			}while (should_try(ec));
 
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, make_error_code(operation_canceled), provider, std::string(""), boost::function<void()>()
+					st.handler, make_error_code(operation_canceled), st.provider, std::string(""), boost::function<void()>()
 				)
 			);
  		}
@@ -196,95 +281,126 @@ public:
 private:
 	bool process_result(boost::system::error_code ec, std::size_t bytes_transfered)
 	{
-		// 读取 json
-		try
+		state & st = *m_state;
+
+		// {"status": 0, "captcha": 123, "is_correct": true, "text": ""}
+		// 直接在 buffers 里挑出要用的字段. 多数查询还没有结果, text 是空的, 这时候不复制也不分配内存.
+		decaptcha::detail::json_reader reader(decaptcha::detail::response_data(*st.buffers, st.buffers->size()));
+		boost::string_ref key;
+		decaptcha::detail::json_value value, text, captcha;
+		bool is_correct = false, has_text = false, has_captcha = false;
+
+		while (reader.next(key, value))
 		{
-			std::istream is(m_buffers.get());
-			pt::ptree result;
-			js::read_json(is, result);
-			if (result.get<bool>("is_correct"))
+			if (key == "is_correct")
 			{
-				std::string text = result.get<std::string>("text");
-				if (text.empty())
+				if (!value.to_bool(is_correct))
 					return false;
- 				std::string  captchaid = result.get<std::string>("captcha");
-				m_io_service.post(
-					boost::asio::detail::bind_handler(
-						m_handler, boost::system::error_code(),
-						provider, text,
-						reportbad_func(m_io_service, m_username, m_password, captchaid)
-					)
-				);
-
-				return true;
+			}
+			else if (key == "text")
+			{
+				text = value;
+				has_text = true;
+			}
+			else if (key == "captcha")
+			{
+				captcha = value;
+				has_captcha = true;
 			}
 		}
-		catch(const pt::ptree_error & error)
-		{
-		}
-		return false;
+
+		if (reader.failed() || !is_correct || !has_text || !has_captcha)
+			return false;
+
+		if (text.empty())
+			return false;
+
+		st.io_service.post(
+			boost::asio::detail::bind_handler(
+				st.handler, boost::system::error_code(),
+				st.provider, text.to_string(),
+				reportbad_func(st.io_service, st.account, captcha.to_string())
+			)
+		);
+
+		return true;
 	}
 
-	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 1min
+	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 poll_schedule 的 max_wait
 	bool should_try(boost::system::error_code ec) const
 	{
-		return (*m_tries) ++ < 20;
+		const state & st = *m_state;
+
+		return st.poll.should_poll();
 	}
 
 private:
-	std::string build_multipart_formdata(const std::string &buffer, const std::string & boundary) const
+	void async_delay(boost::posix_time::time_duration delay)
 	{
-		std::stringstream content_body;
-		content_body << "------------------------------" << boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"username\"" <<  "\r\n\r\n"
-					 << m_username << "\r\n";
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"password\"" <<  "\r\n\r\n"
-					 << m_password << "\r\n";
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"captchafile\"; filename=\"vercode.jpeg\"" << "\r\n"
-					 << "Content-Type: image/jpeg" <<  "\r\n\r\n";
-
-		content_body.write(buffer.data(), buffer.length());
-			content_body << "\r\n";
-
-		content_body << "------------------------------" <<  boundary << "--" << "\r\n";
-
-		return content_body.str();
+		state & st = *m_state;
+
+		// 等待的时候不占着连接, 还回连接池给别人用.
+		st.stream.reset();
+
+		st.timer->expires_from_now(delay);
+		st.timer->async_wait(decaptcha::detail::wait_handler<deathbycaptcha_decoder_op>(*this, st.strand));
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-
-	boost::shared_ptr<int>	m_tries;
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<std::string> m_location;
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	// 这个验证码所有异步操作的 handler 内存都从 state 里的 arena 分配.
+	friend void * asio_handler_allocate(std::size_t size, deathbycaptcha_decoder_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
 
-	Handler m_handler;
+	friend void asio_handler_deallocate(void * pointer, std::size_t, deathbycaptcha_decoder_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
 
-	const std::string m_username, m_password;
+private:
+	boost::shared_ptr<state> m_state;
 };
 
+// 哪些错误说明服务商忙不过来了.
+inline bool is_overload(const boost::system::error_code & ec)
+{
+	return decaptcha::detail::is_http_overload(ec);
+}
+
+template<class Handler>
+void start_decoder_op(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account,
+	const std::string * buffer, Handler handler)
+{
+	deathbycaptcha_decoder_op<Handler> op(io_service, account, *buffer, handler);
+}
+
 }
 
 class deathbycaptcha_decoder{
 public:
 	deathbycaptcha_decoder(boost::asio::io_service & io_service, std::string username, std::string password)
-	  : m_io_service(io_service), m_username(username), m_password(password)
+	  : m_io_service(io_service),
+	    m_account(boost::make_shared<detail::account_info>(boost::ref(io_service), username, password)),
+	    m_limiter(decaptcha::detail::get_concurrency_limiter(io_service, "deathbycaptcha 阿三解码服务"))
 	{
 	}
 
+	// buffer 在 handler 被调用之前必须一直有效.
 	template <class Handler>
 	void operator()(const std::string &buffer, Handler handler)
 	{
-		detail::deathbycaptcha_decoder_op<Handler>
-				op(m_io_service, m_username, m_password, buffer, handler);
+		// 拿到 deathbycaptcha 的并发名额才上传, 拿不到就是 provider_busy, 交给下一个解码器.
+		decaptcha::detail::async_limited(m_limiter, &detail::is_overload, handler,
+			boost::bind(&detail::start_decoder_op<decaptcha::detail::limited_handler<Handler> >,
+				boost::ref(m_io_service), m_account, &buffer, _1));
 	}
 
 private:
 	boost::asio::io_service & m_io_service;
-	const std::string m_username, m_password;
+	boost::shared_ptr<const detail::account_info> m_account;
+	// 同一个服务商的所有解码器共用.
+	boost::shared_ptr<concurrency_limiter> m_limiter;
 };
 
 }
@@ -17,89 +17,489 @@
  */
 
 #pragma once
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include "cancel_token.hpp"
+#include "image_format.hpp"
+#include "decoder_stats.hpp"
+#include "decoder_health.hpp"
+#include "decoder_routing.hpp"
+#include "result_cache.hpp"
+#include "single_flight.hpp"
 
 namespace decaptcha{
 
 class deCAPTCHA;
 
+// 多个解码器之间的调度方式.
+enum dispatch_policy{
+	// 一个一个的试, 前一个失败了才使用下一个.
+	dispatch_serial,
+	// 同时交给所有的解码器, 采用最先成功返回的结果, 其余的取消掉.
+	dispatch_race,
+	// 先只用第一个解码器, 过了一段时间还没有结果才启动下一个, 采用最先成功返回的结果.
+	dispatch_hedged,
+};
+
 namespace detail{
 
-template<class DecoderOp, class Handler >
-class async_decaptcha_op : boost::asio::coroutine {
+// 调度参数, 由 deCAPTCHA::set_xxx 设置.
+struct dispatch_config{
+	dispatch_config()
+		: policy(dispatch_serial), hedge_delay(boost::posix_time::seconds(15)), hedge_percentile(0.9)
+	{
+	}
+
+	dispatch_policy policy;
+	// dispatch_hedged 的时候, 启动下一个解码器之前等待的时间.
+	boost::posix_time::time_duration hedge_delay;
+	// 大于 0 的时候, 样本足够的解码器改用自己识别耗时的这个分位数作为等待时间.
+	double hedge_percentile;
+};
+
+/*
+ * deCAPTCHA 传给解码器的 handler.
+ *
+ * 除了回调以外还带有一个 cancel_token, 解码器通过 get_cancel_token 获得.
+ * 解码器一路按值拷贝 handler, 回调放在共享的指针后面, 拷贝不用分配内存.
+ */
+class decoder_handler{
 public:
-	async_decaptcha_op(boost::asio::io_service & io_service, std::vector<DecoderOp>	decoder,
-						const std::string & buf, Handler handler)
-		:m_io_service(io_service), m_decoder(decoder), m_buffer(buf),
-		m_handler(handler)
+	typedef boost::function<
+			void (boost::system::error_code ec, std::string provider, std::string result, boost::function<void()>)
+		> function_type;
+
+	decoder_handler(const function_type & func, const cancel_token & token)
+		: m_func(boost::make_shared<const function_type>(func)), m_token(token)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad) const
+	{
+		(*m_func)(ec, provider, result, reportbad);
+	}
+
+	friend cancel_token get_cancel_token(const decoder_handler & handler)
+	{
+		return handler.m_token;
+	}
+
+private:
+	boost::shared_ptr<const function_type> m_func;
+	cancel_token m_token;
+};
+
+// 用户 reportbad 的时候, 记到给出这个答案的解码器头上.
+// 只有一个指针, 放得进 boost::function 自带的缓冲区.
+struct accuracy_reportbad_op{
+	accuracy_reportbad_op(boost::shared_ptr<decoder_stats> stats, const boost::function<void()> & reportbad)
+		: m_state(boost::make_shared<const state>(stats, reportbad))
+	{
+	}
+
+	void operator()() const
+	{
+		m_state->stats->record_wrong();
+		if (m_state->reportbad)
+			m_state->reportbad();
+	}
+
+private:
+	struct state{
+		state(boost::shared_ptr<decoder_stats> _stats, const boost::function<void()> & _reportbad)
+			: stats(_stats), reportbad(_reportbad)
+		{
+		}
+
+		boost::shared_ptr<decoder_stats> stats;
+		boost::function<void()> reportbad;
+	};
+
+	boost::shared_ptr<const state> m_state;
+};
+
+// async_decaptcha 的超时. 到时间了取消 token, 并记下是超时, 不是调用者自己取消的.
+struct solve_deadline : boost::noncopyable{
+	solve_deadline(boost::asio::io_service & io_service, const cancel_token & cancel)
+		: timer(io_service), token(make_cancel_token(cancel)), expired(false)
+	{
+	}
+
+	static void start(boost::shared_ptr<solve_deadline> self, boost::posix_time::time_duration timeout)
+	{
+		self->timer.expires_from_now(timeout);
+		self->timer.async_wait(boost::bind(&solve_deadline::handle_timeout, boost::weak_ptr<solve_deadline>(self), _1));
+	}
+
+	static void handle_timeout(boost::weak_ptr<solve_deadline> weak_self, boost::system::error_code ec)
+	{
+		boost::shared_ptr<solve_deadline> self = weak_self.lock();
+		if (ec || !self || self->token.is_canceled())
+			return;
+
+		self->expired = true;
+		self->token.cancel();
+	}
+
+	boost::asio::deadline_timer timer;
+	// 交给 async_decaptcha 的, 调用者取消或者超时都会取消它.
+	cancel_token token;
+	boost::atomic<bool> expired;
+};
+
+// 超时的时候把 operation_aborted 换成 timed_out.
+template<class Handler>
+class deadline_handler{
+public:
+	deadline_handler(boost::shared_ptr<solve_deadline> deadline, Handler handler)
+		: m_deadline(deadline), m_handler(handler)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
+	{
+		boost::system::error_code ignore_ec;
+		m_deadline->timer.cancel(ignore_ec);
+
+		if (ec == boost::asio::error::operation_aborted && m_deadline->expired)
+			ec = boost::asio::error::timed_out;
+		m_handler(ec, provider, result, reportbad);
+	}
+
+private:
+	boost::shared_ptr<solve_deadline> m_deadline;
+	Handler m_handler;
+};
+
+typedef boost::function<
+		void (const std::string & buffer, decoder_handler)
+	> decoder_op_t;
+typedef boost::function<
+		boost::system::error_code (const std::string & buffer, std::string & output)
+	> preprocessor_t;
+
+/*
+ * 解码器列表和各种设置. 修改的时候复制一份改完整个换掉,
+ * async_decaptcha 只在锁里拿一下指针, 之后用的都是这份快照, 不怕别的线程同时 add_decoder.
+ */
+struct decaptcha_settings{
+	std::vector<decoder_op_t> decoder;
+	std::vector<boost::shared_ptr<decoder_stats> > stats;
+	std::vector<boost::shared_ptr<decoder_health> > health;
+	// 每个解码器识别一个验证码的花费.
+	std::vector<double> cost;
+	dispatch_config config;
+	routing_config routing;
+	circuit_config circuit;
+	preprocessor_t preprocess;
+};
+
+/*
+ * 一个验证码的识别过程.
+ *
+ * 所有的状态都在一个 state 里, 解码器列表和图片也只是指针, 不随验证码复制.
+ * strand 包装的回调, 定时器和交给解码器的 handler 里拷贝的只是 m_state,
+ * 每个在识别的验证码占用的内存和图片大小, 解码器个数无关.
+ */
+template<class Handler >
+class async_decaptcha_op{
+	// 所有解码器共享的完成状态, 只在 strand 里访问.
+	struct state : boost::noncopyable
+	{
+		state(boost::asio::io_service & _io_service, boost::shared_ptr<const decaptcha_settings> _settings,
+			std::vector<std::size_t> & _order, boost::shared_ptr<const std::string> _image,
+			boost::shared_ptr<result_cache> _cache, boost::uint64_t _hash, const cancel_token & _cancel, Handler _handler)
+			: io_service(_io_service), settings(_settings), image(_image), cache(_cache), hash(_hash), cancel(_cancel),
+			handler(_handler), strand(_io_service), cancels(_settings->decoder.size()), probes(_settings->decoder.size()), started(_settings->decoder.size()),
+			hedge_timer(_io_service), next_decoder(0), pending(0), done(false)
+		{
+			order.swap(_order);
+		}
+
+		boost::asio::io_service & io_service;
+		// 开始识别时的设置快照, 解码器列表, 统计和熔断都从这里取.
+		const boost::shared_ptr<const decaptcha_settings> settings;
+		// 这个验证码使用解码器的顺序, 由 route_decoders 排好.
+		std::vector<std::size_t> order;
+		// 交给解码器的图片, 解码器拿到的是它的引用.
+		const boost::shared_ptr<const std::string> image;
+		const boost::shared_ptr<result_cache> cache;
+		const boost::uint64_t hash;
+		// 取消整个识别.
+		const cancel_token cancel;
+		Handler handler;
+		// 解码器的回调, 定时器和取消可能来自不同的线程, 都转到这里.
+		boost::asio::io_service::strand strand;
+
+		// 每个已经启动的解码器一个.
+		std::vector<cancel_token> cancels;
+		// 每个解码器启动时 decoder_health::allow 给的试探编号, 返回的时候交回去.
+		std::vector<decoder_health::probe_ticket> probes;
+		// 每个解码器的启动时间, 用来统计识别耗时.
+		std::vector<boost::posix_time::ptime> started;
+		// dispatch_hedged 用来启动下一个解码器.
+		boost::asio::deadline_timer hedge_timer;
+		// 下一个要启动的是 order 里的第几个.
+		std::size_t next_decoder;
+		// 启动了还没返回的解码器个数.
+		std::size_t pending;
+		// handler 已经调用过了.
+		bool done;
+		// 胜出的结果, 用来判断后返回的结果是不是错的.
+		std::string result;
+	};
+
+public:
+	async_decaptcha_op(boost::asio::io_service & io_service, boost::shared_ptr<const decaptcha_settings> settings,
+						std::vector<std::size_t> & order, boost::shared_ptr<const std::string> image,
+						boost::shared_ptr<result_cache> cache, boost::uint64_t hash, const cancel_token & cancel, Handler handler)
+		: m_state(boost::make_shared<state>(boost::ref(io_service), settings, boost::ref(order), image,
+			cache, hash, boost::cref(cancel), handler))
 	{
-		using namespace boost::asio::detail;
-		// TODO 使用机器识别算法
 		// TODO 使用人肉识别服务
 
 		// 让 XMPP/IRC 的聊友版面
-		m_io_service.post(
-			bind_handler(*this, boost::system::error_code(), std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+		m_state->strand.post(*this);
+	}
+
+	// 开始.
+	void operator()()
+	{
+		state & st = *m_state;
+
+		st.cancel.on_cancel(
+			boost::function<void()>(boost::bind(&async_decaptcha_op::dispatch_abort, boost::weak_ptr<state>(m_state))),
+			m_state
 		);
+
+		if (st.done)
+			return;
+
+		if (st.settings->decoder.empty())
+		{
+			st.done = true;
+			st.io_service.post(
+				boost::asio::detail::bind_handler(st.handler, boost::system::error_code(), std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+			);
+			return;
+		}
+
+		if (st.settings->config.policy == dispatch_race)
+		{
+			while (launch_next())
+				;
+		}
+		else
+		{
+			launch_next();
+		}
+
+		// 所有的解码器都熔断了, 不用等.
+		if (st.pending == 0)
+		{
+			st.done = true;
+			st.io_service.post(
+				boost::asio::detail::bind_handler(st.handler, boost::system::error_code(health_error::all_circuits_open),
+					std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+			);
+		}
+	}
+
+	// dispatch_hedged 的等待时间到了, 还没有结果就启动下一个解码器.
+	void operator()(boost::system::error_code ec)
+	{
+		state & st = *m_state;
+
+		if (ec || st.done)
+			return;
+
+		launch_next();
 	}
 
-	template<class Functor>
-	void operator()(boost::system::error_code ec, std::string provider, std::string result, Functor reportbad = boost::function<void()>() )
+	// 第 index 个解码器返回了.
+	void operator()(std::size_t index, boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
 	{
-		int & i = m_index_decoder;
+		state & st = *m_state;
 
-		BOOST_ASIO_CORO_REENTER(this)
+		st.pending --;
+		st.cancels[index] = cancel_token();
+		st.settings->health[index]->record(ec, st.probes[index]);
+
+		boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - st.started[index];
+		if (!ec)
+			st.settings->stats[index]->record_latency(elapsed);
+		// 被取消的, 没拿到并发名额的没有真正试过.
+		if (ec != boost::asio::error::operation_aborted && ec != concurrency_error::provider_busy)
+			st.settings->stats[index]->record_attempt(elapsed, !ec);
+
+		if (st.done)
 		{
-			// 遍历所有的 decoder, 一个一个试过.
-			for( i = 0 ; i < m_decoder.size(); i ++)
-			{
-				BOOST_ASIO_CORO_YIELD m_decoder[i](m_buffer, *this);
-				if (!ec)
-				{
-					m_io_service.post(
-						boost::asio::detail::bind_handler(m_handler, ec, provider, result, reportbad));
-					return;
-				}
-			}
-			m_io_service.post(
-				boost::asio::detail::bind_handler(m_handler, ec, std::string("deCAPTCHA"), result, reportbad));
+			// 输了, 但是已经完成识别的.
+			// 结果和胜出的不一样, 说明两个里面必然有一个是错的, 报告了能把钱要回来.
+			if (!ec && reportbad && !boost::algorithm::iequals(result, st.result))
+				st.io_service.post(reportbad);
 			return;
 		}
+
+		if (!ec)
+		{
+			st.done = true;
+			st.result = result;
+
+			// 取消掉其他还在运行的解码器.
+			for (std::size_t i = 0; i < st.cancels.size(); i++)
+				st.cancels[i].cancel();
+
+			boost::system::error_code ignore_ec;
+			st.hedge_timer.cancel(ignore_ec);
+
+			// 放进缓存, reportbad 的时候要从缓存里踢掉.
+			// 被 reportbad 的答案计入解码器的准确率, 路由的时候要用.
+			st.settings->stats[index]->record_solved();
+			reportbad = accuracy_reportbad_op(st.settings->stats[index], reportbad);
+
+			shared_reportbad once = st.cache->insert(st.hash, provider, result, reportbad);
+			reportbad = cache_reportbad_op(st.cache, st.hash, result, once);
+
+			st.io_service.post(
+				boost::asio::detail::bind_handler(st.handler, ec, provider, result, reportbad));
+			return;
+		}
+
+		// 遍历所有的 decoder, 一个一个试过.
+		// dispatch_hedged 下还有别的解码器在跑的话, 就等 hedge_timer 再启动下一个.
+		if ((st.settings->config.policy != dispatch_hedged || st.pending == 0) && launch_next())
+			return;
+
+		if (st.pending == 0)
+		{
+			st.done = true;
+			st.io_service.post(
+				boost::asio::detail::bind_handler(st.handler, ec, std::string("deCAPTCHA"), result, reportbad));
+		}
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-	std::vector<DecoderOp>	m_decoder;
-	const std::string m_buffer;
-	Handler m_handler;
-private:                                                    // value used in coroutine
-	int m_index_decoder;
+	// cancel 可能在任意线程调用.
+	static void dispatch_abort(boost::weak_ptr<state> weak_state)
+	{
+		if (boost::shared_ptr<state> st = weak_state.lock())
+			st->strand.dispatch(boost::bind(&async_decaptcha_op::abort, weak_state));
+	}
 
+	// 整个识别被取消了, 解码器通过 cancel 的子 token 也都被取消了.
+	static void abort(boost::weak_ptr<state> weak_state)
+	{
+		boost::shared_ptr<state> st = weak_state.lock();
+		if (!st || st->done)
+			return;
+
+		st->done = true;
+
+		boost::system::error_code ignore_ec;
+		st->hedge_timer.cancel(ignore_ec);
+
+		st->io_service.post(
+			boost::asio::detail::bind_handler(st->handler,
+				boost::system::error_code(boost::asio::error::operation_aborted),
+				std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+		);
+	}
+
+	// 启动下一个没有熔断的解码器, 一个都没有了返回 false.
+	bool launch_next()
+	{
+		state & st = *m_state;
+
+		while (st.next_decoder < st.order.size())
+		{
+			std::size_t index = st.order[st.next_decoder++];
+			if (st.settings->health[index]->allow(st.probes[index]))
+			{
+				launch(index);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void launch(std::size_t index)
+	{
+		state & st = *m_state;
+
+		st.cancels[index] = make_cancel_token(st.cancel);
+		st.started[index] = boost::posix_time::microsec_clock::universal_time();
+		st.pending ++;
+
+		if (st.settings->config.policy == dispatch_hedged && st.next_decoder < st.order.size())
+		{
+			st.hedge_timer.expires_from_now(hedge_delay(index));
+			st.hedge_timer.async_wait(st.strand.wrap(boost::bind<void>(*this, _1)));
+		}
+
+		st.settings->decoder[index](*st.image,
+			decoder_handler(st.strand.wrap(boost::bind<void>(*this, index, _1, _2, _3, _4)), st.cancels[index])
+		);
+	}
+
+	// 第 index 个解码器多久没有结果就启动下一个.
+	boost::posix_time::time_duration hedge_delay(std::size_t index) const
+	{
+		const state & st = *m_state;
+
+		const dispatch_config & config = st.settings->config;
+
+		if (config.hedge_percentile > 0)
+		{
+			boost::posix_time::time_duration learned = st.settings->stats[index]->latency_percentile(config.hedge_percentile);
+			if (!learned.is_special())
+				return learned;
+		}
+		return config.hedge_delay;
+	}
+
+private:
+	boost::shared_ptr<state> m_state;
 };
 
-template<class DecoderOp, class Handler > async_decaptcha_op<DecoderOp, Handler>
+template<class Handler > async_decaptcha_op<Handler>
 	make_async_decaptcha_op(boost::asio::io_service & io_service,
-			const std::vector<DecoderOp> & decoder, const std::string & buf, Handler handler)
+			boost::shared_ptr<const decaptcha_settings> settings, std::vector<std::size_t> & order,
+			boost::shared_ptr<const std::string> image, boost::shared_ptr<result_cache> cache, boost::uint64_t hash,
+			const cancel_token & cancel, Handler handler)
 {
-	return detail::async_decaptcha_op<DecoderOp, Handler>(
-				io_service, decoder, buf, handler);
+	return detail::async_decaptcha_op<Handler>(
+				io_service, settings, order, image, cache, hash, cancel, handler);
 }
 
 }
 
 class deCAPTCHA{
 	typedef boost::function<void()>	reportbadfunc_t;
-	typedef boost::function<
-			void (boost::system::error_code ec, std::string provider, std::string result, reportbadfunc_t)
-		> decoder_handler;
-	typedef boost::function<
-			void (const std::string & buffer, decoder_handler)
-		> decoder_op_t;
+	typedef detail::decoder_handler decoder_handler;
+	typedef detail::decoder_op_t decoder_op_t;
+	typedef detail::preprocessor_t preprocessor_t;
+	typedef detail::decaptcha_settings settings;
 
 public:
+	/*
+	 * deCAPTCHA 的所有成员函数都可以在多个线程里同时调用,
+	 * io_service 也可以由多个线程一起 run.
+	 */
 	deCAPTCHA(boost::asio::io_service & io_service)
-		:m_io_service(io_service)
+		:m_io_service(io_service), m_cache(boost::make_shared<result_cache>()),
+		m_flights(boost::make_shared<detail::flight_table>()),
+		m_settings(boost::make_shared<settings>())
 	{
 	}
 
@@ -109,16 +509,127 @@ public:
 	 * 目前实现的解码器是 channel_friend_decoder 和 deathbycaptcha_decoder
 	 * channel_friend_decoder 利用其他频道的聊友进行解码.
 	 * deathbycaptcha_decoder 则是印度阿三开的一家人肉解码服务公司
+	 *
+	 * cost 是识别一个验证码的花费, 单位随意, 所有解码器一致就行. set_routing 按花费排序的时候用.
 	 */
 	template<class DecoderClass>
-	void add_decoder(DecoderClass decoder)
+	void add_decoder(DecoderClass decoder, double cost = 0)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->decoder.push_back(decoder);
+		s->cost.push_back(cost);
+		s->stats.push_back(boost::make_shared<decoder_stats>());
+		s->health.push_back(boost::make_shared<decoder_health>(s->circuit));
+		m_settings = s;
+	}
+
+	std::size_t decoder_count() const
+	{
+		return snapshot()->decoder.size();
+	}
+
+	// 第 index 个 add_decoder 添加的解码器的健康状况.
+	boost::shared_ptr<const decoder_health> health(std::size_t index) const
+	{
+		return snapshot()->health.at(index);
+	}
+
+	/*
+	 * set_routing 设置每个验证码使用解码器的顺序, 默认是 route_static, 也就是 add_decoder 的顺序.
+	 *
+	 * 其他的方式每个验证码都重新排序, 根据解码器最近的识别耗时, 失败率, 答案被 reportbad 的比例
+	 * 和 add_decoder 时给的 cost 估计拿到一个正确答案的期望耗时和期望花费.
+	 * route_fastest 期望耗时最短的优先, route_cheapest_within_sla 在 p90 耗时不超过 sla 的里面挑最便宜的,
+	 * route_weighted 按 latency_weight 和 cost_weight 加权. 见 decoder_routing.hpp.
+	 */
+	void set_routing(const routing_config & config)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->routing = config;
+		m_settings = s;
+	}
+
+	/*
+	 * set_circuit_breaker 设置熔断的参数, 对已经添加的和以后添加的解码器都有效.
+	 *
+	 * 连续失败或者最近的失败率太高的解码器会被熔断, 识别的时候直接跳过.
+	 * 冷却时间过后放一个验证码去试探, 成功了才按比例慢慢恢复. 见 decoder_health.hpp.
+	 * 所有的解码器都熔断了的话, handler 立即收到 health_error::all_circuits_open.
+	 */
+	void set_circuit_breaker(const circuit_config & config)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->circuit = config;
+		for (std::size_t i = 0; i < s->health.size(); i++)
+			s->health[i]->set_config(config);
+		m_settings = s;
+	}
+
+	/*
+	 * set_dispatch_policy 设置多个解码器之间的调度方式, 默认是 dispatch_serial.
+	 *
+	 * dispatch_race 会把验证码同时交给所有的解码器, 第一个成功的结果交给 handler,
+	 * 其余的解码器被取消. 已经识别完了的落败者, 如果结果和胜出者不一样, 会被报告识别错误.
+	 * 速度最快, 但是要为每个验证码付多份钱.
+	 *
+	 * dispatch_hedged 先只启动第一个解码器, 等待 set_hedge_delay 设置的时间还没有结果,
+	 * 才启动下一个. 大部分验证码只付一份钱, 又能把慢的那一小部分的耗时砍下来.
+	 */
+	void set_dispatch_policy(dispatch_policy policy)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->config.policy = policy;
+		m_settings = s;
+	}
+
+	/*
+	 * set_hedge_delay 设置 dispatch_hedged 启动下一个解码器之前的等待时间.
+	 *
+	 * percentile 大于 0 的时候, 识别过足够多验证码的解码器使用自己识别耗时的 percentile 分位数,
+	 * 比如 0.9 就是 p90. 样本不够的时候才使用 delay. percentile 为 0 则总是使用 delay.
+	 */
+	void set_hedge_delay(boost::posix_time::time_duration delay, double percentile = 0.9)
 	{
-		m_decoder.push_back(decoder);
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->config.hedge_delay = delay;
+		s->config.hedge_percentile = percentile;
+		m_settings = s;
 	}
 
 	/*
-	* async_decaptcha 用于将 buf 表示的一个缓冲区(jpeg数据) 识别为一个文字,
+	 * set_cache_size 设置识别结果缓存的大小, 0 表示不缓存. 默认缓存 1024 个.
+	 *
+	 * 同一张图片(按内容的 hash)再次识别的时候直接返回缓存的结果, 不再花钱.
+	 * 调用 handler 收到的 reportbad 会把结果从缓存中踢掉, 并且一段时间内不会再缓存这个错误的结果.
+	 */
+	void set_cache_size(std::size_t size)
+	{
+		m_cache->set_capacity(size);
+	}
+
+	/*
+	 * set_image_preprocessor 设置上传之前对图片的处理, 比如 image_preprocess.hpp 里的 image_preprocessor.
+	 *
+	 * 同一张图片只处理一次, 所有的解码器都拿到处理后的图片.
+	 * 返回错误的话, 不交给任何解码器, handler 直接收到这个错误.
+	 */
+	void set_image_preprocessor(const preprocessor_t & preprocessor)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<settings> s = boost::make_shared<settings>(*m_settings);
+		s->preprocess = preprocessor;
+		m_settings = s;
+	}
+
+	/*
+	* async_decaptcha 用于将 buf 表示的一个缓冲区(jpeg/png/gif/bmp 数据) 识别为一个文字,
 	* 识别完成后调用 handler 返回识别结果.
+	* 空的或者认不出格式的图片直接返回 image_error, 不会交给解码器.
 	* 
 	* handler 的签名如下
 	* 
@@ -138,13 +649,130 @@ public:
 	template<class Handler>
 	void async_decaptcha(const std::string & buf, Handler handler)
 	{
-		detail::make_async_decaptcha_op(m_io_service, m_decoder, buf, handler);
+		async_decaptcha(buf, cancel_token(), handler);
+	}
+
+	/*
+	 * 同时有多个同样的图片在识别的时候, 只有第一个会真正交给解码器,
+	 * 后来的直接等待第一个的结果, 所有的 handler 收到同样的 provider, result 和 reportbad.
+	 *
+	 * cancel 被取消的时候, handler 会立即收到 operation_aborted.
+	 * 只有等待这个结果的调用者全部取消了, 才会真正取消识别.
+	 */
+	template<class Handler>
+	void async_decaptcha(const std::string & buf, const cancel_token & cancel, Handler handler)
+	{
+		boost::system::error_code ec = check_image(buf);
+		if (ec)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(handler, ec, std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+			);
+			return;
+		}
+
+		boost::uint64_t hash = image_hash(buf);
+
+		std::string provider, result;
+		detail::shared_reportbad reportbad;
+		if (m_cache->lookup(hash, provider, result, reportbad))
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(handler, boost::system::error_code(), provider, result,
+					boost::function<void()>(detail::cache_reportbad_op(m_cache, hash, result, reportbad)))
+			);
+			return;
+		}
+
+		boost::shared_ptr<detail::flight> f = m_flights->find(hash);
+		if (f && f->attach(detail::flight::handler_type(handler), cancel))
+			return;
+
+		boost::shared_ptr<const settings> s = snapshot();
+
+		// 整个识别过程只有这一份图片, 预处理直接写进去.
+		boost::shared_ptr<std::string> image = boost::make_shared<std::string>();
+		if (s->preprocess)
+			ec = s->preprocess(buf, *image);
+		else
+			image->assign(buf);
+
+		if (ec)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(handler, ec, std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+			);
+			return;
+		}
+
+		cancel_token solve = make_cancel_token();
+		boost::shared_ptr<detail::flight> created = boost::make_shared<detail::flight>(boost::ref(m_io_service),
+			boost::weak_ptr<detail::flight_table>(m_flights), hash, solve);
+
+		// 别的线程可能同时在识别同一张图片, 那就挂到它的 flight 上.
+		// 挂上去之前它正好结束了的话, 把它从表里拿掉再试一次.
+		for (;;)
+		{
+			f = m_flights->insert(hash, created);
+			if (f->attach(detail::flight::handler_type(handler), cancel))
+				break;
+			m_flights->erase(hash, f.get());
+		}
+
+		if (f != created)
+			return;
+
+		std::vector<std::size_t> order;
+		detail::route_decoders(s->stats, s->cost, s->routing, order);
+
+		detail::make_async_decaptcha_op(m_io_service, s, order, boost::shared_ptr<const std::string>(image), m_cache, hash,
+			solve, detail::flight_handler(f));
+	}
+
+	template<class Handler>
+	void async_decaptcha(const std::string & buf, boost::posix_time::time_duration timeout, Handler handler)
+	{
+		async_decaptcha(buf, timeout, cancel_token(), handler);
 	}
 
+	/*
+	 * timeout 之内没有结果, handler 收到 boost::asio::error::timed_out.
+	 * cancel 先被取消的话, 和上面一样收到 operation_aborted.
+	 *
+	 * 超时和取消一样只针对这一个调用者. 等待这张图片的调用者全部超时或者取消了,
+	 * 正在进行的解码器会立即关闭连接, 取消定时器, 不再继续查询结果.
+	 */
+	template<class Handler>
+	void async_decaptcha(const std::string & buf, boost::posix_time::time_duration timeout, const cancel_token & cancel, Handler handler)
+	{
+		if (timeout.is_pos_infinity())
+		{
+			async_decaptcha(buf, cancel, handler);
+			return;
+		}
+
+		// 先启动定时器再提交, handler 取消定时器的时候 async_wait 一定已经调用过了.
+		boost::shared_ptr<detail::solve_deadline> deadline
+			= boost::make_shared<detail::solve_deadline>(boost::ref(m_io_service), cancel);
+		detail::solve_deadline::start(deadline, timeout);
+
+		async_decaptcha(buf, deadline->token, detail::deadline_handler<Handler>(deadline, handler));
+	}
+
+private:
+	boost::shared_ptr<const settings> snapshot() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_settings;
+	}
 
 private:
 	boost::asio::io_service & m_io_service;
-	std::vector<decoder_op_t>	m_decoder;
+	boost::shared_ptr<result_cache> m_cache;
+	boost::shared_ptr<detail::flight_table> m_flights;
+
+	mutable boost::asio::detail::mutex m_mutex;
+	boost::shared_ptr<const settings> m_settings;
 };
 
 }
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "concurrency_limit.hpp"
+
+#ifndef BOOST_SYSTEM_NOEXCEPT
+  #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
+#endif
+
+namespace decaptcha{
+namespace health_error{
+namespace detail {
+	class error_category_impl;
+}
+
+template<class error_category>
+const boost::system::error_category& error_category_single()
+{
+	static error_category error_category_instance;
+	return reinterpret_cast<const boost::system::error_category&>(error_category_instance);
+}
+
+inline const boost::system::error_category& error_category()
+{
+	return error_category_single<detail::error_category_impl>();
+}
+
+enum errc_t{
+	all_circuits_open = 1,
+};
+
+/*
+ * 解码器的 error_category 用 default_error_condition 把一些错误映射到 not_provider_fault,
+ * 比如本地识别没把握, 图片太大不用上传. 这些错误说明不了解码器背后的服务好不好,
+ * decoder_health::record 像对待取消一样对待它们, 既不算成功也不算失败.
+ */
+enum condition_t{
+	not_provider_fault = 2,
+};
+
+inline boost::system::error_code make_error_code(errc_t e)
+{
+	return boost::system::error_code(static_cast<int>(e), error_category());
+}
+
+inline boost::system::error_condition make_error_condition(condition_t e)
+{
+	return boost::system::error_condition(static_cast<int>(e), error_category());
+}
+
+} // namespace health_error
+} // namespace decaptcha
+
+namespace boost {
+namespace system {
+
+template <>
+struct is_error_code_enum<decaptcha::health_error::errc_t>
+{
+  static const bool value = true;
+};
+
+template <>
+struct is_error_condition_enum<decaptcha::health_error::condition_t>
+{
+  static const bool value = true;
+};
+
+} // namespace system
+} // namespace boost
+
+namespace decaptcha{
+namespace health_error{
+namespace detail{
+
+class error_category_impl
+  : public boost::system::error_category
+{
+	virtual const char* name() const BOOST_SYSTEM_NOEXCEPT
+	{
+		return "decoder health";
+	}
+
+	virtual std::string message(int e) const
+	{
+		switch (e)
+		{
+		case all_circuits_open:
+			return "all decoders are failing and temporarily skipped";
+		case not_provider_fault:
+			return "the decoder gave up without blaming its provider";
+		default:
+			return "decoder health ERROR";
+		}
+	}
+};
+
+} // namespace detail
+} // namespace health_error
+
+// 熔断的参数, 通过 deCAPTCHA::set_circuit_breaker 设置.
+struct circuit_config{
+	circuit_config()
+		: max_consecutive_failures(5), window(20), min_window_samples(10), max_error_rate(0.5),
+		  cooldown(boost::posix_time::seconds(30)), max_cooldown(boost::posix_time::minutes(5)),
+		  ramp_start(0.125)
+	{
+	}
+
+	// 连续失败这么多次就熔断.
+	std::size_t max_consecutive_failures;
+	// 最近 window 个结果里, 样本不少于 min_window_samples 而且失败率达到 max_error_rate 也熔断.
+	std::size_t window, min_window_samples;
+	double max_error_rate;
+	// 熔断后过了 cooldown 才放一个验证码去试探, 试探失败了 cooldown 翻倍, 最多 max_cooldown.
+	boost::posix_time::time_duration cooldown, max_cooldown;
+	// 试探成功后, 一开始只分给它 ramp_start 比例的验证码, 之后每成功一次翻倍, 直到全部恢复.
+	double ramp_start;
+};
+
+/*
+ * decoder_health 跟踪一个解码器的健康状况, 实现熔断.
+ *
+ * 平台挂掉的时候, 每个验证码都要走一遍上传和好几轮查询才会失败, 白白等几十秒.
+ * 熔断之后 deCAPTCHA 直接跳过这个解码器. 冷却时间过了以后只放一个验证码去试探 (半开),
+ * 试探成功才重新接入, 而且分到的验证码按比例慢慢增加, 免得刚恢复的平台又被压垮.
+ *
+ * 每次 allow() 返回 true, 都要在解码器返回后调用一次 record_xxx, 并把 allow() 给的 probe 原样传回来.
+ * 熔断之前就发出去的验证码可能在半开的时候才返回, 只有带着当前试探的 probe 的结果才决定熔断的状态,
+ * 其他的只计入统计. 多个线程可以同时使用.
+ */
+class decoder_health{
+public:
+	enum circuit_state{
+		circuit_closed,
+		circuit_open,
+		circuit_half_open,
+	};
+
+	enum { max_window = 64 };
+
+	// 半开时放出去的试探的编号, 不是试探的为 0.
+	typedef boost::uint64_t probe_ticket;
+
+	explicit decoder_health(const circuit_config & config = circuit_config())
+		: m_config(config), m_state(circuit_closed), m_probe(0), m_last_probe(0), m_share(1), m_credit(0),
+		  m_consecutive_failures(0), m_window_size(0), m_window_next(0), m_window_failures(0),
+		  m_timeouts(0), m_cooldown(config.cooldown)
+	{
+	}
+
+	void set_config(const circuit_config & config)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_config = config;
+		m_cooldown = config.cooldown;
+		reset_window();
+	}
+
+	// 这次要不要交给这个解码器. 放行的是半开时的试探的话, probe 是它的编号, 否则是 0.
+	bool allow(probe_ticket & probe)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		probe = 0;
+		if (m_state == circuit_open)
+		{
+			if (now() < m_open_until)
+				return false;
+			m_state = circuit_half_open;
+			m_probe = 0;
+		}
+
+		if (m_state == circuit_half_open)
+		{
+			// 同一时间只有一个试探.
+			if (m_probe)
+				return false;
+			m_probe = probe = ++m_last_probe;
+			return true;
+		}
+
+		if (m_share >= 1)
+			return true;
+
+		m_credit += m_share;
+		if (m_credit < 1)
+			return false;
+		m_credit -= 1;
+		return true;
+	}
+
+	void record_success(probe_ticket probe = 0)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		m_consecutive_failures = 0;
+		push_outcome(false);
+
+		if (is_current_probe(probe))
+		{
+			// 试探成功, 重新接入, 从 ramp_start 开始.
+			m_state = circuit_closed;
+			m_probe = 0;
+			m_cooldown = m_config.cooldown;
+			m_share = m_config.ramp_start;
+			m_credit = 0;
+			reset_window();
+		}
+		else if (m_state == circuit_closed && m_share < 1)
+		{
+			m_share = (std::min)(m_share * 2, 1.0);
+		}
+	}
+
+	// timeout 为 true 表示等太久放弃了, 而不是平台返回了错误.
+	void record_failure(bool timeout, probe_ticket probe = 0)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		m_consecutive_failures ++;
+		if (timeout)
+			m_timeouts ++;
+		push_outcome(true);
+
+		if (is_current_probe(probe))
+		{
+			// 试探失败, 冷却时间翻倍.
+			m_cooldown = (std::min)(m_cooldown * 2, m_config.max_cooldown);
+			open();
+		}
+		else if (m_state == circuit_closed)
+		{
+			// 还在恢复期就又失败了, 或者失败得太多, 熔断.
+			if (m_share < 1 || m_consecutive_failures >= m_config.max_consecutive_failures || window_tripped())
+				open();
+		}
+	}
+
+	// 被取消了, 不算成功也不算失败. 是试探的话, 可以再放一个试探.
+	void record_aborted(probe_ticket probe = 0)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		if (is_current_probe(probe))
+			m_probe = 0;
+	}
+
+	// 按解码器返回的 ec 调用对应的 record_xxx.
+	void record(const boost::system::error_code & ec, probe_ticket probe = 0)
+	{
+		if (!ec)
+			record_success(probe);
+		else if (ec == boost::asio::error::operation_aborted)
+			record_aborted(probe);
+		// 并发名额满了根本没有交给服务商, 说明不了它好不好.
+		else if (ec == concurrency_error::provider_busy)
+			record_aborted(probe);
+		// 本地识别没把握, 本地检查就知道传不上去的图片, 也说明不了.
+		else if (ec == health_error::not_provider_fault)
+			record_aborted(probe);
+		else
+			record_failure(ec == boost::asio::error::timed_out
+				|| ec == boost::system::errc::timed_out || ec == boost::system::errc::operation_canceled, probe);
+	}
+
+	circuit_state state() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_state;
+	}
+
+	// 最近 window 个结果的失败率.
+	double error_rate() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_window_size ? double(m_window_failures) / m_window_size : 0;
+	}
+
+	std::size_t consecutive_failures() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_consecutive_failures;
+	}
+
+	boost::uint64_t timeouts() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_timeouts;
+	}
+
+	// 恢复期内分到的验证码比例, 1 表示完全恢复.
+	double traffic_share() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_state == circuit_closed ? m_share : 0;
+	}
+
+private:
+	static boost::posix_time::ptime now()
+	{
+		return boost::posix_time::microsec_clock::universal_time();
+	}
+
+	bool is_current_probe(probe_ticket probe) const
+	{
+		return m_state == circuit_half_open && probe != 0 && probe == m_probe;
+	}
+
+	void open()
+	{
+		m_state = circuit_open;
+		m_probe = 0;
+		m_open_until = now() + m_cooldown;
+	}
+
+	std::size_t window_capacity() const
+	{
+		return (std::min)((std::max)(m_config.window, std::size_t(1)), std::size_t(max_window));
+	}
+
+	void push_outcome(bool failed)
+	{
+		std::size_t capacity = window_capacity();
+		if (m_window_size == capacity)
+			m_window_failures -= m_window[m_window_next];
+		else
+			m_window_size ++;
+
+		m_window[m_window_next] = failed;
+		m_window_failures += failed;
+		m_window_next = (m_window_next + 1) % capacity;
+	}
+
+	void reset_window()
+	{
+		m_window_size = m_window_next = m_window_failures = 0;
+	}
+
+	bool window_tripped() const
+	{
+		return m_window_size >= m_config.min_window_samples
+			&& double(m_window_failures) / m_window_size >= m_config.max_error_rate;
+	}
+
+private:
+	mutable boost::asio::detail::mutex m_mutex;
+	circuit_config m_config;
+
+	circuit_state m_state;
+	// 半开的时候已经放出去的试探, 没有是 0.
+	probe_ticket m_probe, m_last_probe;
+	// 恢复期的比例, 每次 allow 攒 m_share 的额度, 攒够 1 放一个.
+	double m_share, m_credit;
+
+	std::size_t m_consecutive_failures;
+	bool m_window[max_window];
+	std::size_t m_window_size, m_window_next, m_window_failures;
+	boost::uint64_t m_timeouts;
+
+	boost::posix_time::time_duration m_cooldown;
+	boost::posix_time::ptime m_open_until;
+};
+
+} // namespace decaptcha
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "decoder_stats.hpp"
+
+namespace decaptcha{
+
+// 每个验证码按什么顺序使用解码器.
+enum routing_objective{
+	// 按 add_decoder 的顺序.
+	route_static,
+	// 期望耗时最短的优先.
+	route_fastest,
+	// 耗时在 sla 以内的解码器里最便宜的优先, 超出 sla 的排在后面, 按耗时排.
+	route_cheapest_within_sla,
+	// 按 latency_weight * 期望耗时 (秒) + cost_weight * 期望花费 打分, 分低的优先.
+	route_weighted,
+};
+
+// 通过 deCAPTCHA::set_routing 设置.
+struct routing_config{
+	routing_config()
+		: objective(route_static), sla(boost::posix_time::seconds(30)),
+		  latency_weight(1), cost_weight(1), default_latency(boost::posix_time::seconds(15))
+	{
+	}
+
+	routing_objective objective;
+	// route_cheapest_within_sla 用, 和解码器的 p90 耗时比较.
+	boost::posix_time::time_duration sla;
+	// route_weighted 用. 花费的单位就是 add_decoder 时给的 cost 的单位.
+	double latency_weight, cost_weight;
+	// 样本还不够的解码器, 当作这个耗时.
+	boost::posix_time::time_duration default_latency;
+};
+
+namespace detail{
+
+// 一个解码器在排序时用到的估计值.
+struct decoder_estimate{
+	// 试一次能拿到正确答案的概率: 有答案 (本地识别没把握, 服务商出错都算没有) 而且答案没被 reportbad.
+	double success;
+	// 拿到一个正确答案期望的耗时 (秒) 和花费. 试一次的耗时按所有结果平均, 没答案要换下一个, 所以都除以 success.
+	// 按耗时从小到大试, 就是期望总耗时最短的顺序, 又快又便宜但是常常没把握的本地识别会排在前面.
+	double latency, cost;
+	// 成功的 p90 耗时, 秒.
+	double tail_latency;
+};
+
+inline double seconds_or(boost::posix_time::time_duration d, boost::posix_time::time_duration fallback)
+{
+	if (d.is_special())
+		d = fallback;
+	return d.total_milliseconds() / 1000.0;
+}
+
+inline decoder_estimate estimate_decoder(const decoder_stats & stats, double cost, const routing_config & config)
+{
+	decoder_estimate e;
+	e.success = (std::max)(stats.answer_rate() * stats.accuracy(), 0.01);
+	e.latency = seconds_or(stats.mean_attempt_latency(), config.default_latency) / e.success;
+	e.cost = cost / e.success;
+	e.tail_latency = seconds_or(stats.latency_percentile(0.9), config.default_latency);
+	return e;
+}
+
+// 按 config 把解码器排序, 结果是解码器的下标. 分数相同的按 add_decoder 的顺序.
+inline void route_decoders(const std::vector<boost::shared_ptr<decoder_stats> > & stats,
+	const std::vector<double> & cost, const routing_config & config, std::vector<std::size_t> & order)
+{
+	std::size_t n = stats.size();
+	order.resize(n);
+
+	if (config.objective == route_static)
+	{
+		for (std::size_t i = 0; i < n; i++)
+			order[i] = i;
+		return;
+	}
+
+	double sla = config.sla.total_milliseconds() / 1000.0;
+
+	// (分数, 下标), 分数低的优先.
+	std::vector<std::pair<std::pair<double, double>, std::size_t> > scored(n);
+	for (std::size_t i = 0; i < n; i++)
+	{
+		decoder_estimate e = estimate_decoder(*stats[i], cost[i], config);
+		std::pair<double, double> score;
+
+		switch (config.objective)
+		{
+		case route_fastest:
+			score = std::make_pair(e.latency, e.cost);
+			break;
+		case route_cheapest_within_sla:
+			// 满足 sla 的排前面按花费, 不满足的排后面按耗时.
+			if (e.tail_latency <= sla)
+				score = std::make_pair(0.0, e.cost);
+			else
+				score = std::make_pair(1.0, e.latency);
+			break;
+		default:
+			score = std::make_pair(config.latency_weight * e.latency + config.cost_weight * e.cost, 0.0);
+			break;
+		}
+		scored[i] = std::make_pair(score, i);
+	}
+
+	std::sort(scored.begin(), scored.end());
+	for (std::size_t i = 0; i < n; i++)
+		order[i] = scored[i].second;
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace decaptcha{
+
+/*
+ * decoder_stats 记录一个解码器最近的识别耗时, 以及它的答案被 reportbad 的比例.
+ * 另外记录最近每一次尝试 (不管有没有答案) 的耗时和结果, 路由用它估计试一次的代价.
+ *
+ * 只保留最近 max_samples 个样本, 这样服务商白天晚上速度变化的时候能跟上.
+ * 多个线程可以同时记录和读取, 不加锁: 写的位置用原子计数器分配, 每个样本各自是原子的.
+ */
+class decoder_stats{
+public:
+	enum { max_samples = 64, min_samples = 5 };
+
+	decoder_stats()
+		: m_next(0), m_attempt_next(0), m_solved(0), m_wrong(0)
+	{
+		for (int i = 0; i < max_samples; i++)
+		{
+			m_samples[i].store(0, boost::memory_order_relaxed);
+			m_attempts[i].store(0, boost::memory_order_relaxed);
+		}
+	}
+
+	void record_latency(boost::posix_time::time_duration latency)
+	{
+		std::size_t n = m_next.fetch_add(1, boost::memory_order_relaxed);
+		m_samples[n % max_samples].store(latency.total_milliseconds(), boost::memory_order_release);
+	}
+
+	// 解码器返回了, 没有答案的也算 (本地识别没把握, 服务商出错), 被取消的不算.
+	void record_attempt(boost::posix_time::time_duration elapsed, bool answered)
+	{
+		std::size_t n = m_attempt_next.fetch_add(1, boost::memory_order_relaxed);
+		// 最低位记有没有答案.
+		m_attempts[n % max_samples].store(elapsed.total_milliseconds() * 2 + (answered ? 1 : 0), boost::memory_order_release);
+	}
+
+	std::size_t attempt_count() const
+	{
+		return (std::min)(m_attempt_next.load(boost::memory_order_acquire), std::size_t(max_samples));
+	}
+
+	// 最近的尝试里有答案的比例. 和 accuracy 一样先假设有 10 个虚拟样本, 9 个有答案.
+	double answer_rate() const
+	{
+		std::size_t count = attempt_count(), answered = 0;
+		for (std::size_t i = 0; i < count; i++)
+			answered += m_attempts[i].load(boost::memory_order_acquire) & 1;
+		return (answered + 9.0) / (count + 10.0);
+	}
+
+	// 最近的尝试平均一次的耗时, 有没有答案都算. 样本少于 min_samples 的时候返回 not_a_date_time.
+	boost::posix_time::time_duration mean_attempt_latency() const
+	{
+		std::size_t count = attempt_count();
+		if (count < min_samples)
+			return boost::posix_time::time_duration(boost::posix_time::not_a_date_time);
+
+		boost::int64_t total = 0;
+		for (std::size_t i = 0; i < count; i++)
+			total += m_attempts[i].load(boost::memory_order_acquire) / 2;
+		return boost::posix_time::milliseconds(total / static_cast<boost::int64_t>(count));
+	}
+
+	// 它的答案被采用了.
+	void record_solved()
+	{
+		m_solved.fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	// 被采用的答案被 reportbad 了.
+	void record_wrong()
+	{
+		m_wrong.fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	// 被采用的答案里正确的比例. 先假设有 10 个虚拟样本错 1 个, 没有数据的时候是 0.9, 样本多了接近真实值.
+	double accuracy() const
+	{
+		double solved = static_cast<double>(m_solved.load(boost::memory_order_relaxed));
+		double wrong = (std::min)(static_cast<double>(m_wrong.load(boost::memory_order_relaxed)), solved);
+		return (solved - wrong + 9) / (solved + 10);
+	}
+
+	std::size_t sample_count() const
+	{
+		return (std::min)(m_next.load(boost::memory_order_acquire), std::size_t(max_samples));
+	}
+
+	// 返回 percentile (0 ~ 1) 分位的耗时, 样本少于 min_samples 的时候返回 not_a_date_time.
+	boost::posix_time::time_duration latency_percentile(double percentile) const
+	{
+		std::vector<boost::int64_t> samples;
+		copy_samples(samples);
+		return percentile_of(samples, percentile);
+	}
+
+	// 把样本 (毫秒) 追加到 samples 后面, 用于合并多个 decoder_stats.
+	void copy_samples(std::vector<boost::int64_t> & samples) const
+	{
+		std::size_t count = sample_count();
+		samples.reserve(samples.size() + count);
+		for (std::size_t i = 0; i < count; i++)
+			samples.push_back(m_samples[i].load(boost::memory_order_acquire));
+	}
+
+	static boost::posix_time::time_duration percentile_of(std::vector<boost::int64_t> & samples, double percentile)
+	{
+		std::size_t count = samples.size();
+		if (count < min_samples)
+			return boost::posix_time::time_duration(boost::posix_time::not_a_date_time);
+
+		std::size_t n = static_cast<std::size_t>(percentile * (count - 1) + 0.5);
+		n = (std::min)(n, count - 1);
+		std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+		return boost::posix_time::milliseconds(samples[n]);
+	}
+
+private:
+	boost::atomic<boost::int64_t> m_samples[max_samples];
+	boost::atomic<std::size_t> m_next;
+	boost::atomic<boost::int64_t> m_attempts[max_samples];
+	boost::atomic<std::size_t> m_attempt_next;
+	boost::atomic<boost::uint64_t> m_solved, m_wrong;
+};
+
+} // namespace decaptcha
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+
+extern "C" {
+#include <jpeglib.h>
+}
+#include <png.h>
+
+#include "image_format.hpp"
+
+namespace decaptcha{
+
+// 8 位灰度图, 一行接一行存放.
+struct gray_image{
+	gray_image()
+		: width(0), height(0)
+	{
+	}
+
+	unsigned char at(std::size_t x, std::size_t y) const
+	{
+		return pixels[y * width + x];
+	}
+
+	std::size_t width, height;
+	std::vector<unsigned char> pixels;
+};
+
+namespace detail{
+
+// 验证码不会有这么大的, 超过的直接当作坏图片.
+enum { max_image_dimension = 4096 };
+
+struct jpeg_error_manager{
+	jpeg_error_mgr pub;
+	std::jmp_buf jump;
+};
+
+// libjpeg 默认出错的时候直接 exit(), 这里跳回 decode_jpeg.
+inline void jpeg_error_exit(j_common_ptr cinfo)
+{
+	std::longjmp(reinterpret_cast<jpeg_error_manager*>(cinfo->err)->jump, 1);
+}
+
+inline void jpeg_output_message(j_common_ptr)
+{
+}
+
+} // namespace detail
+
+// 把 jpeg 数据解码成灰度图, 不是 jpeg 或者数据损坏返回 false.
+inline bool decode_jpeg(const std::string & buffer, gray_image & image)
+{
+	jpeg_decompress_struct cinfo;
+	detail::jpeg_error_manager jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = &detail::jpeg_error_exit;
+	jerr.pub.output_message = &detail::jpeg_output_message;
+
+	if (setjmp(jerr.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, reinterpret_cast<unsigned char*>(const_cast<char*>(buffer.data())), buffer.size());
+
+	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK
+		|| cinfo.image_width > detail::max_image_dimension || cinfo.image_height > detail::max_image_dimension)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	jpeg_start_decompress(&cinfo);
+
+	image.width = cinfo.output_width;
+	image.height = cinfo.output_height;
+	image.pixels.resize(image.width * image.height);
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW row = &image.pixels[cinfo.output_scanline * image.width];
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return image.width > 0 && image.height > 0;
+}
+
+// 把 png 数据解码成灰度图, 彩色的转成灰度.
+inline bool decode_png(const std::string & buffer, gray_image & image)
+{
+	png_image png;
+	std::memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_memory(&png, buffer.data(), buffer.size()))
+		return false;
+
+	if (png.width == 0 || png.height == 0
+		|| png.width > detail::max_image_dimension || png.height > detail::max_image_dimension)
+	{
+		png_image_free(&png);
+		return false;
+	}
+
+	png.format = PNG_FORMAT_GRAY;
+	image.width = png.width;
+	image.height = png.height;
+	image.pixels.resize(image.width * image.height);
+	return png_image_finish_read(&png, NULL, &image.pixels[0], 0, NULL) != 0;
+}
+
+// 编码成 8 位灰度 png.
+inline bool encode_png(const gray_image & image, std::string & buffer)
+{
+	png_image png;
+	std::memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	png.width = image.width;
+	png.height = image.height;
+	png.format = PNG_FORMAT_GRAY;
+
+	png_alloc_size_t size = 0;
+	if (!png_image_write_to_memory(&png, NULL, &size, 0, &image.pixels[0], 0, NULL))
+		return false;
+
+	buffer.resize(size);
+	if (!png_image_write_to_memory(&png, &buffer[0], &size, 0, &image.pixels[0], 0, NULL))
+		return false;
+
+	buffer.resize(size);
+	return true;
+}
+
+// 按文件头选择解码器.
+inline bool decode_image(const std::string & buffer, gray_image & image)
+{
+	switch (sniff_image_format(buffer))
+	{
+	case image_jpeg:
+		return decode_jpeg(buffer, image);
+	case image_png:
+		return decode_png(buffer, image);
+	default:
+		return false;
+	}
+}
+
+// 双线性插值缩放到 width x height.
+inline void resize_image(const gray_image & src, std::size_t width, std::size_t height, gray_image & dst)
+{
+	dst.width = width;
+	dst.height = height;
+	dst.pixels.resize(width * height);
+
+	for (std::size_t y = 0; y < height; y++)
+	{
+		double fy = (y + 0.5) * src.height / height - 0.5;
+		fy = fy < 0 ? 0 : fy;
+		std::size_t y0 = (std::min)(static_cast<std::size_t>(fy), src.height - 1);
+		std::size_t y1 = (std::min)(y0 + 1, src.height - 1);
+		double wy = fy - y0;
+
+		for (std::size_t x = 0; x < width; x++)
+		{
+			double fx = (x + 0.5) * src.width / width - 0.5;
+			fx = fx < 0 ? 0 : fx;
+			std::size_t x0 = (std::min)(static_cast<std::size_t>(fx), src.width - 1);
+			std::size_t x1 = (std::min)(x0 + 1, src.width - 1);
+			double wx = fx - x0;
+
+			double top = src.at(x0, y0) * (1 - wx) + src.at(x1, y0) * wx;
+			double bottom = src.at(x0, y1) * (1 - wx) + src.at(x1, y1) * wx;
+			dst.pixels[y * width + x] = static_cast<unsigned char>(top * (1 - wy) + bottom * wy + 0.5);
+		}
+	}
+}
+
+} // namespace decaptcha
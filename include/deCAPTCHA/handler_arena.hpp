@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <new>
+#include <cstddef>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+
+namespace decaptcha{
+namespace detail{
+
+/*
+ * handler_arena 是一个验证码的 handler 内存.
+ *
+ * asio 每发起一个异步操作, 都要为 handler 分配一块内存, 完成的时候释放, strand 的 dispatch 也一样.
+ * 一个解码器 op 同时挂着的异步操作只有几个 (连接上的读写, 定时器, 取消, strand),
+ * 所以预留几块固定大小的 slot 轮流使用, 放不下或者都在用的时候才去堆上分配.
+ * arena 放在 op 的 state 里, 验证码完成的时候和 state 一起释放.
+ *
+ * op 通过 asio_handler_allocate/asio_handler_deallocate 这两个 hook 使用 arena,
+ * 包在 op 外面的 strand::wrap, bind_handler 和 async_post_multipart 都会把 hook 转给 op.
+ *
+ * 释放可能发生在 strand 以外的线程 (reactor 先释放 handler 的内存, 再把 handler 交给 strand),
+ * 所以每个 slot 的占用标记是原子的.
+ */
+class handler_arena : boost::noncopyable
+{
+public:
+	BOOST_STATIC_CONSTANT(std::size_t, slot_size = 256);
+	BOOST_STATIC_CONSTANT(std::size_t, slot_count = 6);
+
+	handler_arena()
+	{
+		for (std::size_t i = 0; i < slot_count; i++)
+			m_in_use[i].store(false, boost::memory_order_relaxed);
+	}
+
+	void * allocate(std::size_t size)
+	{
+		if (size <= slot_size)
+		{
+			for (std::size_t i = 0; i < slot_count; i++)
+			{
+				if (!m_in_use[i].exchange(true, boost::memory_order_acquire))
+					return slot(i);
+			}
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void * pointer)
+	{
+		char * p = static_cast<char *>(pointer);
+		char * begin = static_cast<char *>(m_storage.address());
+
+		if (p >= begin && p < begin + slot_size * slot_count)
+			m_in_use[(p - begin) / slot_size].store(false, boost::memory_order_release);
+		else
+			::operator delete(pointer);
+	}
+
+private:
+	void * slot(std::size_t index)
+	{
+		return static_cast<char *>(m_storage.address()) + index * slot_size;
+	}
+
+private:
+	boost::aligned_storage<slot_size * slot_count> m_storage;
+	boost::atomic<bool> m_in_use[slot_count];
+};
+
+} // namespace detail
+} // namespace decaptcha
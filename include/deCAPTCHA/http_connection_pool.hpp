@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <avhttp.hpp>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#endif
+
+namespace decaptcha{
+namespace detail{
+
+// 不阻塞的检查 socket 是否可读.
+inline bool socket_readable(boost::asio::ip::tcp::socket::native_handle_type fd)
+{
+#if defined(_WIN32)
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(fd, &readfds);
+	timeval tv = { 0, 0 };
+	return ::select(0, &readfds, 0, 0, &tv) > 0;
+#else
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return ::poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+/*
+ * 空闲的连接能不能再用.
+ *
+ * 空闲的 keep-alive 连接上不应该有任何数据. 可读却没有数据说明服务器已经关闭了连接,
+ * 有数据说明上一个响应没有读完.
+ */
+inline bool is_stale_connection(avhttp::http_stream & stream)
+{
+	if (!stream.is_open())
+		return true;
+
+	boost::system::error_code ec;
+	std::size_t available = stream.lowest_layer().available(ec);
+	if (ec || available > 0)
+		return true;
+
+	return socket_readable(stream.lowest_layer().native_handle());
+}
+
+class http_connection_pool_impl
+	: boost::noncopyable, public boost::enable_shared_from_this<http_connection_pool_impl>
+{
+	struct idle_connection{
+		boost::shared_ptr<avhttp::http_stream> stream;
+		boost::posix_time::ptime since;
+	};
+	typedef std::deque<idle_connection> idle_list;
+
+public:
+	typedef boost::function<void (boost::shared_ptr<avhttp::http_stream>)> acquire_handler;
+
+private:
+	// 一个 host 的空闲连接, 借出去的连接数和排队等连接的.
+	struct host_state{
+		host_state() : active(0) {}
+
+		idle_list idle;
+		std::size_t active;
+		std::deque<acquire_handler> waiters;
+	};
+	typedef std::map<std::string, host_state> host_map;
+
+	// 借出去的连接被释放的时候, 还回连接池.
+	struct give_back_op{
+		boost::weak_ptr<http_connection_pool_impl> pool;
+		std::string key;
+		boost::shared_ptr<avhttp::http_stream> owner;
+
+		void operator()(avhttp::http_stream *)
+		{
+			boost::shared_ptr<avhttp::http_stream> stream;
+			stream.swap(owner);
+
+			if (boost::shared_ptr<http_connection_pool_impl> p = pool.lock())
+				p->give_back(key, stream);
+		}
+	};
+
+public:
+	explicit http_connection_pool_impl(boost::asio::io_service & io_service)
+		: m_io_service(io_service), m_sweep_timer(io_service),
+		  m_max_per_host(4), m_max_active_per_host(16), m_idle_timeout(boost::posix_time::seconds(30)),
+		  m_sweeping(false), m_shutdown(false)
+	{
+	}
+
+	// 不受 max_active_per_host 限制, 只用于偶尔发一次的请求.
+	boost::shared_ptr<avhttp::http_stream> acquire(const std::string & url)
+	{
+		std::string key = host_key(url);
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		host_state & host = m_hosts[key];
+		host.active++;
+		return lend(key, take_idle(host));
+	}
+
+	// 借出去的连接数没到上限就立即借, 否则排队, 有连接还回来的时候按顺序分给排队的.
+	// handler 总是通过 io_service::post 调用.
+	void async_acquire(const std::string & url, const acquire_handler & handler)
+	{
+		std::string key = host_key(url);
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		host_state & host = m_hosts[key];
+		if (host.active >= m_max_active_per_host)
+		{
+			host.waiters.push_back(handler);
+			return;
+		}
+
+		host.active++;
+		m_io_service.post(boost::bind(handler, lend(key, take_idle(host))));
+	}
+
+	void set_max_per_host(std::size_t max_per_host)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_max_per_host = max_per_host;
+	}
+
+	// 调大的话, 排队的马上就能借到.
+	void set_max_active_per_host(std::size_t max_active_per_host)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_max_active_per_host = (std::max)(max_active_per_host, std::size_t(1));
+
+		for (host_map::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+		{
+			host_state & host = it->second;
+			while (!host.waiters.empty() && host.active < m_max_active_per_host)
+			{
+				host.active++;
+				post_waiter(it->first, host, take_idle(host));
+			}
+		}
+	}
+
+	void set_idle_timeout(boost::posix_time::time_duration idle_timeout)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_idle_timeout = idle_timeout;
+	}
+
+	std::size_t idle_count() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		std::size_t count = 0;
+		for (host_map::const_iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+			count += it->second.idle.size();
+		return count;
+	}
+
+	std::size_t active_count(const std::string & url) const
+	{
+		std::string key = host_key(url);
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		host_map::const_iterator it = m_hosts.find(key);
+		return it == m_hosts.end() ? 0 : it->second.active;
+	}
+
+	void shutdown()
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_shutdown = true;
+
+		boost::system::error_code ignore_ec;
+		m_sweep_timer.cancel(ignore_ec);
+
+		// 排队的 handler 直接丢掉, io_service 正在析构, 不会再有人等它们.
+		for (host_map::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+		{
+			for (std::size_t i = 0; i < it->second.idle.size(); i++)
+				close(*it->second.idle[i].stream);
+			it->second.idle.clear();
+			it->second.waiters.clear();
+		}
+	}
+
+private:
+	// 和 avhttp::url 解析的结果一样是 protocol://host:port, 每次借连接都要算, 所以直接在 url 上找,
+	// 不用把整个 url 拆成好几个字符串. 带用户名或者 IPv6 地址这种少见的才交给 avhttp::url.
+	static std::string host_key(const std::string & url)
+	{
+		std::string::size_type scheme_end = url.find("://");
+		std::string::size_type host_begin = scheme_end + 3;
+		std::string::size_type host_end = scheme_end == std::string::npos
+			? std::string::npos : url.find_first_of(":/?#@[", host_begin);
+
+		if (scheme_end == std::string::npos || host_begin == host_end
+			|| (host_end != std::string::npos && (url[host_end] == '@' || url[host_end] == '['))
+			|| url.find('@', host_begin) < url.find_first_of("/?#", host_begin))
+		{
+			avhttp::url u(url);
+			return u.protocol() + "://" + u.host() + ":" + boost::lexical_cast<std::string>(u.port());
+		}
+
+		std::string key;
+		key.reserve((std::min)(url.size(), host_end) + 6);
+		key.append(url, 0, (std::min)(url.size(), host_end));
+		key += ':';
+
+		if (host_end != std::string::npos && url[host_end] == ':')
+		{
+			std::string::size_type port_end = url.find_first_of("/?#", host_end + 1);
+			key.append(url, host_end + 1, port_end == std::string::npos ? std::string::npos : port_end - host_end - 1);
+		}
+		else if (scheme_end == 5 && url.compare(0, 5, "https") == 0)
+			key += "443";
+		else
+			key += "80";
+		return key;
+	}
+
+	static void close(avhttp::http_stream & stream)
+	{
+		boost::system::error_code ignore_ec;
+		stream.close(ignore_ec);
+	}
+
+	// 最近还回来的连接最可能还活着, 没有能用的就新建一个. 在锁里调用.
+	boost::shared_ptr<avhttp::http_stream> take_idle(host_state & host)
+	{
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+		while (!host.idle.empty())
+		{
+			idle_connection c = host.idle.back();
+			host.idle.pop_back();
+
+			if (now - c.since < m_idle_timeout && !is_stale_connection(*c.stream))
+				return c.stream;
+			close(*c.stream);
+		}
+
+		return boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
+	}
+
+	// 包一层, 最后一个指针释放的时候还回来.
+	boost::shared_ptr<avhttp::http_stream> lend(const std::string & key, boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		give_back_op op;
+		op.pool = shared_from_this();
+		op.key = key;
+		op.owner = stream;
+		return boost::shared_ptr<avhttp::http_stream>(stream.get(), op);
+	}
+
+	// 把一个名额交给排队的第一个. 在锁里调用, 名额已经算进 active 了.
+	void post_waiter(const std::string & key, host_state & host, boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		acquire_handler handler;
+		handler.swap(host.waiters.front());
+		host.waiters.pop_front();
+		m_io_service.post(boost::bind(handler, lend(key, stream)));
+	}
+
+	// 借出去的连接可能在任意线程释放.
+	void give_back(const std::string & key, boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		host_state & host = m_hosts[key];
+		host.active--;
+
+		if (m_shutdown)
+			return;
+
+		// 有人在排队, 名额直接转给它, 连接还能用的话连接也一起给.
+		if (!host.waiters.empty())
+		{
+			if (is_stale_connection(*stream))
+			{
+				close(*stream);
+				stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
+			}
+			host.active++;
+			post_waiter(key, host, stream);
+			return;
+		}
+
+		// 放进空闲列表的连接借出去之前还会再检查一次.
+		if (!stream->is_open() || host.idle.size() >= m_max_per_host)
+		{
+			close(*stream);
+			return;
+		}
+
+		idle_connection c;
+		c.stream = stream;
+		c.since = boost::posix_time::microsec_clock::universal_time();
+		host.idle.push_back(c);
+
+		start_sweep();
+	}
+
+	void start_sweep()
+	{
+		if (m_sweeping)
+			return;
+
+		m_sweeping = true;
+		m_sweep_timer.expires_from_now(m_idle_timeout);
+		m_sweep_timer.async_wait(
+			boost::bind(&http_connection_pool_impl::handle_sweep,
+				boost::weak_ptr<http_connection_pool_impl>(shared_from_this()), boost::asio::placeholders::error)
+		);
+	}
+
+	static void handle_sweep(boost::weak_ptr<http_connection_pool_impl> weak_pool, boost::system::error_code ec)
+	{
+		boost::shared_ptr<http_connection_pool_impl> pool = weak_pool.lock();
+		if (!pool)
+			return;
+
+		boost::asio::detail::mutex::scoped_lock l(pool->m_mutex);
+		pool->m_sweeping = false;
+		if (ec || pool->m_shutdown)
+			return;
+
+		pool->sweep();
+	}
+
+	// 关掉空闲太久的连接, 还有空闲连接的话继续定时清理.
+	void sweep()
+	{
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		bool has_idle = false;
+
+		for (host_map::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+		{
+			idle_list & idle = it->second.idle;
+			while (!idle.empty() && now - idle.front().since >= m_idle_timeout)
+			{
+				close(*idle.front().stream);
+				idle.pop_front();
+			}
+			has_idle = has_idle || !idle.empty();
+		}
+
+		if (has_idle)
+			start_sweep();
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	// 保护下面所有的成员, 包括 m_sweep_timer.
+	mutable boost::asio::detail::mutex m_mutex;
+	boost::asio::deadline_timer m_sweep_timer;
+
+	host_map m_hosts;
+
+	std::size_t m_max_per_host;
+	std::size_t m_max_active_per_host;
+	boost::posix_time::time_duration m_idle_timeout;
+
+	bool m_sweeping;
+	bool m_shutdown;
+};
+
+} // namespace detail
+
+/*
+ * http_connection_pool 是所有解码器共用的 HTTP/1.1 keep-alive 连接池, 每个 io_service 一个.
+ *
+ * acquire 返回的 http_stream 释放的时候会自动还回连接池, 不用手动归还.
+ * 每个 host 同时借出去的连接最多 max_active_per_host 个 (默认 16), 超过的 async_acquire 排队,
+ * 验证码再多, 连到一个服务商的 socket 数也是有限的, 不会耗尽本地端口.
+ * 每个 host 最多保留 max_per_host 个空闲连接, 空闲超过 idle_timeout 的连接会被关闭.
+ * 借出之前会检查连接是否已经被服务器关闭, 或者上次的响应没有读完.
+ * 可以在多个线程里同时借还.
+ */
+class http_connection_pool
+	: public boost::asio::detail::service_base<http_connection_pool>
+{
+public:
+	explicit http_connection_pool(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<http_connection_pool>(io_service),
+		  m_impl(boost::make_shared<detail::http_connection_pool_impl>(boost::ref(io_service)))
+	{
+	}
+
+	// 借一个连到 url 所在 host 的连接, 没有空闲的就新建一个. 不受 max_active_per_host 限制.
+	boost::shared_ptr<avhttp::http_stream> acquire(const std::string & url)
+	{
+		return m_impl->acquire(url);
+	}
+
+	// 借到的时候 handler(stream) 被 post 到 io_service, 借出去的连接太多的时候排队.
+	void async_acquire(const std::string & url, const detail::http_connection_pool_impl::acquire_handler & handler)
+	{
+		m_impl->async_acquire(url, handler);
+	}
+
+	void set_max_per_host(std::size_t max_per_host)
+	{
+		m_impl->set_max_per_host(max_per_host);
+	}
+
+	void set_max_active_per_host(std::size_t max_active_per_host)
+	{
+		m_impl->set_max_active_per_host(max_active_per_host);
+	}
+
+	void set_idle_timeout(boost::posix_time::time_duration idle_timeout)
+	{
+		m_impl->set_idle_timeout(idle_timeout);
+	}
+
+	std::size_t idle_count() const
+	{
+		return m_impl->idle_count();
+	}
+
+	// 借出去还没还回来的连接数.
+	std::size_t active_count(const std::string & url) const
+	{
+		return m_impl->active_count(url);
+	}
+
+private:
+	void shutdown_service()
+	{
+		m_impl->shutdown();
+	}
+
+private:
+	boost::shared_ptr<detail::http_connection_pool_impl> m_impl;
+};
+
+namespace detail{
+
+inline boost::shared_ptr<avhttp::http_stream> acquire_http_stream(boost::asio::io_service & io_service, const std::string & url)
+{
+	return boost::asio::use_service<http_connection_pool>(io_service).acquire(url);
+}
+
+template<class Handler>
+void async_acquire_http_stream(boost::asio::io_service & io_service, const std::string & url, Handler handler)
+{
+	boost::asio::use_service<http_connection_pool>(io_service).async_acquire(url, handler);
+}
+
+// 服务商忙不过来时返回的 HTTP 状态, 交给 concurrency_limiter 减少并发.
+inline bool is_http_overload(const boost::system::error_code & ec)
+{
+	return ec == avhttp::errc::internal_server_error || ec == avhttp::errc::bad_gateway
+		|| ec == avhttp::errc::service_unavailable || ec == avhttp::errc::gateway_timeout;
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -19,7 +19,6 @@
 #pragma once
 #include <string>
 #include <fstream>
-#include <boost/regex.hpp>
 #include <boost/random.hpp>
 #include <boost/format.hpp>
 #include <boost/make_shared.hpp>
@@ -33,7 +32,18 @@ namespace pt = boost::property_tree;
 #include <boost/property_tree/json_parser.hpp>
 namespace js = boost::property_tree::json_parser;
 
-#include <boost/timedcall.hpp>
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "http_connection_pool.hpp"
+#include "streambuf_pool.hpp"
+#include "response_parser.hpp"
+#include "concurrency_limit.hpp"
+#include "decoder_health.hpp"
+#include "poll_schedule.hpp"
+#include "timer_wheel.hpp"
+#include "poll_multiplexer.hpp"
+#include "multipart.hpp"
+#include "image_format.hpp"
 
 #ifndef BOOST_SYSTEM_NOEXCEPT
   #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
@@ -145,131 +155,224 @@ class error_category_impl
 			return "hydati ERROR";
 		}
 	}
+
+	// 图片是空的, 太大或者格式不对, 是图片的问题, 不是服务商的.
+	virtual boost::system::error_condition default_error_condition(int e) const BOOST_SYSTEM_NOEXCEPT
+	{
+		switch (e)
+		{
+		case error::ERROR_ZERO_CAPTCHA_FILESIZE:
+		case error::ERROR_TOO_BIG_CAPTCHA_FILESIZE:
+		case error::ERROR_IMAGE_TYPE_NOT_SUPPORTED:
+			return decaptcha::health_error::not_provider_fault;
+		default:
+			return boost::system::error_condition(e, *this);
+		}
+	}
 };
 
-struct report_bad_op : boost::asio::coroutine
+struct report_bad_op
 {
-	report_bad_op(boost::asio::io_service & io_service, const std::string &authkey,
-			boost::shared_ptr<std::string> CAPTCHA_ID)
-	  : m_io_service(io_service), m_CAPTCHA_ID(CAPTCHA_ID), m_authkey(authkey)
+	// url 在识别成功的时候就拼好, report_bad_op 放得进 boost::function 自带的缓冲区.
+	report_bad_op(boost::asio::io_service & io_service, boost::shared_ptr<const std::string> url)
+	  : m_io_service(io_service), m_url(url)
 	{
 	}
 
 	// 调用这个开始报告错误.
 	void operator()()
 	{
-		// http://dt1.hydati.com:8080/response.php?action=error&auth_code=xxxx&sid=xxxxxx
-		m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-		m_buffers = boost::make_shared<boost::asio::streambuf>();
-
-		avhttp::async_read_body(*m_stream,
-								std::string(boost::str(boost::format("http://dt1.hydati.com:8080/response.php?action=error&auth_code=%s&sid=%s") % m_authkey % *m_CAPTCHA_ID)),
-								*m_buffers, *this);
-	}
-
-	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
-	{
-
+		decaptcha::detail::fetch_url_op op(m_io_service, *m_url,
+			avhttp::request_opts()(avhttp::http_options::connection, "keep-alive"), decaptcha::detail::ignore_fetch_result());
 	}
 
 private:
 	boost::asio::io_service & m_io_service;
-	const std::string m_authkey;
-	boost::shared_ptr<std::string> m_CAPTCHA_ID;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	boost::shared_ptr<const std::string> m_url;
 };
 
 inline report_bad_op report_bad_func(boost::asio::io_service & io_service,
-				const std::string & authkey,
-				boost::shared_ptr<std::string> CAPTCHA_ID)
+				const std::string & authkey, const std::string & CAPTCHA_ID)
 {
-	return report_bad_op(io_service, authkey, CAPTCHA_ID);
+	// http://dt1.hydati.com:8080/response.php?action=error&auth_code=xxxx&sid=xxxxxx
+	return report_bad_op(io_service, boost::make_shared<std::string>(
+		boost::str(boost::format("http://dt1.hydati.com:8080/response.php?action=error&auth_code=%s&sid=%s") % authkey % CAPTCHA_ID)));
 }
 
+/*
+ * 一个慧眼答题平台账号的设置, 解码器创建的时候准备好, 之后不再修改.
+ * 解码器和它启动的每一个 op 共用一份, handler 里拷贝的只是指针.
+ */
+struct account_info : boost::noncopyable
+{
+	account_info(boost::asio::io_service & io_service, const std::string & _authkey, const std::string & _dati_type)
+		: authkey(_authkey), dati_type(_dati_type),
+		  poller(decaptcha::detail::get_url_poll_multiplexer(io_service, "hydati",
+				avhttp::request_opts()
+					(avhttp::http_options::connection, "keep-alive")))
+	{
+		// extra_str 要 GB18030 编码, 只在这里转换一次.
+		form.field("dati_type", dati_type)
+			.field("acc_str", authkey)
+			.field("zz", "AboUqITw21cSDCnt")
+			.field("timeout", "40")
+			.file("pic")
+			.field("extra_str", boost::locale::conv::between("四个字母 不区分大小写","GB18030","UTF-8"));
+	}
+
+	const std::string authkey;
+	const std::string dati_type;
+	decaptcha::detail::multipart_form form;
+	boost::shared_ptr<decaptcha::detail::poll_multiplexer> poller;
+};
+
 template<class Handler>
 class hydati_decoder_op : boost::asio::coroutine
 {
-	std::string generate_boundary() const
+	typedef decaptcha::wheel_timer<decaptcha::detail::wait_handler<hydati_decoder_op> > timer_type;
+
+	// 一个验证码的所有状态. op 在每一步异步操作之间被拷贝, 拷贝的只是指向它的指针.
+	struct state : boost::noncopyable
 	{
-		boost::rand48 p(time(NULL));
-		return  boost::str(boost::format("%06x%06x") % p() %  p()  ).substr(0, 12);
-	}
+		state(boost::asio::io_service & _io_service, boost::shared_ptr<const account_info> _account, Handler _handler)
+			: io_service(_io_service),
+			  cancel(get_cancel_token(_handler)),
+			  strand(boost::make_shared<decaptcha::detail::op_strand>(boost::ref(_io_service))),
+			  timer(boost::make_shared<timer_type>(boost::ref(_io_service))),
+			  poll(decaptcha::detail::get_poll_schedule(_io_service, "hydati", 5, 2, 5)),
+			  stop_tries(false),
+			  watchdog(boost::make_shared<decaptcha::detail::io_watchdog<avhttp::http_stream> >(boost::ref(_io_service), strand, stream)),
+			  buffers(decaptcha::detail::acquire_streambuf(_io_service)),
+			  image(0),
+			  CAPTCHA_ID(boost::make_shared<std::string>()),
+			  handler(_handler),
+			  account(_account)
+		{
+		}
+
+		// 异步操作的 handler 内存, 和 state 一起释放.
+		decaptcha::detail::handler_arena arena;
+
+		boost::asio::io_service & io_service;
+
+		cancel_token cancel;
+		// op 的 handler, 定时器和取消都在这个 strand 里执行, 多个线程 run 的时候不会同时访问 op.
+		boost::shared_ptr<decaptcha::detail::op_strand> strand;
+		// 轮询的定时器挂在共用的时间轮上.
+		boost::shared_ptr<timer_type> timer;
+		decaptcha::detail::poll_timing poll;
+
+		bool stop_tries;
+
+		boost::shared_ptr<avhttp::http_stream> stream;
+		// 上传的每一步都限时.
+		boost::shared_ptr<decaptcha::detail::io_watchdog<avhttp::http_stream> > watchdog;
+
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		// 要上传的图片, 在 handler 被调用之前一直有效.
+		const std::string * image;
+
+		boost::shared_ptr<std::string> CAPTCHA_ID;
+
+		Handler handler;
+
+		boost::shared_ptr<const account_info> account;
+	};
+
 public:
 	hydati_decoder_op(boost::asio::io_service & io_service,
-			const std::string &authkey,const std::string &dati_type,
+			boost::shared_ptr<const account_info> account,
 			const std::string &buffer, Handler handler)
-		: m_io_service(io_service),
-		  m_authkey(authkey),
-		  m_dati_type(dati_type),
-		  m_handler(handler),
-		  m_stream(boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service))),
-		  m_CAPTCHA_ID(boost::make_shared<std::string>()),
-		  m_buffers(boost::make_shared<boost::asio::streambuf>()),
-		  m_tries(0), stop_tries(false)
+		: m_state(boost::make_shared<state>(boost::ref(io_service), account, handler))
 	{
-		std::string boundary = generate_boundary();
- 		std::string content = build_multipart_formdata(buffer, boundary);
- 		std::string content_type = boost::str(boost::format("multipart/form-data; boundary=----------------------------%s") % boundary);
-
-		m_stream->request_options(
-			avhttp::request_opts()
-				(avhttp::http_options::request_method, "POST" )
-				(avhttp::http_options::connection, "close" )
-				(avhttp::http_options::content_length, boost::lexical_cast<std::string>(content.length()) )
-				(avhttp::http_options::content_type, content_type )
-				(avhttp::http_options::request_body, content )
-		);
-		// 处理.
-		avhttp::async_read_body(*m_stream, "http://dt1.hydati.com:8080/uploadpic.php", *m_buffers, *this);
+		state & st = *m_state;
+
+		decaptcha::detail::cancel_on_cancel(st.cancel, st.strand, st.timer);
+		decaptcha::detail::cancel_poll_on_cancel(st.cancel, st.strand, st.account->poller, st.buffers);
+
+		// 连到服务商的连接太多的时候在连接池里排队, 借到了再上传.
+		st.image = &buffer;
+		decaptcha::detail::async_acquire_http_stream(io_service, "http://dt1.hydati.com:8080/", st.strand->wrap(*this));
 	};
 
+	// 从连接池借到了连接, 开始上传.
+	void operator()(boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		state & st = *m_state;
+
+		st.stream = stream;
+		st.watchdog->attach(stream);
+		decaptcha::detail::close_on_cancel(st.cancel, st.strand, st.stream);
+
+		// 排队的时候已经取消了.
+		if (st.cancel.is_canceled())
+		{
+			(*this)(boost::system::error_code(boost::asio::error::operation_aborted), 0);
+			return;
+		}
+
+		// 处理.
+		decaptcha::detail::async_post_multipart(st.stream, st.watchdog, "http://dt1.hydati.com:8080/uploadpic.php", avhttp::request_opts(),
+			st.account->form, decaptcha::image_file_name(*st.image), decaptcha::image_mime_type(*st.image), *st.image, *st.buffers, st.strand->wrap(*this));
+	}
+
 	// 这里是返回的数据
 	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
 	{
 		using namespace boost::system::errc;
 
+		state & st = *m_state;
+
+		if (st.cancel.is_canceled())
+		{
+			st.io_service.post(
+				boost::asio::detail::bind_handler(
+					st.handler, boost::system::error_code(boost::asio::error::operation_aborted), std::string("慧眼答题平台"), std::string(""), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
  		BOOST_ASIO_CORO_REENTER(this)
  		{
 			if (!process_upload_result(ec, bytes_transfered))
 			{
-				m_io_service.post(
+				st.io_service.post(
 					boost::asio::detail::bind_handler(
-						m_handler, ec, std::string("慧眼答题平台"), std::string(""), boost::function<void()>()
+						st.handler, ec, std::string("慧眼答题平台"), std::string(""), boost::function<void()>()
 					)
 				);
 
 				return;
 			}
 
-			// 延时 3s
-			BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 3, boost::asio::detail::bind_handler(*this, ec, 0) );
+			st.poll.start();
 
 			do{
-				// 延时 2s 然后重试.
-				// 这样第一次就延时 5s 了,  正好合适
+				// 等到 poll_schedule 认为结果差不多出来了再去查询.
 				BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 2, boost::asio::detail::bind_handler(*this, ec, 0) );
+					async_delay(st.poll.next_delay());
 
-				// 获取一下结果
-				m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-				m_buffers = boost::make_shared<boost::asio::streambuf>();
+				// 获取一下结果, 每个查询从连接池借一个连接, 同时发出去.
+				// 上一次的响应已经处理完了, 清空了接着用.
+				decaptcha::detail::reset_streambuf(*st.buffers);
 
-				// http://www.hydati.com/index.php?mod=demo&act=result&id=CAPCHA_ID_HERE
+				// http://dt1.hydati.com:8080/query.php?sid=CAPCHA_ID_HERE
 				BOOST_ASIO_CORO_YIELD
-					avhttp::async_read_body(*m_stream,
-											std::string(boost::str(boost::format("http://dt1.hydati.com:8080/query.php?sid=%s") % *m_CAPTCHA_ID)),
-											*m_buffers, *this);
+					st.account->poller->async_poll(
+						boost::str(boost::format("http://dt1.hydati.com:8080/query.php?sid=%s") % *st.CAPTCHA_ID),
+						st.buffers, st.strand->wrap(*this));
 
 				if (process_result(ec, bytes_transfered))
+				{
+					st.poll.solved();
 					return;
+				}
 			}while (should_try(ec));
 
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, make_error_code(operation_canceled), std::string("慧眼答题平台"), std::string(""), boost::function<void()>()
+					st.handler, make_error_code(operation_canceled), std::string("慧眼答题平台"), std::string(""), boost::function<void()>()
 				)
 			);
  		}
@@ -281,28 +384,27 @@ private:
 		// 如果出错返回‘#’开头的错误信息字符串。例如:#答题超时
  		using namespace boost::system::errc;
 
-		std::string response;
-
-		response.resize(bytes_transfered);
+		state & st = *m_state;
 
-		m_buffers->sgetn(&response[0],bytes_transfered);
+		boost::string_ref response = decaptcha::detail::response_data(*st.buffers, bytes_transfered);
 
 		if(response.empty())
 		{
 			return false;
 		}
 
-		if(boost::regex_match(response,boost::regex("([a-zA-Z]+)")))
+		// 答案全是字母.
+		if(decaptcha::detail::match_all(response, decaptcha::detail::is_ascii_alpha))
 		{
 			using namespace boost::asio::detail;
 
-			m_io_service.post(
+			st.io_service.post(
 					bind_handler(
-						m_handler,
+						st.handler,
 						boost::system::error_code(),
 						std::string("慧眼答题平台"),
-						response,
-						report_bad_func(m_io_service, m_authkey, m_CAPTCHA_ID)
+						std::string(response.begin(), response.end()),
+						report_bad_func(st.io_service, st.account->authkey, *st.CAPTCHA_ID)
 					)
 				);
 			return true;
@@ -310,93 +412,88 @@ private:
 
 		ec = error::ERROR_CAPTCHA_UNSOLVABLE;
 		if(response[0]=='#')
-			stop_tries = true;
+			st.stop_tries = true;
 		return false;
 	}
 
 	/*
 	 * 返回的数据是ID或者 #开头的错误描述.
-	 *
+	 * 上传出错 (包括超时) 的时候直接把 ec 交给 handler, 好让 deCAPTCHA 马上换下一个解码器.
      */
 	bool process_upload_result(boost::system::error_code & ec, std::size_t bytes_transfered)
 	{
+		state & st = *m_state;
+
+		if (ec)
+		{
+			st.stop_tries = true;
+			return false;
+		}
+
 		// 检查result
-		std::string result;
-		result.resize(bytes_transfered);
-		m_buffers->sgetn(&result[0], bytes_transfered);
+		boost::string_ref result = decaptcha::detail::response_data(*st.buffers, bytes_transfered);
 
- 		boost::cmatch what;
- 		boost::regex ex("([\\d]*)");
-		if(result[0] != '#' && boost::regex_search(result.c_str(), what, ex))
+		// 获得了 ID, 开头的数字. 没有数字的话拿什么去查询都没有结果.
+		boost::string_ref id = decaptcha::detail::scan_span(result, decaptcha::detail::is_ascii_digit);
+		if (!id.empty())
 		{
-			// 获得了 ID
-			* m_CAPTCHA_ID = what[1];
+			st.CAPTCHA_ID->assign(id.begin(), id.end());
 			return true;
 		};
 
 		ec = error::ERROR_CAPTCHA_UNSOLVABLE;
-		stop_tries = true;
+		st.stop_tries = true;
 		return false;
 	}
 
-	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 1min
+	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 poll_schedule 的 max_wait
 	bool should_try(boost::system::error_code ec)
 	{
-		return stop_tries==false && (m_tries ++ < 5);
+		state & st = *m_state;
+
+		return st.stop_tries==false && st.poll.should_poll();
 	}
 
 private:
-	std::string build_multipart_formdata(const std::string &buffer, const std::string & boundary) const
+	void async_delay(boost::posix_time::time_duration delay)
 	{
-		std::stringstream content_body;
-
-
-		content_body << "------------------------------" << boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"dati_type\"" <<  "\r\n\r\n"
-					 << m_dati_type << "\r\n";
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"acc_str\"" <<  "\r\n\r\n"
-					 << m_authkey << "\r\n";
-
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"zz\"" <<  "\r\n\r\n"
-					 << "AboUqITw21cSDCnt" << "\r\n";
-
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"timeout\"" <<  "\r\n\r\n"
-					 << "40" << "\r\n";
-
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"pic\"; filename=\"vercode.jpeg\"" << "\r\n"
-					 << "Content-Type: image/jpeg" <<  "\r\n\r\n";
+		state & st = *m_state;
 
-		content_body.write(buffer.data(), buffer.length());
-			content_body << "\r\n";
+		// 等待的时候不占着连接, 还回连接池给别人用.
+		st.stream.reset();
 
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"extra_str\"" <<  "\r\n\r\n"
-					 << boost::locale::conv::between("四个字母 不区分大小写","GB18030","UTF-8") << "\r\n";
-		content_body << "------------------------------" <<  boundary << "--" << "\r\n";
-		return content_body.str();
+		st.timer->expires_from_now(delay);
+		st.timer->async_wait(decaptcha::detail::wait_handler<hydati_decoder_op>(*this, st.strand));
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-
-	int m_tries;
-	bool stop_tries;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
+	// 这个验证码所有异步操作的 handler 内存都从 state 里的 arena 分配.
+	friend void * asio_handler_allocate(std::size_t size, hydati_decoder_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
 
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	friend void asio_handler_deallocate(void * pointer, std::size_t, hydati_decoder_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
 
-	boost::shared_ptr<std::string> m_CAPTCHA_ID;
+private:
+	boost::shared_ptr<state> m_state;
+};
 
-	Handler m_handler;
+// 哪些错误说明服务商忙不过来了.
+inline bool is_overload(const boost::system::error_code & ec)
+{
+	return decaptcha::detail::is_http_overload(ec);
+}
 
-	const std::string m_authkey;
-	const std::string m_dati_type;
-};
+template<class Handler>
+void start_decoder_op(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account,
+	const std::string * buffer, Handler handler)
+{
+	hydati_decoder_op<Handler> op(io_service, account, *buffer, handler);
+}
 
 } // namespace detail
 } // namespace hydati
@@ -404,19 +501,26 @@ private:
 class hydati_decoder{
 public:
 	hydati_decoder(boost::asio::io_service & io_service, const std::string &authkey)
-	  : m_io_service(io_service), m_authkey(authkey)
+	  : m_io_service(io_service),
+	    m_account(boost::make_shared<hydati::detail::account_info>(boost::ref(io_service), authkey, "1002")),
+	    m_limiter(decaptcha::detail::get_concurrency_limiter(io_service, "慧眼答题平台"))
 	{
 	}
 
+	// buffer 在 handler 被调用之前必须一直有效.
 	template <class Handler>
 	void operator()(const std::string &buffer, Handler handler)
 	{
-		hydati::detail::hydati_decoder_op<Handler>
-				op(m_io_service, m_authkey, "1002",buffer, handler);
+		// 拿到慧眼答题平台的并发名额才上传, 拿不到就是 provider_busy, 交给下一个解码器.
+		decaptcha::detail::async_limited(m_limiter, &hydati::detail::is_overload, handler,
+			boost::bind(&hydati::detail::start_decoder_op<decaptcha::detail::limited_handler<Handler> >,
+				boost::ref(m_io_service), m_account, &buffer, _1));
 	}
 private:
 	boost::asio::io_service & m_io_service;
-	std::string m_authkey;
+	boost::shared_ptr<const hydati::detail::account_info> m_account;
+	// 同一个服务商的所有解码器共用.
+	boost::shared_ptr<concurrency_limiter> m_limiter;
 };
 
 }
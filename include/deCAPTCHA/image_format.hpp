@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <cstring>
+#include <boost/system/error_code.hpp>
+
+#ifndef BOOST_SYSTEM_NOEXCEPT
+  #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
+#endif
+
+namespace decaptcha{
+
+enum image_format{
+	image_unknown,
+	image_jpeg,
+	image_png,
+	image_gif,
+	image_bmp,
+};
+
+namespace image_error{
+namespace detail {
+	class error_category_impl;
+}
+
+template<class error_category>
+const boost::system::error_category& error_category_single()
+{
+	static error_category error_category_instance;
+	return reinterpret_cast<const boost::system::error_category&>(error_category_instance);
+}
+
+inline const boost::system::error_category& error_category()
+{
+	return error_category_single<detail::error_category_impl>();
+}
+
+enum errc_t{
+	empty_image = 1,
+	unknown_image_format,
+	corrupt_image,
+};
+
+inline boost::system::error_code make_error_code(errc_t e)
+{
+	return boost::system::error_code(static_cast<int>(e), error_category());
+}
+
+} // namespace image_error
+} // namespace decaptcha
+
+namespace boost {
+namespace system {
+
+template <>
+struct is_error_code_enum<decaptcha::image_error::errc_t>
+{
+  static const bool value = true;
+};
+
+} // namespace system
+} // namespace boost
+
+namespace decaptcha{
+namespace image_error{
+namespace detail{
+
+class error_category_impl
+  : public boost::system::error_category
+{
+	virtual const char* name() const BOOST_SYSTEM_NOEXCEPT
+	{
+		return "captcha image";
+	}
+
+	virtual std::string message(int e) const
+	{
+		switch (e)
+		{
+		case empty_image:
+			return "captcha image is empty";
+		case unknown_image_format:
+			return "captcha image is not jpeg, png, gif or bmp";
+		case corrupt_image:
+			return "captcha image can not be decoded";
+		default:
+			return "captcha image ERROR";
+		}
+	}
+};
+
+} // namespace detail
+} // namespace image_error
+
+// 按文件头判断图片格式.
+inline image_format sniff_image_format(const std::string & buffer)
+{
+	const char * p = buffer.data();
+	std::size_t n = buffer.size();
+
+	if (n >= 3 && std::memcmp(p, "\xFF\xD8\xFF", 3) == 0)
+		return image_jpeg;
+	if (n >= 8 && std::memcmp(p, "\x89PNG\r\n\x1A\n", 8) == 0)
+		return image_png;
+	if (n >= 6 && (std::memcmp(p, "GIF87a", 6) == 0 || std::memcmp(p, "GIF89a", 6) == 0))
+		return image_gif;
+	if (n >= 14 && std::memcmp(p, "BM", 2) == 0)
+		return image_bmp;
+	return image_unknown;
+}
+
+// 上传的时候用的 Content-Type, 认不出来的按 jpeg 处理.
+inline const char * image_mime_type(const std::string & buffer)
+{
+	switch (sniff_image_format(buffer))
+	{
+	case image_png:
+		return "image/png";
+	case image_gif:
+		return "image/gif";
+	case image_bmp:
+		return "image/bmp";
+	default:
+		return "image/jpeg";
+	}
+}
+
+// 上传的时候用的文件名, 有的平台按扩展名判断格式.
+inline const char * image_file_name(const std::string & buffer)
+{
+	switch (sniff_image_format(buffer))
+	{
+	case image_png:
+		return "vercode.png";
+	case image_gif:
+		return "vercode.gif";
+	case image_bmp:
+		return "vercode.bmp";
+	default:
+		return "vercode.jpeg";
+	}
+}
+
+// 空的或者认不出格式的图片, 不用上传就知道会失败.
+inline boost::system::error_code check_image(const std::string & buffer)
+{
+	if (buffer.empty())
+		return image_error::empty_image;
+	if (sniff_image_format(buffer) == image_unknown)
+		return image_error::unknown_image_format;
+	return boost::system::error_code();
+}
+
+} // namespace decaptcha
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/system/error_code.hpp>
+
+#include "image_format.hpp"
+#include "gray_image.hpp"
+
+namespace decaptcha{
+namespace detail{
+
+// 边框上出现最多的灰度就是背景色.
+inline int background_level(const gray_image & image)
+{
+	std::size_t histogram[256] = { 0 };
+	for (std::size_t x = 0; x < image.width; x++)
+	{
+		histogram[image.at(x, 0)] ++;
+		histogram[image.at(x, image.height - 1)] ++;
+	}
+	for (std::size_t y = 0; y < image.height; y++)
+	{
+		histogram[image.at(0, y)] ++;
+		histogram[image.at(image.width - 1, y)] ++;
+	}
+	return static_cast<int>(std::max_element(histogram, histogram + 256) - histogram);
+}
+
+// 裁掉四周只有背景色的行和列, 留 margin 个像素的边.
+inline void crop_background(gray_image & image, int tolerance, std::size_t margin)
+{
+	int background = background_level(image);
+
+	std::size_t x0 = image.width, x1 = 0, y0 = image.height, y1 = 0;
+	for (std::size_t y = 0; y < image.height; y++)
+	{
+		for (std::size_t x = 0; x < image.width; x++)
+		{
+			if (std::abs(image.at(x, y) - background) > tolerance)
+			{
+				x0 = (std::min)(x0, x);
+				x1 = (std::max)(x1, x + 1);
+				y0 = (std::min)(y0, y);
+				y1 = (std::max)(y1, y + 1);
+			}
+		}
+	}
+
+	// 整张都是背景, 不裁.
+	if (x0 >= x1)
+		return;
+
+	x0 = x0 > margin ? x0 - margin : 0;
+	y0 = y0 > margin ? y0 - margin : 0;
+	x1 = (std::min)(x1 + margin, image.width);
+	y1 = (std::min)(y1 + margin, image.height);
+
+	if (x0 == 0 && y0 == 0 && x1 == image.width && y1 == image.height)
+		return;
+
+	gray_image cropped;
+	cropped.width = x1 - x0;
+	cropped.height = y1 - y0;
+	cropped.pixels.resize(cropped.width * cropped.height);
+	for (std::size_t y = y0; y < y1; y++)
+	{
+		std::copy(image.pixels.begin() + y * image.width + x0, image.pixels.begin() + y * image.width + x1,
+			cropped.pixels.begin() + (y - y0) * cropped.width);
+	}
+	std::swap(image, cropped);
+}
+
+} // namespace detail
+
+/*
+ * image_preprocessor 在上传之前把验证码图片变小, 通过 deCAPTCHA::set_image_preprocessor 安装.
+ *
+ * jpeg 和 png 会被解码成灰度图 (解码失败的直接返回 corrupt_image, 不用上传),
+ * 裁掉四周的空白, 再编码成灰度 png. 比原图小才使用新的, 否则原样上传.
+ * 其他格式原样上传.
+ */
+class image_preprocessor{
+public:
+	image_preprocessor()
+		: m_crop(true), m_tolerance(16), m_margin(2)
+	{
+	}
+
+	// 和背景色相差不超过 tolerance 的算作背景. crop 为 false 则不裁剪.
+	void set_crop(bool crop, int tolerance = 16, std::size_t margin = 2)
+	{
+		m_crop = crop;
+		m_tolerance = tolerance;
+		m_margin = margin;
+	}
+
+	boost::system::error_code operator()(const std::string & buffer, std::string & output) const
+	{
+		image_format format = sniff_image_format(buffer);
+		if (format != image_jpeg && format != image_png)
+		{
+			output = buffer;
+			return boost::system::error_code();
+		}
+
+		gray_image image;
+		if (!decode_image(buffer, image))
+			return image_error::corrupt_image;
+
+		if (m_crop)
+			detail::crop_background(image, m_tolerance, m_margin);
+
+		std::string png;
+		if (encode_png(image, png) && png.size() < buffer.size())
+			output.swap(png);
+		else
+			output = buffer;
+		return boost::system::error_code();
+	}
+
+private:
+	bool m_crop;
+	int m_tolerance;
+	std::size_t m_margin;
+};
+
+} // namespace decaptcha
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "cancel_token.hpp"
+
+namespace decaptcha{
+
+// 每一步网络操作最多等多久, 通过 io_watchdog_service::set_timeouts 设置.
+struct io_timeouts{
+	io_timeouts()
+		: connect(boost::posix_time::seconds(10)), send(boost::posix_time::seconds(15)),
+		  first_byte(boost::posix_time::seconds(20)), read(boost::posix_time::seconds(15))
+	{
+	}
+
+	// 解析域名并建立连接.
+	boost::posix_time::time_duration connect;
+	// 发送请求, 包括上传图片.
+	boost::posix_time::time_duration send;
+	// 请求发完到收到响应头.
+	boost::posix_time::time_duration first_byte;
+	// 收完响应体.
+	boost::posix_time::time_duration read;
+};
+
+// 每个 io_service 一份超时设置, 所有解码器共用.
+class io_watchdog_service
+	: public boost::asio::detail::service_base<io_watchdog_service>
+{
+public:
+	explicit io_watchdog_service(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<io_watchdog_service>(io_service)
+	{
+	}
+
+	// 只影响之后开始的操作.
+	void set_timeouts(const io_timeouts & timeouts)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_timeouts = timeouts;
+	}
+
+	io_timeouts timeouts() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_timeouts;
+	}
+
+private:
+	void shutdown_service()
+	{
+	}
+
+private:
+	mutable boost::asio::detail::mutex m_mutex;
+	io_timeouts m_timeouts;
+};
+
+namespace detail{
+
+/*
+ * io_watchdog 给一个连接上的每一步网络操作限时.
+ *
+ * 每一步开始之前 arm, 时间到了还没有 complete 就关闭连接, 挂在上面的操作立即带着错误返回,
+ * complete 把这个错误换成 boost::asio::error::timed_out. 关闭连接在 op 的 strand 里进行,
+ * 不和 op 自己的 handler 同时访问连接. arm 和 complete 也只能在这个 strand 里调用.
+ *
+ * 用 deadline_timer 而不是 wheel_timer, 每一步都要重新 arm, 而时间轮上的定时器
+ * 不能在到期的同时从别的线程重新挂上去.
+ */
+template<class Stream>
+class io_watchdog
+	: boost::noncopyable, public boost::enable_shared_from_this<io_watchdog<Stream> >
+{
+public:
+	io_watchdog(boost::asio::io_service & io_service, boost::shared_ptr<op_strand> strand, boost::shared_ptr<Stream> stream)
+		: m_timeouts(boost::asio::use_service<io_watchdog_service>(io_service).timeouts()),
+		  m_strand(strand), m_stream(stream), m_timer(io_service), m_generation(0), m_expired(false)
+	{
+	}
+
+	const io_timeouts & timeouts() const
+	{
+		return m_timeouts;
+	}
+
+	// 连接是从连接池排队借来的, 借到以后才交给 watchdog.
+	void attach(boost::shared_ptr<Stream> stream)
+	{
+		m_stream = stream;
+	}
+
+	// 开始一步, 上一步的限时作废.
+	void arm(boost::posix_time::time_duration timeout)
+	{
+		m_generation ++;
+		m_timer.expires_from_now(timeout);
+		m_timer.async_wait(boost::bind(&io_watchdog::handle_timeout,
+			boost::weak_ptr<io_watchdog>(this->shared_from_this()), m_generation, _1));
+	}
+
+	// 这一步结束了, 返回应该交给调用者的错误.
+	boost::system::error_code complete(const boost::system::error_code & ec)
+	{
+		m_generation ++;
+		boost::system::error_code ignore_ec;
+		m_timer.cancel(ignore_ec);
+
+		if (ec && m_expired)
+			return boost::asio::error::timed_out;
+		return ec;
+	}
+
+	bool expired() const
+	{
+		return m_expired;
+	}
+
+private:
+	static void handle_timeout(boost::weak_ptr<io_watchdog> weak_self, boost::uint64_t generation, boost::system::error_code ec)
+	{
+		if (ec)
+			return;
+
+		if (boost::shared_ptr<io_watchdog> self = weak_self.lock())
+			self->m_strand->dispatch(boost::bind(&io_watchdog::expire, weak_self, generation));
+	}
+
+	static void expire(boost::weak_ptr<io_watchdog> weak_self, boost::uint64_t generation)
+	{
+		boost::shared_ptr<io_watchdog> self = weak_self.lock();
+		// 到期的同时这一步正好结束了.
+		if (!self || generation != self->m_generation)
+			return;
+
+		self->m_expired = true;
+		if (boost::shared_ptr<Stream> stream = self->m_stream.lock())
+		{
+			boost::system::error_code ignore_ec;
+			stream->close(ignore_ec);
+		}
+	}
+
+private:
+	const io_timeouts m_timeouts;
+	boost::shared_ptr<op_strand> m_strand;
+	// 连接归 op 所有, 等待结果的时候 op 会把连接还回连接池.
+	boost::weak_ptr<Stream> m_stream;
+	boost::asio::deadline_timer m_timer;
+	boost::uint64_t m_generation;
+	bool m_expired;
+};
+
+} // namespace detail
+} // namespace decaptcha
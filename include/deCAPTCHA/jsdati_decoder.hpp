@@ -19,7 +19,6 @@
 #pragma once
 #include <string>
 #include <fstream>
-#include <boost/regex.hpp>
 #include <boost/random.hpp>
 #include <boost/format.hpp>
 #include <boost/make_shared.hpp>
@@ -28,12 +27,18 @@
 #include <avhttp.hpp>
 #include <avhttp/async_read_body.hpp>
 
-#include <boost/property_tree/ptree.hpp>
-namespace pt = boost::property_tree;
-#include <boost/property_tree/json_parser.hpp>
-namespace js = boost::property_tree::json_parser;
-
-#include <boost/timedcall.hpp>
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "http_connection_pool.hpp"
+#include "streambuf_pool.hpp"
+#include "response_parser.hpp"
+#include "concurrency_limit.hpp"
+#include "decoder_health.hpp"
+#include "poll_schedule.hpp"
+#include "timer_wheel.hpp"
+#include "poll_multiplexer.hpp"
+#include "multipart.hpp"
+#include "image_format.hpp"
 
 #ifndef BOOST_SYSTEM_NOEXCEPT
   #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
@@ -145,25 +150,61 @@ class error_category_impl
 			return "jsdati ERROR";
 		}
 	}
+
+	// 图片是空的, 太大或者格式不对, 是图片的问题, 不是服务商的.
+	virtual boost::system::error_condition default_error_condition(int e) const BOOST_SYSTEM_NOEXCEPT
+	{
+		switch (e)
+		{
+		case error::ERROR_ZERO_CAPTCHA_FILESIZE:
+		case error::ERROR_TOO_BIG_CAPTCHA_FILESIZE:
+		case error::ERROR_IMAGE_TYPE_NOT_SUPPORTED:
+			return decaptcha::health_error::not_provider_fault;
+		default:
+			return boost::system::error_condition(e, *this);
+		}
+	}
+};
+
+/*
+ * 一个联众打码平台账号的设置, 解码器创建的时候准备好, 之后不再修改.
+ * 解码器和它启动的每一个 op 共用一份, handler 里拷贝的只是指针.
+ */
+struct account_info : boost::noncopyable
+{
+	account_info(boost::asio::io_service & io_service, const std::string & _username, const std::string & _passwd)
+		: username(_username), passwd(_passwd),
+		  poller(decaptcha::detail::get_url_poll_multiplexer(io_service, "jsdati",
+				avhttp::request_opts()
+					(avhttp::http_options::referer, "http://www.jsdati.com/index.php/demo")
+					(avhttp::http_options::connection, "keep-alive")
+					("Accept-Language", "en-us")))
+	{
+		form.field("user_name", username)
+			.field("user_pw", passwd)
+			.file("user_yzm")
+			.field("pesubmit", "");
+	}
+
+	const std::string username, passwd;
+	decaptcha::detail::multipart_form form;
+	boost::shared_ptr<decaptcha::detail::poll_multiplexer> poller;
 };
 
 struct report_bad_op : boost::asio::coroutine
 {
 	report_bad_op(boost::asio::io_service & io_service,
-				const std::string &username, const std::string & passwd,
+				boost::shared_ptr<const account_info> account,
 				boost::shared_ptr<std::string> CAPTCHA_ID,
 				const std::string &dmuser_name)
-	  : m_io_service(io_service), m_CAPTCHA_ID(CAPTCHA_ID),
- 		m_username(username), m_passwd(passwd), m_dmuser_name(dmuser_name)
+	  : m_io_service(io_service), m_account(account), m_CAPTCHA_ID(CAPTCHA_ID),
+		m_dmuser_name(dmuser_name)
 	{
 	}
 
 	// 调用这个开始报告错误.
 	void operator()()
 	{
-		m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-		m_buffers = boost::make_shared<boost::asio::streambuf>();
-
 		// 联众打码平台 暂时不支持,  哎.
 	}
 
@@ -174,110 +215,169 @@ struct report_bad_op : boost::asio::coroutine
 
 private:
 	boost::asio::io_service & m_io_service;
-	const std::string m_username, m_passwd, m_dmuser_name;
+	boost::shared_ptr<const account_info> m_account;
 	boost::shared_ptr<std::string> m_CAPTCHA_ID;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	std::string m_dmuser_name;
 };
 
 inline report_bad_op report_bad_func(boost::asio::io_service & io_service,
-				const std::string &username, const std::string & passwd,
+				boost::shared_ptr<const account_info> account,
 				boost::shared_ptr<std::string> CAPTCHA_ID, const std::string &dmuser_name)
 {
-	return report_bad_op(io_service, username, passwd, CAPTCHA_ID, dmuser_name);
+	return report_bad_op(io_service, account, CAPTCHA_ID, dmuser_name);
 }
 
 template<class Handler>
 class jsdati_decoder_op : boost::asio::coroutine
 {
-	std::string generate_boundary() const
+	typedef decaptcha::wheel_timer<decaptcha::detail::wait_handler<jsdati_decoder_op> > timer_type;
+
+	// 一个验证码的所有状态. op 在每一步异步操作之间被拷贝, 拷贝的只是指向它的指针.
+	struct state : boost::noncopyable
 	{
-		boost::rand48 p(time(NULL));
-		return  boost::str(boost::format("%06x%06x") % p() %  p()  ).substr(0, 12);
-	}
+		state(boost::asio::io_service & _io_service, boost::shared_ptr<const account_info> _account, Handler _handler)
+			: io_service(_io_service),
+			  cancel(get_cancel_token(_handler)),
+			  strand(boost::make_shared<decaptcha::detail::op_strand>(boost::ref(_io_service))),
+			  timer(boost::make_shared<timer_type>(boost::ref(_io_service))),
+			  poll(decaptcha::detail::get_poll_schedule(_io_service, "jsdati", 10, 5, 5)),
+			  stop_tries(false),
+			  watchdog(boost::make_shared<decaptcha::detail::io_watchdog<avhttp::http_stream> >(boost::ref(_io_service), strand, stream)),
+			  buffers(decaptcha::detail::acquire_streambuf(_io_service)),
+			  image(0),
+			  CAPTCHA_ID(boost::make_shared<std::string>()),
+			  handler(_handler),
+			  account(_account)
+		{
+		}
+
+		// 异步操作的 handler 内存, 和 state 一起释放.
+		decaptcha::detail::handler_arena arena;
+
+		boost::asio::io_service & io_service;
+
+		cancel_token cancel;
+		// op 的 handler, 定时器和取消都在这个 strand 里执行, 多个线程 run 的时候不会同时访问 op.
+		boost::shared_ptr<decaptcha::detail::op_strand> strand;
+		// 轮询的定时器挂在共用的时间轮上.
+		boost::shared_ptr<timer_type> timer;
+		decaptcha::detail::poll_timing poll;
+
+		bool stop_tries;
+
+		boost::shared_ptr<avhttp::http_stream> stream;
+		// 上传的每一步都限时.
+		boost::shared_ptr<decaptcha::detail::io_watchdog<avhttp::http_stream> > watchdog;
+
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		// 要上传的图片, 在 handler 被调用之前一直有效.
+		const std::string * image;
+
+		boost::shared_ptr<std::string> CAPTCHA_ID;
+
+		Handler handler;
+
+		boost::shared_ptr<const account_info> account;
+	};
+
 public:
 	jsdati_decoder_op(boost::asio::io_service & io_service,
-			const std::string &username, const std::string & passwd,
+			boost::shared_ptr<const account_info> account,
 			const std::string &buffer, Handler handler)
-		: m_io_service(io_service),
-		  m_username(username), m_passwd(passwd),
-		  m_handler(handler),
-		  m_stream(boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service))),
-		  m_CAPTCHA_ID(boost::make_shared<std::string>()),
-		  m_buffers(boost::make_shared<boost::asio::streambuf>()),
-		  m_tries(0), stop_tries(false)
+		: m_state(boost::make_shared<state>(boost::ref(io_service), account, handler))
 	{
-		std::string boundary = generate_boundary();
- 		std::string content = build_multipart_formdata(buffer, boundary);
- 		std::string content_type = boost::str(boost::format("multipart/form-data; boundary=----------------------------%s") % boundary);
+		state & st = *m_state;
 
-		m_stream->request_options(
+		decaptcha::detail::cancel_on_cancel(st.cancel, st.strand, st.timer);
+		decaptcha::detail::cancel_poll_on_cancel(st.cancel, st.strand, st.account->poller, st.buffers);
+
+		// 连到服务商的连接太多的时候在连接池里排队, 借到了再上传.
+		st.image = &buffer;
+		decaptcha::detail::async_acquire_http_stream(io_service, "http://www.jsdati.com/", st.strand->wrap(*this));
+	};
+
+	// 从连接池借到了连接, 开始上传.
+	void operator()(boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		state & st = *m_state;
+
+		st.stream = stream;
+		st.watchdog->attach(stream);
+		decaptcha::detail::close_on_cancel(st.cancel, st.strand, st.stream);
+
+		// 排队的时候已经取消了.
+		if (st.cancel.is_canceled())
+		{
+			(*this)(boost::system::error_code(boost::asio::error::operation_aborted), 0);
+			return;
+		}
+
+		// 处理.
+		decaptcha::detail::async_post_multipart(st.stream, st.watchdog, "http://www.jsdati.com/index.php/demo",
 			avhttp::request_opts()
-				(avhttp::http_options::request_method, "POST" )
-				(avhttp::http_options::connection, "close" )
-				(avhttp::http_options::content_length, boost::lexical_cast<std::string>(content.length()) )
-				(avhttp::http_options::content_type, content_type )
-				(avhttp::http_options::request_body, content )
 				(avhttp::http_options::referer, "http://www.jsdati.com/index.php/demo")
 				(avhttp::http_options::accept, "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8")
-				("Accept-Language", "en-us")
-		);
-		// 处理.
-		avhttp::async_read_body(*m_stream, "http://www.jsdati.com/index.php/demo", *m_buffers, *this);
-	};
+				("Accept-Language", "en-us"),
+			st.account->form, decaptcha::image_file_name(*st.image), decaptcha::image_mime_type(*st.image), *st.image, *st.buffers, st.strand->wrap(*this));
+	}
 
 	// 这里是 OK|ID_HERE 格式的数据
 	void operator()(boost::system::error_code ec, std::size_t bytes_transfered)
 	{
 		using namespace boost::system::errc;
 
+		state & st = *m_state;
+
+		if (st.cancel.is_canceled())
+		{
+			st.io_service.post(
+				boost::asio::detail::bind_handler(
+					st.handler, boost::system::error_code(boost::asio::error::operation_aborted), std::string("联众打码平台"), std::string(""), boost::function<void()>()
+				)
+			);
+			return;
+		}
+
  		BOOST_ASIO_CORO_REENTER(this)
  		{
 			if (!process_upload_result(ec, bytes_transfered))
 			{
-				m_io_service.post(
+				st.io_service.post(
 					boost::asio::detail::bind_handler(
-						m_handler, ec, std::string("联众打码平台"), std::string(""), boost::function<void()>()
+						st.handler, ec, std::string("联众打码平台"), std::string(""), boost::function<void()>()
 					)
 				);
 
 				return;
 			}
 
-			// 延时 5
-			BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 5, boost::asio::detail::bind_handler(*this, ec, 0) );
+			st.poll.start();
 
 			do{
-				// 延时 5s 然后重试.
-				// 这样第一次就延时 10s 了,  正好合适
+				// 等到 poll_schedule 认为结果差不多出来了再去查询.
 				BOOST_ASIO_CORO_YIELD
-					boost::delayedcallsec(m_io_service, 5, boost::asio::detail::bind_handler(*this, ec, 0) );
+					async_delay(st.poll.next_delay());
 
-				// 获取一下结果
-				m_stream = boost::make_shared<avhttp::http_stream>(boost::ref(m_io_service));
-				m_buffers = boost::make_shared<boost::asio::streambuf>();
-
-				m_stream->request_options(
-					avhttp::request_opts()
-						(avhttp::http_options::referer, "http://www.jsdati.com/index.php/demo")
-						("Accept-Language", "en-us")
-				);
+				// 获取一下结果, 每个查询从连接池借一个连接, 同时发出去.
+				// 上一次的响应已经处理完了, 清空了接着用.
+				decaptcha::detail::reset_streambuf(*st.buffers);
 
 				// http://www.jsdati.com/index.php?mod=demo&act=result&id=CAPCHA_ID_HERE
 				BOOST_ASIO_CORO_YIELD
-					avhttp::async_read_body(*m_stream,
-											std::string(boost::str(boost::format("http://www.jsdati.com/index.php?mod=demo&act=result&id=%s") % *m_CAPTCHA_ID)),
-											*m_buffers, *this);
+					st.account->poller->async_poll(
+						boost::str(boost::format("http://www.jsdati.com/index.php?mod=demo&act=result&id=%s") % *st.CAPTCHA_ID),
+						st.buffers, st.strand->wrap(*this));
 
 				if (process_result(ec, bytes_transfered))
+				{
+					st.poll.solved();
 					return;
+				}
 			}while (should_try(ec));
 
-			m_io_service.post(
+			st.io_service.post(
 				boost::asio::detail::bind_handler(
-					m_handler, make_error_code(operation_canceled), std::string("联众打码平台"), std::string(""), boost::function<void()>()
+					st.handler, make_error_code(operation_canceled), std::string("联众打码平台"), std::string(""), boost::function<void()>()
 				)
 			);
  		}
@@ -286,28 +386,46 @@ private:
 	bool process_result(boost::system::error_code & ec, std::size_t bytes_transfered)
 	{
 		// {"yzm_state":"\u7b49\u5f85\u8bc6\u522b","yzm_value":"","dmuser_name":"SS15083"}
+		// 直接在 buffers 里挑出要用的字段. 多数查询还没有结果, result 是空的, 这时候不复制也不分配内存.
  		using namespace boost::system::errc;
 
- 		pt::ptree jsresult;
- 		std::istream response(m_buffers.get());
+		state & st = *m_state;
 
- 		try{
-			js::read_json(response, jsresult);
+		decaptcha::detail::json_reader reader(decaptcha::detail::response_data(*st.buffers, st.buffers->size()));
+		boost::string_ref key;
+		decaptcha::detail::json_value value, yzm_value, dmuser_name;
+		bool has_state = false, has_value = false, has_user = false;
 
-			std::string yzm_state =  jsresult.get<std::string>("status");
-			std::string yzm_value =  jsresult.get<std::string>("result");
-			std::string dmuser_name = jsresult.get<std::string>("damaworker");
+		while (reader.next(key, value))
+		{
+			if (key == "status")
+			{
+				has_state = true;
+			}
+			else if (key == "result")
+			{
+				yzm_value = value;
+				has_value = true;
+			}
+			else if (key == "damaworker")
+			{
+				dmuser_name = value;
+				has_user = true;
+			}
+		}
 
+		if (!reader.failed() && has_state && has_value && has_user)
+		{
 			if (!yzm_value.empty())
 			{
 				using namespace boost::asio::detail;
-				m_io_service.post(
+				st.io_service.post(
 						bind_handler(
-							m_handler,
+							st.handler,
 							boost::system::error_code(),
 							std::string("联众打码平台"),
-							yzm_value,
-							report_bad_func(m_io_service, m_username, m_passwd, m_CAPTCHA_ID, dmuser_name)
+							yzm_value.to_string(),
+							report_bad_func(st.io_service, st.account, st.CAPTCHA_ID, dmuser_name.to_string())
 						)
 					);
 				return true;
@@ -316,13 +434,10 @@ private:
 				ec = error::ERROR_CAPCHA_NOT_READY;
 				return false;
 			}
-
-		}catch (const pt::ptree_error&)
-		{
 		}
 
 		ec = error::ERROR_CAPTCHA_UNSOLVABLE;
-		stop_tries = true;
+		st.stop_tries = true;
 		return false;
 	}
 
@@ -332,74 +447,80 @@ private:
      */
 	bool process_upload_result(boost::system::error_code & ec, std::size_t bytes_transfered)
 	{
+		state & st = *m_state;
+
+		// 上传出错 (包括超时) 的时候原样交给 handler, 健康统计要看到真正的错误.
+		if (ec)
+		{
+			st.stop_tries = true;
+			return false;
+		}
+
 		// 检查result
-		std::string result;
-		result.resize(bytes_transfered);
-		m_buffers->sgetn(&result[0], bytes_transfered);
+		boost::string_ref result = decaptcha::detail::response_data(*st.buffers, bytes_transfered);
+		boost::string_ref id;
 
- 		boost::cmatch what;
- 		boost::regex ex("window.location.href='http://www.jsdati.com/index.php/demo/([0-9]*)'");
- 		if (boost::regex_search(result.c_str(), what, ex))
+ 		if (decaptcha::detail::find_span_after(result, "window.location.href='http://www.jsdati.com/index.php/demo/", decaptcha::detail::is_ascii_digit, id)
+			&& result.end() - id.end() > 0 && *id.end() == '\'')
 		{
 			// 获得了 ID
-			* m_CAPTCHA_ID = what[1];
+			st.CAPTCHA_ID->assign(id.begin(), id.end());
 			return true;
 		};
 
 		ec = error::ERROR_CAPTCHA_UNSOLVABLE;
-		stop_tries = true;
+		st.stop_tries = true;
 		return false;
 	}
 
-	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 1min
+	// 神码叫应该继续呢?  就是返回没错误, 也没有超过 poll_schedule 的 max_wait
 	bool should_try(boost::system::error_code ec)
 	{
-		return stop_tries==false && (m_tries ++ < 5);
+		state & st = *m_state;
+
+		return st.stop_tries==false && st.poll.should_poll();
 	}
 
 private:
-	std::string build_multipart_formdata(const std::string &buffer, const std::string & boundary) const
+	void async_delay(boost::posix_time::time_duration delay)
 	{
-		std::stringstream content_body;
-
-
-		content_body << "------------------------------" << boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"user_name\"" <<  "\r\n\r\n"
-					 << m_username << "\r\n";
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"user_pw\"" <<  "\r\n\r\n"
-					 << m_passwd << "\r\n";
+		state & st = *m_state;
 
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"user_yzm\"; filename=\"vercode.jpeg\"" << "\r\n"
-					 << "Content-Type: image/jpeg" <<  "\r\n\r\n";
+		// 等待的时候不占着连接, 还回连接池给别人用.
+		st.stream.reset();
 
-		content_body.write(buffer.data(), buffer.length());
-			content_body << "\r\n";
-
-		content_body << "------------------------------" <<  boundary <<  "\r\n"
-					 << "Content-Disposition: form-data; name=\"pesubmit\"" <<  "\r\n\r\n"
-					 <<  "\r\n";
-		content_body << "------------------------------" <<  boundary << "--" << "\r\n";
-		return content_body.str();
+		st.timer->expires_from_now(delay);
+		st.timer->async_wait(decaptcha::detail::wait_handler<jsdati_decoder_op>(*this, st.strand));
 	}
 
 private:
-	boost::asio::io_service & m_io_service;
-
-	int m_tries;
-	bool stop_tries;
-
-	boost::shared_ptr<avhttp::http_stream> m_stream;
+	// 这个验证码所有异步操作的 handler 内存都从 state 里的 arena 分配.
+	friend void * asio_handler_allocate(std::size_t size, jsdati_decoder_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
 
-	boost::shared_ptr<boost::asio::streambuf> m_buffers;
+	friend void asio_handler_deallocate(void * pointer, std::size_t, jsdati_decoder_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
 
-	boost::shared_ptr<std::string> m_CAPTCHA_ID;
+private:
+	boost::shared_ptr<state> m_state;
+};
 
-	Handler m_handler;
+// 哪些错误说明服务商忙不过来了.
+inline bool is_overload(const boost::system::error_code & ec)
+{
+	return decaptcha::detail::is_http_overload(ec);
+}
 
-	const std::string m_username, m_passwd;
-};
+template<class Handler>
+void start_decoder_op(boost::asio::io_service & io_service, boost::shared_ptr<const account_info> account,
+	const std::string * buffer, Handler handler)
+{
+	jsdati_decoder_op<Handler> op(io_service, account, *buffer, handler);
+}
 
 } // namespace detail
 } // namespace jsdati
@@ -408,19 +529,26 @@ class jsdati_decoder{
 public:
 	jsdati_decoder(boost::asio::io_service & io_service,
 		const std::string &username, const std::string & passwd)
-	  : m_io_service(io_service), m_username(username), m_passwd(passwd)
+	  : m_io_service(io_service),
+	    m_account(boost::make_shared<jsdati::detail::account_info>(boost::ref(io_service), username, passwd)),
+	    m_limiter(decaptcha::detail::get_concurrency_limiter(io_service, "联众打码平台"))
 	{
 	}
 
+	// buffer 在 handler 被调用之前必须一直有效.
 	template <class Handler>
 	void operator()(const std::string &buffer, Handler handler)
 	{
-		jsdati::detail::jsdati_decoder_op<Handler>
-				op(m_io_service, m_username, m_passwd, buffer, handler);
+		// 拿到联众打码平台的并发名额才上传, 拿不到就是 provider_busy, 交给下一个解码器.
+		decaptcha::detail::async_limited(m_limiter, &jsdati::detail::is_overload, handler,
+			boost::bind(&jsdati::detail::start_decoder_op<decaptcha::detail::limited_handler<Handler> >,
+				boost::ref(m_io_service), m_account, &buffer, _1));
 	}
 private:
 	boost::asio::io_service & m_io_service;
-	std::string m_username, m_passwd;
+	boost::shared_ptr<const jsdati::detail::account_info> m_account;
+	// 同一个服务商的所有解码器共用.
+	boost::shared_ptr<concurrency_limiter> m_limiter;
 };
 
 }
@@ -0,0 +1,653 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DECAPTCHA_HAS_SSE2 1
+#endif
+
+#include "cancel_token.hpp"
+#include "decoder_health.hpp"
+#include "gray_image.hpp"
+
+#ifndef BOOST_SYSTEM_NOEXCEPT
+  #define BOOST_SYSTEM_NOEXCEPT BOOST_NOEXCEPT
+#endif
+
+namespace decaptcha{
+namespace decoder{
+namespace local_recognizer{
+namespace detail {
+	class error_category_impl;
+}
+
+template<class error_category>
+const boost::system::error_category& error_category_single()
+{
+	static error_category error_category_instance;
+	return reinterpret_cast<const boost::system::error_category&>(error_category_instance);
+}
+
+inline const boost::system::error_category& error_category()
+{
+	return error_category_single<detail::error_category_impl>();
+}
+
+namespace error{
+enum errc_t{
+	image_not_supported = 1,
+	segmentation_failed,
+	low_confidence,
+};
+
+inline boost::system::error_code make_error_code(errc_t e)
+{
+	return boost::system::error_code(static_cast<int>(e), error_category());
+}
+
+} // namespace error
+} // namespace local_recognizer
+} // namespace decoder
+} // namespace decaptcha
+
+namespace boost {
+namespace system {
+
+template <>
+struct is_error_code_enum<decaptcha::decoder::local_recognizer::error::errc_t>
+{
+  static const bool value = true;
+};
+
+} // namespace system
+} // namespace boost
+
+namespace decaptcha{
+namespace decoder{
+namespace local_recognizer{
+namespace detail{
+
+class error_category_impl
+  : public boost::system::error_category
+{
+	virtual const char* name() const BOOST_SYSTEM_NOEXCEPT
+	{
+		return "local recognizer";
+	}
+
+	virtual std::string message(int e) const
+	{
+		switch (e)
+		{
+		case error::image_not_supported:
+			return "image format is not supported by the local recognizer";
+		case error::segmentation_failed:
+			return "could not split the image into characters";
+		case error::low_confidence:
+			return "recognition confidence is too low";
+		default:
+			return "local recognizer ERROR";
+		}
+	}
+
+	// 都是图片本身的问题, 不是识别器坏了, 不计入熔断.
+	virtual boost::system::error_condition default_error_condition(int e) const BOOST_SYSTEM_NOEXCEPT
+	{
+		switch (e)
+		{
+		case error::image_not_supported:
+		case error::segmentation_failed:
+		case error::low_confidence:
+			return health_error::not_provider_fault;
+		default:
+			return boost::system::error_condition(e, *this);
+		}
+	}
+};
+
+// 每个字符缩放到 16x16, 正好是 SSE 寄存器宽度的整数倍.
+enum { glyph_size = 16, glyph_bytes = glyph_size * glyph_size };
+
+typedef boost::array<unsigned char, glyph_bytes> glyph;
+
+// 两个字符之间的距离, 每个像素差的绝对值之和.
+inline unsigned glyph_distance(const unsigned char * a, const unsigned char * b)
+{
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	for (int i = 0; i < glyph_bytes; i += 32)
+	{
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))));
+	}
+	__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	return static_cast<unsigned>(_mm_cvtsi128_si32(sum));
+#elif defined(DECAPTCHA_HAS_SSE2)
+	__m128i acc = _mm_setzero_si128();
+	for (int i = 0; i < glyph_bytes; i += 16)
+	{
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+	}
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	return static_cast<unsigned>(_mm_cvtsi128_si32(acc));
+#else
+	unsigned sum = 0;
+	for (int i = 0; i < glyph_bytes; i++)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sum;
+#endif
+}
+
+// Otsu 法求二值化阈值.
+inline int otsu_threshold(const gray_image & image)
+{
+	std::size_t histogram[256] = { 0 };
+	for (std::size_t i = 0; i < image.pixels.size(); i++)
+		histogram[image.pixels[i]] ++;
+
+	double total = static_cast<double>(image.pixels.size());
+	double sum = 0;
+	for (int i = 0; i < 256; i++)
+		sum += i * static_cast<double>(histogram[i]);
+
+	double sum_background = 0, weight_background = 0, best = -1;
+	int threshold = 128;
+	for (int t = 0; t < 256; t++)
+	{
+		weight_background += histogram[t];
+		if (weight_background == 0)
+			continue;
+
+		double weight_foreground = total - weight_background;
+		if (weight_foreground == 0)
+			break;
+
+		sum_background += t * static_cast<double>(histogram[t]);
+		double mean_background = sum_background / weight_background;
+		double mean_foreground = (sum - sum_background) / weight_foreground;
+		double between = weight_background * weight_foreground * (mean_background - mean_foreground) * (mean_background - mean_foreground);
+		if (between > best)
+		{
+			best = between;
+			threshold = t;
+		}
+	}
+	return threshold;
+}
+
+// 二值化, 字符是少数的那一类像素, 不管是深色字还是浅色字.
+inline std::vector<unsigned char> binarize(const gray_image & image)
+{
+	int threshold = otsu_threshold(image);
+
+	std::size_t dark = 0;
+	for (std::size_t i = 0; i < image.pixels.size(); i++)
+		if (image.pixels[i] <= threshold)
+			dark ++;
+
+	bool dark_ink = dark * 2 <= image.pixels.size();
+
+	std::vector<unsigned char> mask(image.pixels.size());
+	for (std::size_t i = 0; i < image.pixels.size(); i++)
+		mask[i] = ((image.pixels[i] <= threshold) == dark_ink) ? 1 : 0;
+	return mask;
+}
+
+struct column_run{
+	std::size_t begin, end, ink;
+};
+
+// 把 [x0, x1) 列里的字符裁剪出来, 缩放成 glyph.
+inline bool extract_glyph(const std::vector<unsigned char> & mask, std::size_t width, std::size_t height,
+	std::size_t x0, std::size_t x1, glyph & out)
+{
+	std::size_t y0 = height, y1 = 0;
+	for (std::size_t y = 0; y < height; y++)
+	{
+		for (std::size_t x = x0; x < x1; x++)
+		{
+			if (mask[y * width + x])
+			{
+				y0 = (std::min)(y0, y);
+				y1 = (std::max)(y1, y + 1);
+				break;
+			}
+		}
+	}
+	if (y0 >= y1)
+		return false;
+
+	// 保持长宽比, 放在正方形中间, 不然 "1" 和 "8" 拉伸以后都是一整块.
+	long w = static_cast<long>(x1 - x0), h = static_cast<long>(y1 - y0);
+	long side = (std::max)(w, h);
+	long ox = static_cast<long>(x0) - (side - w) / 2, oy = static_cast<long>(y0) - (side - h) / 2;
+	for (long gy = 0; gy < glyph_size; gy++)
+	{
+		long sy0 = oy + gy * side / glyph_size;
+		long sy1 = (std::max)(oy + (gy + 1) * side / glyph_size, sy0 + 1);
+		for (long gx = 0; gx < glyph_size; gx++)
+		{
+			long sx0 = ox + gx * side / glyph_size;
+			long sx1 = (std::max)(ox + (gx + 1) * side / glyph_size, sx0 + 1);
+
+			// 正方形超出字符范围的部分算作背景.
+			std::size_t ink = 0;
+			for (long y = (std::max)(sy0, static_cast<long>(y0)); y < (std::min)(sy1, static_cast<long>(y1)); y++)
+				for (long x = (std::max)(sx0, static_cast<long>(x0)); x < (std::min)(sx1, static_cast<long>(x1)); x++)
+					ink += mask[y * width + x];
+
+			out[gy * glyph_size + gx] = static_cast<unsigned char>(255 * ink / ((sy1 - sy0) * (sx1 - sx0)));
+		}
+	}
+	return true;
+}
+
+/*
+ * 按列投影把图片切成 count 个字符.
+ *
+ * 有墨迹的连续列是一段, 墨迹太少的段当作噪点丢掉. 段多了就合并间隔最小的相邻两段,
+ * 少了就把最宽的一段在中间投影最少的那一列切开.
+ */
+inline bool segment(const gray_image & image, std::size_t count, std::vector<glyph> & glyphs)
+{
+	std::vector<unsigned char> mask = binarize(image);
+	std::size_t width = image.width, height = image.height;
+
+	std::vector<std::size_t> projection(width, 0);
+	std::size_t total_ink = 0;
+	for (std::size_t y = 0; y < height; y++)
+		for (std::size_t x = 0; x < width; x++)
+			projection[x] += mask[y * width + x];
+	for (std::size_t x = 0; x < width; x++)
+		total_ink += projection[x];
+
+	if (total_ink == 0)
+		return false;
+
+	std::vector<column_run> runs;
+	for (std::size_t x = 0; x < width; )
+	{
+		if (projection[x] == 0)
+		{
+			x++;
+			continue;
+		}
+
+		column_run run = { x, x, 0 };
+		while (x < width && projection[x] > 0)
+			run.ink += projection[x++];
+		run.end = x;
+
+		if (run.ink * 50 >= total_ink)
+			runs.push_back(run);
+	}
+
+	while (runs.size() > count)
+	{
+		std::size_t merge = 0;
+		for (std::size_t i = 1; i + 1 < runs.size(); i++)
+		{
+			if (runs[i + 1].begin - runs[i].end < runs[merge + 1].begin - runs[merge].end)
+				merge = i;
+		}
+		runs[merge].end = runs[merge + 1].end;
+		runs[merge].ink += runs[merge + 1].ink;
+		runs.erase(runs.begin() + merge + 1);
+	}
+
+	while (!runs.empty() && runs.size() < count)
+	{
+		std::size_t widest = 0;
+		for (std::size_t i = 1; i < runs.size(); i++)
+		{
+			if (runs[i].end - runs[i].begin > runs[widest].end - runs[widest].begin)
+				widest = i;
+		}
+
+		column_run & run = runs[widest];
+		std::size_t w = run.end - run.begin;
+		if (w < 2)
+			return false;
+
+		std::size_t cut = run.begin + w / 2;
+		for (std::size_t x = run.begin + w / 4; x < run.begin + w * 3 / 4; x++)
+		{
+			if (projection[x] < projection[cut])
+				cut = x;
+		}
+		cut = (std::max)(cut, run.begin + 1);
+
+		column_run right = { cut, run.end, 0 };
+		for (std::size_t x = cut; x < run.end; x++)
+			right.ink += projection[x];
+		run.end = cut;
+		run.ink -= right.ink;
+		runs.insert(runs.begin() + widest + 1, right);
+	}
+
+	if (runs.size() != count)
+		return false;
+
+	glyphs.resize(count);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (!extract_glyph(mask, width, height, runs[i].begin, runs[i].end, glyphs[i]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * 字符模板库.
+ *
+ * 模板连续存放, 匹配的时候顺序扫一遍, 每个模板 256 字节正好是 16 次 SSE2 或者 8 次 AVX2 的 SAD.
+ * 文件格式是一个接一个的记录, 每条记录 1 字节的字符加 256 字节的模板.
+ */
+class template_set{
+public:
+	void add(char label, const glyph & g)
+	{
+		m_labels.push_back(label);
+		m_glyphs.insert(m_glyphs.end(), g.begin(), g.end());
+	}
+
+	void add(const template_set & other)
+	{
+		m_labels.insert(m_labels.end(), other.m_labels.begin(), other.m_labels.end());
+		m_glyphs.insert(m_glyphs.end(), other.m_glyphs.begin(), other.m_glyphs.end());
+	}
+
+	std::size_t size() const
+	{
+		return m_labels.size();
+	}
+
+	/*
+	 * 找出最像的字符 label, distance 是和它的距离,
+	 * runner_up 是和其他字符里最像的那个的距离, 两者差得越多越可信.
+	 */
+	bool classify(const glyph & g, char & label, unsigned & distance, unsigned & runner_up) const
+	{
+		if (m_labels.empty())
+			return false;
+
+		unsigned best[256];
+		std::fill(best, best + 256, unsigned(-1));
+
+		for (std::size_t i = 0; i < m_labels.size(); i++)
+		{
+			unsigned d = glyph_distance(g.data(), &m_glyphs[i * glyph_bytes]);
+			unsigned char l = static_cast<unsigned char>(m_labels[i]);
+			best[l] = (std::min)(best[l], d);
+		}
+
+		distance = runner_up = unsigned(-1);
+		for (int l = 0; l < 256; l++)
+		{
+			if (best[l] < distance)
+			{
+				runner_up = distance;
+				distance = best[l];
+				label = static_cast<char>(l);
+			}
+			else if (best[l] < runner_up)
+			{
+				runner_up = best[l];
+			}
+		}
+		return true;
+	}
+
+	bool load(const std::string & filename)
+	{
+		std::ifstream file(filename.c_str(), std::ifstream::binary);
+		if (!file)
+			return false;
+
+		char label;
+		glyph g;
+		while (file.get(label) && file.read(reinterpret_cast<char*>(g.data()), glyph_bytes))
+			add(label, g);
+		return true;
+	}
+
+	bool save(const std::string & filename) const
+	{
+		std::ofstream file(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+		if (!file)
+			return false;
+
+		for (std::size_t i = 0; i < m_labels.size(); i++)
+		{
+			file.put(m_labels[i]);
+			file.write(reinterpret_cast<const char*>(&m_glyphs[i * glyph_bytes]), glyph_bytes);
+		}
+		return static_cast<bool>(file);
+	}
+
+private:
+	std::vector<char> m_labels;
+	std::vector<unsigned char> m_glyphs;
+};
+
+/*
+ * 识别和 train 会在不同的线程里同时进行, 模板库和 decaptcha_settings 一样写时复制:
+ * 修改的时候拷贝一份改好再换上去, 识别的时候拿一份快照, 扫模板的时候不用加锁.
+ */
+class recognizer : boost::noncopyable{
+public:
+	explicit recognizer(std::size_t length)
+		: m_length(length), m_max_distance(48 * glyph_bytes), m_min_margin(0.2),
+		  m_templates(boost::make_shared<template_set>())
+	{
+	}
+
+	boost::system::error_code recognize(const std::string & buffer, std::string & answer) const
+	{
+		boost::shared_ptr<const template_set> templates;
+		unsigned max_distance;
+		double min_margin;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			templates = m_templates;
+			max_distance = m_max_distance;
+			min_margin = m_min_margin;
+		}
+
+		gray_image image;
+		if (!decode_image(buffer, image))
+			return error::image_not_supported;
+
+		std::vector<glyph> glyphs;
+		if (!segment(image, m_length, glyphs))
+			return error::segmentation_failed;
+
+		answer.clear();
+		for (std::size_t i = 0; i < glyphs.size(); i++)
+		{
+			char label;
+			unsigned distance, runner_up;
+			if (!templates->classify(glyphs[i], label, distance, runner_up))
+				return error::low_confidence;
+
+			// 离模板太远, 或者和第二像的字符差不多像, 都不可信.
+			if (distance > max_distance
+				|| (runner_up != unsigned(-1) && distance > (1.0 - min_margin) * runner_up))
+				return error::low_confidence;
+
+			answer += label;
+		}
+		return boost::system::error_code();
+	}
+
+	// 用已知答案的验证码扩充模板库, 切出来的字符个数和答案对不上就不要.
+	bool train(const std::string & buffer, const std::string & answer)
+	{
+		if (answer.length() != m_length)
+			return false;
+
+		gray_image image;
+		std::vector<glyph> glyphs;
+		if (!decode_image(buffer, image) || !segment(image, m_length, glyphs))
+			return false;
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<template_set> t = boost::make_shared<template_set>(*m_templates);
+		for (std::size_t i = 0; i < glyphs.size(); i++)
+			t->add(answer[i], glyphs[i]);
+		m_templates = t;
+		return true;
+	}
+
+	// 文件里的模板追加到模板库里.
+	bool load(const std::string & filename)
+	{
+		template_set loaded;
+		if (!loaded.load(filename))
+			return false;
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<template_set> t = boost::make_shared<template_set>(*m_templates);
+		t->add(loaded);
+		m_templates = t;
+		return true;
+	}
+
+	boost::shared_ptr<const template_set> templates() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_templates;
+	}
+
+	void set_max_distance(unsigned average_pixel_distance)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_max_distance = average_pixel_distance * glyph_bytes;
+	}
+
+	void set_min_margin(double min_margin)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_min_margin = min_margin;
+	}
+
+private:
+	const std::size_t m_length;
+
+	mutable boost::asio::detail::mutex m_mutex;
+	unsigned m_max_distance;
+	double m_min_margin;
+	boost::shared_ptr<const template_set> m_templates;
+};
+
+} // namespace detail
+} // namespace local_recognizer
+
+/*
+ * local_recognizer_decoder 在本地用模板匹配识别验证码, 不花钱, 几毫秒就有结果.
+ *
+ * 图片二值化以后按列切成 length 个字符, 每个字符和模板库里的模板比较.
+ * 没有把握的时候返回 low_confidence 错误, deCAPTCHA 接着交给下一个解码器,
+ * 所以要第一个 add_decoder.
+ *
+ * 模板库用 load_templates 加载, 或者用其他解码器识别正确的验证码 train 出来,
+ * 再用 save_templates 保存. 拷贝之间共享同一个模板库.
+ */
+class local_recognizer_decoder{
+public:
+	explicit local_recognizer_decoder(boost::asio::io_service & io_service, std::size_t length = 4)
+		: m_io_service(io_service),
+		  m_recognizer(boost::make_shared<local_recognizer::detail::recognizer>(length))
+	{
+	}
+
+	bool load_templates(const std::string & filename)
+	{
+		return m_recognizer->load(filename);
+	}
+
+	bool save_templates(const std::string & filename) const
+	{
+		return m_recognizer->templates()->save(filename);
+	}
+
+	bool train(const std::string & buffer, const std::string & answer)
+	{
+		return m_recognizer->train(buffer, answer);
+	}
+
+	std::size_t template_count() const
+	{
+		return m_recognizer->templates()->size();
+	}
+
+	// 每个像素平均差多少 (0 ~ 255) 以内才算像, 默认 48.
+	void set_max_distance(unsigned average_pixel_distance)
+	{
+		m_recognizer->set_max_distance(average_pixel_distance);
+	}
+
+	// 最像的字符要比第二像的近多少 (比例) 才算有把握, 默认 0.2.
+	void set_min_margin(double min_margin)
+	{
+		m_recognizer->set_min_margin(min_margin);
+	}
+
+	template <class Handler>
+	void operator()(const std::string &buffer, Handler handler)
+	{
+		std::string answer;
+		boost::system::error_code ec;
+
+		if (get_cancel_token(handler).is_canceled())
+			ec = boost::asio::error::operation_aborted;
+		else
+			ec = m_recognizer->recognize(buffer, answer);
+
+		m_io_service.post(
+			boost::asio::detail::bind_handler(
+				handler, ec, std::string("本地识别"), answer, boost::function<void()>()
+			)
+		);
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	boost::shared_ptr<local_recognizer::detail::recognizer> m_recognizer;
+};
+
+}
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <ctime>
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+#include <boost/random.hpp>
+#include <boost/format.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility/addressof.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/lexical_cast.hpp>
+#include <avhttp.hpp>
+
+#include "io_watchdog.hpp"
+
+namespace decaptcha{
+namespace detail{
+
+/*
+ * multipart_form 是一个预先生成好的 multipart/form-data 请求体模板.
+ *
+ * 固定的字段在解码器构造的时候生成一次, 每个验证码只需要生成文件的那一小段头,
+ * 图片本身不拷贝, 直接作为 buffer 序列的一部分发送出去.
+ *
+ * 请求体的结构是 preamble | file_header | 图片 | trailer.
+ */
+class multipart_form{
+	struct impl{
+		std::string boundary;
+		std::string preamble;
+		std::string trailer_fields;
+		std::string trailer;
+		std::string file_field;
+	};
+
+public:
+	multipart_form()
+		: m_impl(boost::make_shared<impl>())
+	{
+		boost::rand48 p(static_cast<boost::int32_t>(std::time(NULL) ^ reinterpret_cast<std::size_t>(m_impl.get())));
+		m_impl->boundary = boost::str(boost::format("----------------------------%06x%06x%06x%06x") % (p() & 0xffffff) % (p() & 0xffffff) % (p() & 0xffffff) % (p() & 0xffffff));
+		update_trailer();
+	}
+
+	// 在文件之前 (调用 file 之前) 或者之后添加一个普通字段.
+	multipart_form & field(const std::string & name, const std::string & value)
+	{
+		std::string part = "--" + m_impl->boundary + "\r\n"
+			+ "Content-Disposition: form-data; name=\"" + name + "\"\r\n\r\n"
+			+ value + "\r\n";
+
+		if (m_impl->file_field.empty())
+			m_impl->preamble += part;
+		else
+			m_impl->trailer_fields += part;
+
+		update_trailer();
+		return *this;
+	}
+
+	// 图片所在的字段.
+	multipart_form & file(const std::string & name)
+	{
+		m_impl->file_field = name;
+		return *this;
+	}
+
+	std::string content_type() const
+	{
+		return "multipart/form-data; boundary=" + m_impl->boundary;
+	}
+
+	// 每个验证码的文件头, 只有这一小段是每次都要生成的.
+	std::string file_header(const std::string & filename, const std::string & mime) const
+	{
+		return "--" + m_impl->boundary + "\r\n"
+			+ "Content-Disposition: form-data; name=\"" + m_impl->file_field + "\"; filename=\"" + filename + "\"\r\n"
+			+ "Content-Type: " + mime + "\r\n\r\n";
+	}
+
+	std::size_t content_length(const std::string & file_header, const std::string & file) const
+	{
+		return m_impl->preamble.length() + file_header.length() + file.length() + m_impl->trailer.length();
+	}
+
+	// file_header 和 file 必须在发送完成之前一直有效.
+	boost::array<boost::asio::const_buffer, 4> buffers(const std::string & file_header, const std::string & file) const
+	{
+		boost::array<boost::asio::const_buffer, 4> bufs = { {
+			boost::asio::buffer(m_impl->preamble),
+			boost::asio::buffer(file_header),
+			boost::asio::buffer(file),
+			boost::asio::buffer(m_impl->trailer)
+		} };
+		return bufs;
+	}
+
+private:
+	void update_trailer()
+	{
+		m_impl->trailer = "\r\n" + m_impl->trailer_fields + "--" + m_impl->boundary + "--\r\n";
+	}
+
+private:
+	// 只在解码器构造的时候修改, 之后所有的 op 共享.
+	boost::shared_ptr<impl> m_impl;
+};
+
+/*
+ * 发送 multipart/form-data 的 POST 请求.
+ *
+ * 用 fake_continue 让 async_open 发送完请求头就返回, 然后用 gather write 发送请求体,
+ * 再接收响应头. read_body 为 true 的时候接着读取整个响应体. handler 的签名和
+ * avhttp::async_read_body 一样是 (ec, bytes_transfered), 不读响应体的时候 bytes_transfered 为 0.
+ * 每一步都由 watchdog 限时, 超时的话 handler 收到 timed_out.
+ */
+template<class Handler>
+class async_post_multipart_op : boost::asio::coroutine
+{
+public:
+	async_post_multipart_op(boost::shared_ptr<avhttp::http_stream> stream,
+		boost::shared_ptr<io_watchdog<avhttp::http_stream> > watchdog, const std::string & url,
+		const multipart_form & form, const std::string & file_header, const std::string & file,
+		boost::asio::streambuf & response, bool read_body, Handler handler)
+		: m_stream(stream), m_watchdog(watchdog), m_file_header(boost::make_shared<std::string>(file_header)),
+		  m_form(form), m_file(file), m_response(response), m_read_body(read_body), m_handler(handler)
+	{
+		// 连接池里拿来的连接不用再连, 这里的限时按新建连接算.
+		m_watchdog->arm(m_watchdog->timeouts().connect + m_watchdog->timeouts().send);
+		m_stream->async_open(url, *this);
+	}
+
+	void operator()(boost::system::error_code ec, std::size_t bytes_transfered = 0)
+	{
+		BOOST_ASIO_CORO_REENTER(this)
+		{
+			// fake_continue 的时候, 请求头发送完毕返回的是 continue_request.
+			if (ec == avhttp::errc::continue_request)
+				ec = boost::system::error_code();
+
+			if (ec)
+			{
+				complete(ec, 0);
+				return;
+			}
+
+			m_watchdog->arm(m_watchdog->timeouts().send);
+			BOOST_ASIO_CORO_YIELD
+				boost::asio::async_write(*m_stream, m_form.buffers(*m_file_header, m_file), *this);
+
+			if (ec)
+			{
+				complete(ec, 0);
+				return;
+			}
+
+			m_watchdog->arm(m_watchdog->timeouts().first_byte);
+			BOOST_ASIO_CORO_YIELD m_stream->async_receive_header(*this);
+
+			if (ec || !m_read_body)
+			{
+				complete(ec, 0);
+				return;
+			}
+
+			m_watchdog->arm(m_watchdog->timeouts().read);
+			BOOST_ASIO_CORO_YIELD
+				boost::asio::async_read(*m_stream, m_response, avhttp::transfer_response_body(m_stream->content_length()), *this);
+
+			if (ec == boost::asio::error::eof)
+				ec = boost::system::error_code();
+
+			complete(ec, m_response.size());
+		}
+	}
+
+private:
+	void complete(boost::system::error_code ec, std::size_t bytes_transfered)
+	{
+		m_handler(m_watchdog->complete(ec), bytes_transfered);
+	}
+
+	// 中间步骤和最终的 handler 在同一个上下文里执行, handler 是 strand 包装过的话,
+	// 整个上传过程都在 strand 里.
+	template<class Function>
+	friend void asio_handler_invoke(const Function & function, async_post_multipart_op * this_handler)
+	{
+		using boost::asio::asio_handler_invoke;
+		asio_handler_invoke(function, boost::addressof(this_handler->m_handler));
+	}
+
+	// 中间步骤的 handler 内存也向最终的 handler 要, 比如解码器 op 的 handler_arena.
+	friend void * asio_handler_allocate(std::size_t size, async_post_multipart_op * this_handler)
+	{
+		using boost::asio::asio_handler_allocate;
+		return asio_handler_allocate(size, boost::addressof(this_handler->m_handler));
+	}
+
+	friend void asio_handler_deallocate(void * pointer, std::size_t size, async_post_multipart_op * this_handler)
+	{
+		using boost::asio::asio_handler_deallocate;
+		asio_handler_deallocate(pointer, size, boost::addressof(this_handler->m_handler));
+	}
+
+private:
+	boost::shared_ptr<avhttp::http_stream> m_stream;
+	boost::shared_ptr<io_watchdog<avhttp::http_stream> > m_watchdog;
+	boost::shared_ptr<std::string> m_file_header;
+	multipart_form m_form;
+	const std::string & m_file;
+	boost::asio::streambuf & m_response;
+	bool m_read_body;
+	Handler m_handler;
+};
+
+// async_send_multipart 的 handler 只接收 ec.
+template<class Handler>
+struct send_multipart_handler{
+	explicit send_multipart_handler(Handler handler)
+		: m_handler(handler)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::size_t)
+	{
+		m_handler(ec);
+	}
+
+	template<class Function>
+	friend void asio_handler_invoke(const Function & function, send_multipart_handler * this_handler)
+	{
+		using boost::asio::asio_handler_invoke;
+		asio_handler_invoke(function, boost::addressof(this_handler->m_handler));
+	}
+
+	friend void * asio_handler_allocate(std::size_t size, send_multipart_handler * this_handler)
+	{
+		using boost::asio::asio_handler_allocate;
+		return asio_handler_allocate(size, boost::addressof(this_handler->m_handler));
+	}
+
+	friend void asio_handler_deallocate(void * pointer, std::size_t size, send_multipart_handler * this_handler)
+	{
+		using boost::asio::asio_handler_deallocate;
+		asio_handler_deallocate(pointer, size, boost::addressof(this_handler->m_handler));
+	}
+
+	Handler m_handler;
+};
+
+inline avhttp::request_opts multipart_request_opts(avhttp::request_opts opts,
+	const multipart_form & form, const std::string & file_header, const std::string & file)
+{
+	opts(avhttp::http_options::request_method, "POST")
+		(avhttp::http_options::connection, "keep-alive")
+		(avhttp::http_options::content_type, form.content_type())
+		(avhttp::http_options::content_length, boost::lexical_cast<std::string>(form.content_length(file_header, file)))
+		(avhttp::http_options::fake_continue, "true");
+	return opts;
+}
+
+/*
+ * async_post_multipart 上传 file 并读取整个响应, handler 签名为 (ec, bytes_transfered).
+ *
+ * 和 asio 的惯例一样, file 在 handler 被调用之前必须一直有效.
+ * watchdog 是 stream 的, 绑定在 handler 所在的 strand 上.
+ */
+template<class Handler>
+void async_post_multipart(boost::shared_ptr<avhttp::http_stream> stream,
+	boost::shared_ptr<io_watchdog<avhttp::http_stream> > watchdog, const std::string & url,
+	const avhttp::request_opts & opts, const multipart_form & form,
+	const std::string & filename, const std::string & mime, const std::string & file,
+	boost::asio::streambuf & response, Handler handler)
+{
+	std::string file_header = form.file_header(filename, mime);
+	stream->request_options(multipart_request_opts(opts, form, file_header, file));
+	async_post_multipart_op<Handler>(stream, watchdog, url, form, file_header, file, response, true, handler);
+}
+
+// 和 async_post_multipart 一样, 但只接收响应头, handler 签名为 (ec).
+template<class Handler>
+void async_send_multipart(boost::shared_ptr<avhttp::http_stream> stream,
+	boost::shared_ptr<io_watchdog<avhttp::http_stream> > watchdog, const std::string & url,
+	const avhttp::request_opts & opts, const multipart_form & form,
+	const std::string & filename, const std::string & mime, const std::string & file,
+	boost::asio::streambuf & response, Handler handler)
+{
+	std::string file_header = form.file_header(filename, mime);
+	stream->request_options(multipart_request_opts(opts, form, file_header, file));
+	async_post_multipart_op<send_multipart_handler<Handler> >(stream, watchdog, url, form, file_header, file, response, false,
+		send_multipart_handler<Handler>(handler));
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <avhttp.hpp>
+#include <avhttp/async_read_body.hpp>
+
+#include "cancel_token.hpp"
+#include "handler_arena.hpp"
+#include "http_connection_pool.hpp"
+#include "io_watchdog.hpp"
+#include "streambuf_pool.hpp"
+#include "response_parser.hpp"
+
+namespace decaptcha{
+namespace detail{
+
+/*
+ * 请求一个 url, 把整个响应体交给 handler. 默认是 GET, opts 里也可以带上 POST 的请求体.
+ * 响应体不复制, 交给 handler 的 string_ref 指向 op 自己的 streambuf, 只在 handler 里有效.
+ *
+ * 连接从连接池借, 连到这个 host 的连接太多的时候先排队.
+ * 建立连接发送请求到收到响应头, 和读取响应体分别由 io_watchdog 限时,
+ * 超时的连接被关闭, 不会还回连接池, 下一次请求用新的连接.
+ */
+class fetch_url_op : boost::asio::coroutine{
+public:
+	typedef boost::function<void (boost::system::error_code, boost::string_ref)> handler_type;
+
+private:
+	// op 在每一步异步操作之间被拷贝, 拷贝的只是指向 state 的指针.
+	struct state : boost::noncopyable
+	{
+		state(boost::asio::io_service & io_service, const std::string & _url,
+			const avhttp::request_opts & _opts, const handler_type & _handler)
+			: strand(boost::make_shared<op_strand>(boost::ref(io_service))),
+			  watchdog(boost::make_shared<io_watchdog<avhttp::http_stream> >(boost::ref(io_service), strand, stream)),
+			  buffers(acquire_streambuf(io_service)),
+			  url(_url), opts(_opts), handler(_handler)
+		{
+		}
+
+		handler_arena arena;
+
+		boost::shared_ptr<op_strand> strand;
+		boost::shared_ptr<avhttp::http_stream> stream;
+		boost::shared_ptr<io_watchdog<avhttp::http_stream> > watchdog;
+		boost::shared_ptr<boost::asio::streambuf> buffers;
+		std::string url;
+		avhttp::request_opts opts;
+		handler_type handler;
+	};
+
+public:
+	fetch_url_op(boost::asio::io_service & io_service, const std::string & url,
+		const avhttp::request_opts & opts, const handler_type & handler)
+		: m_state(boost::make_shared<state>(boost::ref(io_service), url, opts, handler))
+	{
+		// 连到这个 host 的连接太多的时候在连接池里排队.
+		async_acquire_http_stream(io_service, url, m_state->strand->wrap(*this));
+	}
+
+	// 借到了连接, 发送请求. 排队的时间不算在限时里.
+	void operator()(boost::shared_ptr<avhttp::http_stream> stream)
+	{
+		state & st = *m_state;
+
+		st.stream = stream;
+		st.watchdog->attach(stream);
+		st.stream->request_options(st.opts);
+
+		const io_timeouts & timeouts = st.watchdog->timeouts();
+		st.watchdog->arm(timeouts.connect + timeouts.send + timeouts.first_byte);
+		st.stream->async_open(st.url, st.strand->wrap(*this));
+	}
+
+	void operator()(boost::system::error_code ec, std::size_t bytes_transfered = 0)
+	{
+		state & st = *m_state;
+
+		BOOST_ASIO_CORO_REENTER(this)
+		{
+			if (!ec)
+			{
+				st.watchdog->arm(st.watchdog->timeouts().read);
+				BOOST_ASIO_CORO_YIELD
+					boost::asio::async_read(*st.stream, *st.buffers, avhttp::transfer_response_body(st.stream->content_length()), st.strand->wrap(*this));
+
+				if (ec == boost::asio::error::eof)
+					ec = boost::system::error_code();
+			}
+
+			complete(st.watchdog->complete(ec));
+		}
+	}
+
+private:
+	void complete(boost::system::error_code ec)
+	{
+		state & st = *m_state;
+
+		// 连接先还回连接池, 下一个批次可以接着用. st.buffers 要到 op 结束才还, handler 里 body 一直有效.
+		st.stream.reset();
+		st.handler(ec, response_data(*st.buffers, st.buffers->size()));
+	}
+
+	friend void * asio_handler_allocate(std::size_t size, fetch_url_op * this_handler)
+	{
+		return this_handler->m_state->arena.allocate(size);
+	}
+
+	friend void asio_handler_deallocate(void * pointer, std::size_t, fetch_url_op * this_handler)
+	{
+		this_handler->m_state->arena.deallocate(pointer);
+	}
+
+private:
+	boost::shared_ptr<state> m_state;
+};
+
+// 只是发出请求, 不关心结果, 比如 reportbad.
+struct ignore_fetch_result{
+	void operator()(boost::system::error_code, boost::string_ref) const
+	{
+	}
+};
+
+/*
+ * poll_multiplexer 把同一个服务商所有在等结果的验证码的查询合并起来.
+ *
+ * 同一轮 (同一个时间轮 tick 里醒来的) 查询先排队, 然后由 fetch 一次查询最多 max_batch 个,
+ * 同一时间最多 max_in_flight 个请求在路上.
+ * 支持批量查询的服务商 (antigate 的 ids=) 一个请求就够了, max_in_flight 为 1,
+ * 请求数量和在等待的验证码数量无关.
+ * 不支持的 max_batch 为 1, 每个查询各自从连接池借连接, 同时发出去,
+ * 一个卡住的查询不会挡住别人, 连接数由连接池的 max_active_per_host 限制.
+ *
+ * 每个查询的结果写进调用者自己的 streambuf, handler 的签名和 async_read_body 一样.
+ * fetch 交回来的结果指向它收到的响应体, 直接写进调用者的 streambuf, 中间不复制成 std::string.
+ * 调用者不等了可以用同一个 streambuf cancel, 还在排队的查询被撤掉, 不再占一个请求.
+ * 可以在多个线程里同时 async_poll, 队列和状态由 m_mutex 保护, fetch 在锁外面发起.
+ */
+class poll_multiplexer
+	: boost::noncopyable, public boost::enable_shared_from_this<poll_multiplexer>
+{
+public:
+	typedef boost::function<void (boost::system::error_code, std::size_t)> handler_type;
+
+	// 查询完成, answers 和 keys 一一对应, 指向 fetch 收到的响应体, 只在 handler 里有效.
+	typedef boost::iterator_range<const boost::string_ref *> answer_range;
+	typedef boost::function<void (boost::system::error_code, answer_range)> fetch_handler;
+	typedef boost::function<void (const std::vector<std::string> & keys, const fetch_handler &)> fetch_function;
+
+	poll_multiplexer(boost::asio::io_service & io_service, const fetch_function & fetch,
+		std::size_t max_batch, std::size_t max_in_flight = 1)
+		: m_io_service(io_service), m_fetch(fetch), m_max_batch((std::max)(max_batch, std::size_t(1))),
+		  m_max_in_flight((std::max)(max_in_flight, std::size_t(1))),
+		  m_flush_pending(false), m_in_flight(0)
+	{
+	}
+
+	void async_poll(const std::string & key, boost::shared_ptr<boost::asio::streambuf> buffer, const handler_type & handler)
+	{
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			m_waiters.push_back(waiter());
+			waiter & w = m_waiters.back();
+			w.key = key;
+			w.buffer = buffer;
+			w.handler = handler;
+
+			if (m_flush_pending || m_in_flight >= m_max_in_flight)
+				return;
+			m_flush_pending = true;
+		}
+
+		// 推迟到这一轮的 handler 都跑完再发, 这样同一个 tick 醒来的查询都在一个批次里.
+		m_io_service.post(boost::bind(&poll_multiplexer::handle_flush, boost::weak_ptr<poll_multiplexer>(shared_from_this())));
+	}
+
+	// 还在排队的查询撤掉, handler 收到 operation_aborted. 已经发出去的照常完成.
+	void cancel(const boost::shared_ptr<boost::asio::streambuf> & buffer)
+	{
+		handler_type handler;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			for (std::deque<waiter>::iterator it = m_waiters.begin(); it != m_waiters.end(); ++it)
+			{
+				if (it->buffer == buffer)
+				{
+					handler.swap(it->handler);
+					m_waiters.erase(it);
+					break;
+				}
+			}
+		}
+
+		if (handler)
+			m_io_service.post(boost::asio::detail::bind_handler(handler,
+				boost::system::error_code(boost::asio::error::operation_aborted), std::size_t(0)));
+	}
+
+	std::size_t pending() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_waiters.size();
+	}
+
+private:
+	struct waiter{
+		std::string key;
+		boost::shared_ptr<boost::asio::streambuf> buffer;
+		handler_type handler;
+
+		void swap(waiter & other)
+		{
+			key.swap(other.key);
+			buffer.swap(other.buffer);
+			handler.swap(other.handler);
+		}
+	};
+
+	static void handle_flush(boost::weak_ptr<poll_multiplexer> weak_self)
+	{
+		if (boost::shared_ptr<poll_multiplexer> self = weak_self.lock())
+		{
+			{
+				boost::asio::detail::mutex::scoped_lock l(self->m_mutex);
+				self->m_flush_pending = false;
+			}
+			self->flush();
+		}
+	}
+
+	void flush()
+	{
+		// 还能发就接着发, 一次一个批次.
+		while (flush_one())
+			;
+	}
+
+	bool flush_one()
+	{
+		boost::shared_ptr<std::vector<waiter> > batch = boost::make_shared<std::vector<waiter> >();
+		std::vector<std::string> keys;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			if (m_in_flight >= m_max_in_flight || m_waiters.empty())
+				return false;
+
+			batch->reserve((std::min)(m_waiters.size(), m_max_batch));
+			keys.reserve(batch->capacity());
+
+			// waiter 里的 handler 是 boost::function, 交换过去而不是拷贝, 省掉一次内存分配.
+			while (!m_waiters.empty() && batch->size() < m_max_batch)
+			{
+				batch->push_back(waiter());
+				batch->back().swap(m_waiters.front());
+				keys.push_back(batch->back().key);
+				m_waiters.pop_front();
+			}
+			m_in_flight++;
+		}
+
+		m_fetch(keys,
+			boost::bind(&poll_multiplexer::handle_fetch, shared_from_this(), batch, _1, _2)
+		);
+		return true;
+	}
+
+	void handle_fetch(boost::shared_ptr<std::vector<waiter> > batch,
+		boost::system::error_code ec, answer_range answers)
+	{
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			m_in_flight--;
+		}
+
+		if (!ec && std::size_t(answers.size()) != batch->size())
+			ec = boost::asio::error::invalid_argument;
+
+		for (std::size_t i = 0; i < batch->size(); i++)
+		{
+			waiter & w = (*batch)[i];
+			std::size_t bytes = 0;
+			if (!ec)
+			{
+				w.buffer->sputn(answers[i].data(), answers[i].size());
+				bytes = answers[i].size();
+			}
+			// 这里已经是 fetch 的完成 handler, 不在 async_poll 里面, 直接调用.
+			// 解码器传进来的 handler 是用它的 strand 包装过的, 转进 strand 的内存从它自己的 arena 分配.
+			w.handler(ec, bytes);
+		}
+
+		// 排队等着的接着发.
+		flush();
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	fetch_function m_fetch;
+	const std::size_t m_max_batch;
+	const std::size_t m_max_in_flight;
+
+	mutable boost::asio::detail::mutex m_mutex;
+	std::deque<waiter> m_waiters;
+	bool m_flush_pending;
+	std::size_t m_in_flight;
+};
+
+/*
+ * 保存每个服务商的 poll_multiplexer, 每个 io_service 一个.
+ * key 是服务商加上账号, 不同账号的验证码不能合并查询.
+ */
+class poll_multiplexer_service
+	: public boost::asio::detail::service_base<poll_multiplexer_service>
+{
+public:
+	explicit poll_multiplexer_service(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<poll_multiplexer_service>(io_service),
+		  m_io_service(io_service)
+	{
+	}
+
+	boost::shared_ptr<poll_multiplexer> get(const std::string & key,
+		const poll_multiplexer::fetch_function & fetch, std::size_t max_batch, std::size_t max_in_flight)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<poll_multiplexer> & mux = m_multiplexers[key];
+		if (!mux)
+			mux = boost::make_shared<poll_multiplexer>(boost::ref(m_io_service), fetch, max_batch, max_in_flight);
+		return mux;
+	}
+
+private:
+	void shutdown_service()
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_multiplexers.clear();
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	boost::asio::detail::mutex m_mutex;
+	std::map<std::string, boost::shared_ptr<poll_multiplexer> > m_multiplexers;
+};
+
+struct cancel_poll_op{
+	cancel_poll_op(boost::shared_ptr<poll_multiplexer> poller, boost::shared_ptr<boost::asio::streambuf> buffer)
+		: m_poller(poller), m_buffer(buffer)
+	{
+	}
+
+	void operator()()
+	{
+		boost::shared_ptr<poll_multiplexer> poller = m_poller.lock();
+		boost::shared_ptr<boost::asio::streambuf> buffer = m_buffer.lock();
+		if (poller && buffer)
+			poller->cancel(buffer);
+	}
+
+	boost::weak_ptr<poll_multiplexer> m_poller;
+	boost::weak_ptr<boost::asio::streambuf> m_buffer;
+};
+
+// 取消 (包括超时) 的时候撤掉还在排队的查询. 在 op 的 strand 里执行, 不会和 op 发起查询错开.
+inline void cancel_poll_on_cancel(const cancel_token & token, boost::shared_ptr<op_strand> strand,
+	boost::shared_ptr<poll_multiplexer> poller, boost::shared_ptr<boost::asio::streambuf> buffer)
+{
+	token.on_cancel(dispatch_on_cancel_op<cancel_poll_op>(strand, cancel_poll_op(poller, buffer)), buffer);
+}
+
+struct fetch_one_url_handler{
+	poll_multiplexer::fetch_handler handler;
+
+	void operator()(boost::system::error_code ec, boost::string_ref body) const
+	{
+		handler(ec, poll_multiplexer::answer_range(&body, &body + 1));
+	}
+};
+
+// 不支持批量查询的服务商, key 就是查询的 url, 一次一个.
+inline void fetch_one_url(boost::asio::io_service & io_service, const avhttp::request_opts & opts,
+	const std::vector<std::string> & keys, const poll_multiplexer::fetch_handler & handler)
+{
+	fetch_one_url_handler h;
+	h.handler = handler;
+	fetch_url_op op(io_service, keys[0], opts, h);
+}
+
+inline boost::shared_ptr<poll_multiplexer> get_poll_multiplexer(boost::asio::io_service & io_service,
+	const std::string & key, const poll_multiplexer::fetch_function & fetch,
+	std::size_t max_batch, std::size_t max_in_flight = 1)
+{
+	return boost::asio::use_service<poll_multiplexer_service>(io_service).get(key, fetch, max_batch, max_in_flight);
+}
+
+// 一个 url 一个请求, 各自从连接池借连接同时发送, 同时在路上的请求数由连接池限制.
+inline boost::shared_ptr<poll_multiplexer> get_url_poll_multiplexer(boost::asio::io_service & io_service,
+	const std::string & key, const avhttp::request_opts & opts)
+{
+	return get_poll_multiplexer(io_service, key,
+		boost::bind(&fetch_one_url, boost::ref(io_service), opts, _1, _2), 1,
+		(std::numeric_limits<std::size_t>::max)());
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <map>
+#include <string>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "decoder_stats.hpp"
+
+namespace decaptcha{
+
+/*
+ * poll_schedule 决定上传验证码之后什么时候去查询结果.
+ *
+ * 记录服务商最近的识别耗时, 第一次查询放在中位数, 之后的查询把中位数到 95% 分位之间
+ * 平均分成 poll_budget - 1 份, 这样大部分验证码只需要查询 poll_budget 次以内,
+ * 结果出来之后平均只多等半个间隔. 样本不够的时候用服务商文档里建议的固定值.
+ *
+ * 第一次查询就拿到结果的, 只知道耗时不超过 first_delay, 不知道具体是多少 (删失的样本).
+ * 它们不混进耗时样本, 只记下占的比例: 要的分位数比这个比例高, 就在后面查询拿到的样本里找;
+ * 落在第一次查询之前的, 假设在 [0, first_delay] 里均匀分布按比例估计.
+ * 这样 first_delay 正好是中位数的时候不会被拉低, 服务商变快了也能跟着变短.
+ *
+ * 查询的时间超过上传之后 max_wait 就放弃, 默认值和原来固定的重试次数等价.
+ * 一个验证码最多查询 poll_budget 的 max_polls_per_budget 倍次. 前 poll_budget 次按学到的间隔查询,
+ * 之后还没有结果的少数验证码, 把到 max_wait 剩下的时间平分给剩下的次数, 这样次数有上限也能等满 max_wait.
+ * 所有的解码器 op 共用, 可以在多个线程里同时使用.
+ */
+class poll_schedule : boost::noncopyable{
+public:
+	enum { max_polls_per_budget = 3 };
+
+	poll_schedule(boost::posix_time::time_duration first_delay,
+		boost::posix_time::time_duration interval, boost::posix_time::time_duration max_wait)
+		: m_outcome_next(0),
+		  m_default_first_delay(first_delay), m_default_interval(interval), m_max_wait(max_wait),
+		  m_min_interval(boost::posix_time::seconds(1)), m_poll_budget(4)
+	{
+		for (int i = 0; i < max_samples; i++)
+			m_outcomes[i].store(-1, boost::memory_order_relaxed);
+	}
+
+	// 上传之后已经等了 waited, 第 n 次 (从 0 开始) 查询之前还要等多久.
+	boost::posix_time::time_duration delay(std::size_t n, boost::posix_time::time_duration waited) const
+	{
+		if (n == 0)
+			return first_delay();
+
+		boost::posix_time::time_duration interval = poll_interval();
+		std::size_t polls = max_polls();
+		boost::posix_time::time_duration left = max_wait() - waited;
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		if (n < m_poll_budget || n >= polls || left <= interval)
+			return interval;
+		return (std::max)(interval, left / static_cast<int>(polls - n));
+	}
+
+	// 上传之后 at 的时候, 已经查询过 polls 次了, 还要不要查询.
+	bool should_poll(boost::posix_time::time_duration at, std::size_t polls) const
+	{
+		return at <= max_wait() && polls < max_polls();
+	}
+
+	// 一个验证码最多查询几次.
+	std::size_t max_polls() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return (std::max)(m_poll_budget, std::size_t(1)) * max_polls_per_budget;
+	}
+
+	/*
+	 * 上传之后 elapsed 的那次查询拿到了结果, 上一次查询到这次之间隔了 last_delay.
+	 * 结果是在这段时间内某个时刻出来的, 取中点作为识别耗时.
+	 */
+	void record_solve(boost::posix_time::time_duration elapsed, boost::posix_time::time_duration last_delay)
+	{
+		boost::posix_time::time_duration solve = elapsed - last_delay / 2;
+		if (solve.is_negative())
+			solve = boost::posix_time::time_duration();
+		m_stats.record_latency(solve);
+		record_outcome(-1);
+	}
+
+	// 等了 first_delay 之后的第一次查询就拿到了结果, 耗时不超过 first_delay.
+	void record_first_poll_solve(boost::posix_time::time_duration first_delay)
+	{
+		record_outcome(first_delay.total_milliseconds());
+	}
+
+	// percentile (0 ~ 1) 分位的识别耗时, 样本少于 decoder_stats::min_samples 的时候返回 not_a_date_time.
+	boost::posix_time::time_duration solve_percentile(double percentile) const
+	{
+		std::size_t count = sample_count(), first_poll = 0;
+		boost::int64_t bound = 0;
+		for (std::size_t i = 0; i < count; i++)
+		{
+			boost::int64_t v = m_outcomes[i].load(boost::memory_order_acquire);
+			if (v >= 0)
+			{
+				first_poll ++;
+				bound += v;
+			}
+		}
+
+		if (count < decoder_stats::min_samples)
+			return boost::posix_time::time_duration(boost::posix_time::not_a_date_time);
+
+		double censored = static_cast<double>(first_poll) / count;
+		if (first_poll && percentile <= censored)
+			return boost::posix_time::milliseconds(static_cast<boost::int64_t>(bound / first_poll * (percentile / censored)));
+
+		// 后面的查询拿到的都比第一次查询晚, 换算成它们里面的分位数.
+		return m_stats.latency_percentile((percentile - censored) / (1 - censored));
+	}
+
+	boost::posix_time::time_duration first_delay() const
+	{
+		boost::posix_time::time_duration median = solve_percentile(0.5);
+		if (median.is_special())
+			return m_default_first_delay;
+
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return (std::max)(median, m_min_interval);
+	}
+
+	boost::posix_time::time_duration poll_interval() const
+	{
+		boost::posix_time::time_duration median = solve_percentile(0.5);
+		boost::posix_time::time_duration tail = solve_percentile(0.95);
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		if (median.is_special() || tail.is_special() || m_poll_budget < 2)
+			return m_default_interval;
+
+		boost::posix_time::time_duration interval = (tail - median) / static_cast<int>(m_poll_budget - 1);
+		return (std::min)((std::max)(interval, m_min_interval), m_default_interval);
+	}
+
+	boost::posix_time::time_duration max_wait() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_max_wait;
+	}
+
+	// 第一次查询就拿到结果的也算.
+	std::size_t sample_count() const
+	{
+		return (std::min)(m_outcome_next.load(boost::memory_order_acquire), std::size_t(max_samples));
+	}
+
+	// 只有第一次查询之后才拿到结果的验证码的耗时.
+	const decoder_stats & stats() const
+	{
+		return m_stats;
+	}
+
+	// 大部分验证码期望的查询次数.
+	void set_poll_budget(std::size_t poll_budget)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_poll_budget = poll_budget;
+	}
+
+	void set_min_interval(boost::posix_time::time_duration min_interval)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_min_interval = min_interval;
+	}
+
+	void set_max_wait(boost::posix_time::time_duration max_wait)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_max_wait = max_wait;
+	}
+
+private:
+	enum { max_samples = decoder_stats::max_samples };
+
+	void record_outcome(boost::int64_t first_poll_bound)
+	{
+		std::size_t n = m_outcome_next.fetch_add(1, boost::memory_order_relaxed);
+		m_outcomes[n % max_samples].store(first_poll_bound, boost::memory_order_release);
+	}
+
+private:
+	decoder_stats m_stats;
+	// 最近每个验证码是不是第一次查询就拿到了结果: 是的话记当时的 first_delay (毫秒), 不是记 -1.
+	boost::atomic<boost::int64_t> m_outcomes[max_samples];
+	boost::atomic<std::size_t> m_outcome_next;
+
+	// 只保护下面几个设置, 样本本身不用加锁.
+	mutable boost::asio::detail::mutex m_mutex;
+
+	const boost::posix_time::time_duration m_default_first_delay, m_default_interval;
+	boost::posix_time::time_duration m_max_wait, m_min_interval;
+	std::size_t m_poll_budget;
+};
+
+/*
+ * poll_scheduler 保存每个服务商的 poll_schedule, 每个 io_service 一个.
+ *
+ *   boost::asio::use_service<decaptcha::poll_scheduler>(io_service).find("antigate")
+ *
+ * 可以查看学到的查询时间.
+ */
+class poll_scheduler
+	: public boost::asio::detail::service_base<poll_scheduler>
+{
+public:
+	explicit poll_scheduler(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<poll_scheduler>(io_service)
+	{
+	}
+
+	// 服务商第一次用的时候以给定的默认值创建.
+	boost::shared_ptr<poll_schedule> get(const std::string & provider,
+		boost::posix_time::time_duration first_delay,
+		boost::posix_time::time_duration interval, boost::posix_time::time_duration max_wait)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<poll_schedule> & schedule = m_schedules[provider];
+		if (!schedule)
+			schedule = boost::make_shared<poll_schedule>(first_delay, interval, max_wait);
+		return schedule;
+	}
+
+	// 没有的话返回空.
+	boost::shared_ptr<poll_schedule> find(const std::string & provider) const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		std::map<std::string, boost::shared_ptr<poll_schedule> >::const_iterator it = m_schedules.find(provider);
+		if (it == m_schedules.end())
+			return boost::shared_ptr<poll_schedule>();
+		return it->second;
+	}
+
+private:
+	void shutdown_service()
+	{
+	}
+
+private:
+	mutable boost::asio::detail::mutex m_mutex;
+	std::map<std::string, boost::shared_ptr<poll_schedule> > m_schedules;
+};
+
+namespace detail{
+
+inline boost::shared_ptr<poll_schedule> get_poll_schedule(boost::asio::io_service & io_service,
+	const std::string & provider, int first_delay, int interval, int max_retries)
+{
+	return boost::asio::use_service<poll_scheduler>(io_service).get(provider,
+		boost::posix_time::seconds(first_delay), boost::posix_time::seconds(interval),
+		boost::posix_time::seconds(first_delay + interval * max_retries));
+}
+
+// 一个验证码的查询进度, 放在 op 的 state 里面.
+class poll_timing{
+public:
+	explicit poll_timing(boost::shared_ptr<poll_schedule> schedule)
+		: m_schedule(schedule), m_polls(0)
+	{
+	}
+
+	// 上传完成, 开始计时.
+	void start()
+	{
+		m_upload_time = boost::posix_time::microsec_clock::universal_time();
+		m_waited = boost::posix_time::time_duration();
+		m_polls = 0;
+	}
+
+	// 下一次查询之前要等多久.
+	boost::posix_time::time_duration next_delay()
+	{
+		m_last_delay = m_schedule->delay(m_polls ++, m_waited);
+		m_waited += m_last_delay;
+		return m_last_delay;
+	}
+
+	bool should_poll() const
+	{
+		return m_schedule->should_poll(m_waited + m_schedule->delay(m_polls, m_waited), m_polls);
+	}
+
+	// 查询拿到了结果.
+	void solved()
+	{
+		if (m_polls == 0)
+			return;
+
+		if (m_polls == 1)
+			m_schedule->record_first_poll_solve(m_last_delay);
+		else
+			m_schedule->record_solve(
+				boost::posix_time::microsec_clock::universal_time() - m_upload_time, m_last_delay);
+	}
+
+private:
+	boost::shared_ptr<poll_schedule> m_schedule;
+	boost::posix_time::ptime m_upload_time;
+	boost::posix_time::time_duration m_waited, m_last_delay;
+	std::size_t m_polls;
+};
+
+} // namespace detail
+} // namespace decaptcha
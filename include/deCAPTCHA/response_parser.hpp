@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <cstddef>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/*
+ * 打码平台返回的都是很短的 ASCII 文本, 格式也固定, 像 "OK|123456" 这样.
+ * 以前每次都先 sgetn 复制成 std::string, 再现场构造 boost::regex 去匹配, 一个响应要分配好几次内存.
+ * 这里的扫描函数直接在 streambuf 的 data() 上工作, 返回的 string_ref 指向 streambuf 里的数据,
+ * 只有最后交给 handler 的答案才复制成 std::string.
+ * deathbycaptcha 和联众返回的是 JSON, 用后面的 json_reader 读, 不再构造 ptree.
+ *
+ * string_ref 在 streambuf 被 consume 或者 reset_streambuf 之前有效.
+ */
+namespace decaptcha{
+namespace detail{
+
+// streambuf 里前 size 个字节, 不复制. asio::streambuf 的 data() 总是一整块连续的内存.
+inline boost::string_ref response_data(const boost::asio::streambuf & buffer, std::size_t size)
+{
+	boost::asio::streambuf::const_buffers_type data = buffer.data();
+	return boost::string_ref(boost::asio::buffer_cast<const char *>(data),
+		(std::min)(size, boost::asio::buffer_size(data)));
+}
+
+// 不受 locale 影响的字符分类, 和正则里的 [0-9] [a-zA-Z] 一样.
+inline bool is_ascii_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+inline bool is_ascii_alpha(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+inline bool is_ascii_alnum(char c)
+{
+	return is_ascii_digit(c) || is_ascii_alpha(c);
+}
+
+// 开头连续满足 pred 的那一段, 相当于 "^([pred]*)".
+template<class Predicate>
+inline boost::string_ref scan_span(boost::string_ref text, Predicate pred)
+{
+	std::size_t n = 0;
+	while (n < text.size() && pred(text[n]))
+		n++;
+	return text.substr(0, n);
+}
+
+// 不为空并且每个字符都满足 pred, 相当于 regex_match("([pred]+)").
+template<class Predicate>
+inline bool match_all(boost::string_ref text, Predicate pred)
+{
+	return !text.empty() && scan_span(text, pred).size() == text.size();
+}
+
+inline bool contains(boost::string_ref text, boost::string_ref needle)
+{
+	return std::search(text.begin(), text.end(), needle.begin(), needle.end()) != text.end()
+		|| needle.empty();
+}
+
+// 找到第一个 marker, 取出紧跟着的那一段满足 pred 的字符 (可以为空), 相当于 regex_search("marker([pred]*)").
+template<class Predicate>
+inline bool find_span_after(boost::string_ref text, boost::string_ref marker, Predicate pred, boost::string_ref & out)
+{
+	boost::string_ref::const_iterator pos = std::search(text.begin(), text.end(), marker.begin(), marker.end());
+	if (pos == text.end() && !marker.empty())
+		return false;
+
+	out = scan_span(text.substr((pos - text.begin()) + marker.size()), pred);
+	return true;
+}
+
+// JSON 里的一个值. raw 指向原文, 字符串是引号里面的部分, 转义还没有展开.
+struct json_value
+{
+	enum kind_type { null_value, bool_value, number_value, string_value, object_value, array_value };
+
+	kind_type kind;
+	boost::string_ref raw;
+
+	json_value()
+		: kind(null_value)
+	{
+	}
+
+	// to_string() 是不是空的. 判断 "还没有结果" 用这个, 不需要复制.
+	bool empty() const
+	{
+		return kind == null_value || kind == object_value || kind == array_value || raw.empty();
+	}
+
+	// 和 ptree 的 get<bool> 一样, 认 true/false 和 1/0, 字符串里的也认.
+	bool to_bool(bool & out) const
+	{
+		if (kind == object_value || kind == array_value)
+			return false;
+
+		if (raw == "true" || raw == "1")
+			out = true;
+		else if (raw == "false" || raw == "0")
+			out = false;
+		else
+			return false;
+		return true;
+	}
+
+	// 复制出来交给调用者. 字符串展开转义, \uXXXX 转成 UTF-8; 数字和 true/false 是原文;
+	// null, object 和 array 是空字符串.
+	std::string to_string() const
+	{
+		if (kind == string_value)
+			return unescape(raw);
+		if (kind == bool_value || kind == number_value)
+			return std::string(raw.begin(), raw.end());
+		return std::string();
+	}
+
+private:
+	static unsigned hex_value(boost::string_ref hex)
+	{
+		unsigned v = 0;
+		for (std::size_t i = 0; i < hex.size(); i++)
+		{
+			char c = hex[i];
+			v = v * 16 + (is_ascii_digit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+		}
+		return v;
+	}
+
+	static void append_utf8(std::string & out, unsigned cp)
+	{
+		if (cp < 0x80)
+		{
+			out += static_cast<char>(cp);
+		}
+		else if (cp < 0x800)
+		{
+			out += static_cast<char>(0xC0 | (cp >> 6));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else if (cp < 0x10000)
+		{
+			out += static_cast<char>(0xE0 | (cp >> 12));
+			out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else
+		{
+			out += static_cast<char>(0xF0 | (cp >> 18));
+			out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+	}
+
+	// json_reader 已经检查过转义的格式了.
+	static std::string unescape(boost::string_ref text)
+	{
+		std::string out;
+		out.reserve(text.size());
+
+		for (std::size_t i = 0; i < text.size(); i++)
+		{
+			char c = text[i];
+			if (c != '\\')
+			{
+				out += c;
+				continue;
+			}
+
+			c = text[++i];
+			switch (c)
+			{
+				case 'b': out += '\b'; break;
+				case 'f': out += '\f'; break;
+				case 'n': out += '\n'; break;
+				case 'r': out += '\r'; break;
+				case 't': out += '\t'; break;
+				case 'u':
+				{
+					unsigned cp = hex_value(text.substr(i + 1, 4));
+					i += 4;
+					// 代理对
+					if (cp >= 0xD800 && cp < 0xDC00 && i + 6 < text.size() && text[i + 1] == '\\' && text[i + 2] == 'u')
+					{
+						unsigned low = hex_value(text.substr(i + 3, 4));
+						if (low >= 0xDC00 && low < 0xE000)
+						{
+							cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+							i += 6;
+						}
+					}
+					append_utf8(out, cp);
+					break;
+				}
+				default: out += c; break;
+			}
+		}
+		return out;
+	}
+};
+
+/*
+ * json_reader 按顺序读出一个 JSON 对象最外层的 "key": value, 一次一个, 像 SAX 那样由调用者挑自己要的 key.
+ * 不建树, 不分配内存, 不抛异常. key 和 value 都指向原文.
+ *
+ *	json_reader reader(response_data(buffer, size));
+ *	while (reader.next(key, value))
+ *		if (key == "text") ...
+ *	if (reader.failed()) ...
+ *
+ * 最外层的格式 (括号, 逗号, 字符串的转义, 数字, true/false/null) 都会检查, 后面不能跟别的东西,
+ * 嵌套的 object 和 array 整个跳过, 只检查括号和里面的字符串.
+ * key 不展开转义, 要找的 key 都是普通的 ASCII.
+ */
+class json_reader
+{
+public:
+	explicit json_reader(boost::string_ref text)
+		: m_text(text), m_pos(0), m_state(state_start)
+	{
+	}
+
+	// 读下一对 key/value. 对象读完了或者格式不对返回 false, 用 failed() 区分.
+	bool next(boost::string_ref & key, json_value & value)
+	{
+		if (m_state == state_done || m_state == state_failed)
+			return false;
+
+		skip_space();
+
+		if (m_state == state_start)
+		{
+			if (!consume('{'))
+				return fail();
+			skip_space();
+			if (consume('}'))
+				return finish();
+			m_state = state_member;
+		}
+		else
+		{
+			// 上一个成员后面只能是 , 或者 }
+			if (consume('}'))
+				return finish();
+			if (!consume(','))
+				return fail();
+			skip_space();
+		}
+
+		if (!parse_string(key))
+			return fail();
+		skip_space();
+		if (!consume(':'))
+			return fail();
+		skip_space();
+		if (!parse_value(value))
+			return fail();
+		return true;
+	}
+
+	bool failed() const
+	{
+		return m_state == state_failed;
+	}
+
+private:
+	bool fail()
+	{
+		m_state = state_failed;
+		return false;
+	}
+
+	bool finish()
+	{
+		skip_space();
+		if (m_pos != m_text.size())
+			return fail();
+		m_state = state_done;
+		return false;
+	}
+
+	bool consume(char c)
+	{
+		if (m_pos < m_text.size() && m_text[m_pos] == c)
+		{
+			m_pos++;
+			return true;
+		}
+		return false;
+	}
+
+	void skip_space()
+	{
+		while (m_pos < m_text.size() &&
+			(m_text[m_pos] == ' ' || m_text[m_pos] == '\t' || m_text[m_pos] == '\n' || m_text[m_pos] == '\r'))
+			m_pos++;
+	}
+
+	static bool is_hex(char c)
+	{
+		return is_ascii_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+	}
+
+	// "..." , out 是引号里面的部分.
+	bool parse_string(boost::string_ref & out)
+	{
+		if (!consume('"'))
+			return false;
+
+		std::size_t begin = m_pos;
+		while (m_pos < m_text.size())
+		{
+			char c = m_text[m_pos];
+			if (c == '"')
+			{
+				out = m_text.substr(begin, m_pos - begin);
+				m_pos++;
+				return true;
+			}
+			if (static_cast<unsigned char>(c) < 0x20)
+				return false;
+			if (c == '\\')
+			{
+				if (++m_pos == m_text.size())
+					return false;
+				c = m_text[m_pos];
+				if (c == 'u')
+				{
+					if (m_text.size() - m_pos <= 4)
+						return false;
+					for (int i = 1; i <= 4; i++)
+						if (!is_hex(m_text[m_pos + i]))
+							return false;
+					m_pos += 4;
+				}
+				else if (c != '"' && c != '\\' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't')
+				{
+					return false;
+				}
+			}
+			m_pos++;
+		}
+		return false;
+	}
+
+	bool parse_literal(boost::string_ref word, json_value::kind_type kind, json_value & out)
+	{
+		if (!m_text.substr(m_pos).starts_with(word))
+			return false;
+		out.kind = kind;
+		out.raw = m_text.substr(m_pos, word.size());
+		m_pos += word.size();
+		return true;
+	}
+
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	bool parse_number(json_value & out)
+	{
+		std::size_t begin = m_pos;
+
+		consume('-');
+		if (!consume('0'))
+		{
+			if (scan_digits() == 0)
+				return false;
+		}
+		if (consume('.') && scan_digits() == 0)
+			return false;
+		if (consume('e') || consume('E'))
+		{
+			if (!consume('+'))
+				consume('-');
+			if (scan_digits() == 0)
+				return false;
+		}
+
+		out.kind = json_value::number_value;
+		out.raw = m_text.substr(begin, m_pos - begin);
+		return true;
+	}
+
+	std::size_t scan_digits()
+	{
+		std::size_t n = scan_span(m_text.substr(m_pos), is_ascii_digit).size();
+		m_pos += n;
+		return n;
+	}
+
+	// 嵌套的 object/array, 找到配对的括号整个跳过.
+	bool skip_nested(json_value & out)
+	{
+		std::size_t begin = m_pos;
+		std::size_t depth = 0;
+		boost::string_ref ignored;
+
+		while (m_pos < m_text.size())
+		{
+			char c = m_text[m_pos];
+			if (c == '"')
+			{
+				if (!parse_string(ignored))
+					return false;
+				continue;
+			}
+
+			m_pos++;
+			if (c == '{' || c == '[')
+			{
+				depth++;
+			}
+			else if (c == '}' || c == ']')
+			{
+				if (--depth == 0)
+				{
+					out.kind = m_text[begin] == '{' ? json_value::object_value : json_value::array_value;
+					out.raw = m_text.substr(begin, m_pos - begin);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	bool parse_value(json_value & out)
+	{
+		if (m_pos == m_text.size())
+			return false;
+
+		switch (m_text[m_pos])
+		{
+			case '"':
+				out.kind = json_value::string_value;
+				return parse_string(out.raw);
+			case '{':
+			case '[':
+				return skip_nested(out);
+			case 't':
+				return parse_literal("true", json_value::bool_value, out);
+			case 'f':
+				return parse_literal("false", json_value::bool_value, out);
+			case 'n':
+				return parse_literal("null", json_value::null_value, out);
+			default:
+				return parse_number(out);
+		}
+	}
+
+private:
+	boost::string_ref m_text;
+	std::size_t m_pos;
+	enum { state_start, state_member, state_done, state_failed } m_state;
+};
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <list>
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace decaptcha{
+
+// 验证码图片的 hash, 用 FNV-1a 64, 并且把长度也混进去.
+inline boost::uint64_t image_hash(const std::string & buffer)
+{
+	boost::uint64_t h = 14695981039346656037ULL;
+	const unsigned char * p = reinterpret_cast<const unsigned char*>(buffer.data());
+
+	for (std::size_t i = 0; i < buffer.length(); i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+
+	h ^= buffer.length();
+	h *= 1099511628211ULL;
+	return h;
+}
+
+namespace detail{
+
+// 同一个识别结果的 reportbad 只能调用一次, 不管是从缓存里拿到的还是直接识别的.
+// 缓存命中的调用者在不同的线程里拿到的是同一个, 可能同时调用, 所以取出来的时候加锁.
+class shared_reportbad{
+	struct impl : boost::noncopyable{
+		boost::asio::detail::mutex mutex;
+		boost::function<void()> reportbad;
+	};
+
+public:
+	shared_reportbad()
+		: m_impl(boost::make_shared<impl>())
+	{
+	}
+
+	explicit shared_reportbad(const boost::function<void()> & reportbad)
+		: m_impl(boost::make_shared<impl>())
+	{
+		m_impl->reportbad = reportbad;
+	}
+
+	void operator()() const
+	{
+		boost::function<void()> reportbad;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_impl->mutex);
+			reportbad.swap(m_impl->reportbad);
+		}
+		if (reportbad)
+			reportbad();
+	}
+
+private:
+	boost::shared_ptr<impl> m_impl;
+};
+
+/*
+ * 以图片 hash 为 key 的 LRU 缓存.
+ *
+ * 被 reportbad 的结果会从缓存中删除, 并在 negative_ttl 时间内记住这个错误的结果,
+ * 期间同一张图片再识别出同样的结果也不会放进缓存.
+ * 本身不加锁, 由 result_cache 分片加锁.
+ */
+class result_cache_shard : boost::noncopyable{
+	struct entry{
+		boost::uint64_t hash;
+		std::string provider;
+		std::string result;
+		detail::shared_reportbad reportbad;
+	};
+
+	struct negative_entry{
+		std::string result;
+		boost::posix_time::ptime expires;
+	};
+
+	typedef std::list<entry> lru_list;
+	typedef boost::unordered_map<boost::uint64_t, lru_list::iterator> index_map;
+	typedef boost::unordered_map<boost::uint64_t, negative_entry> negative_map;
+
+public:
+	explicit result_cache_shard(std::size_t capacity = 1024,
+		boost::posix_time::time_duration negative_ttl = boost::posix_time::minutes(10))
+		: m_capacity(capacity), m_negative_ttl(negative_ttl)
+	{
+	}
+
+	void set_capacity(std::size_t capacity)
+	{
+		m_capacity = capacity;
+		shrink();
+	}
+
+	// 命中的话返回 true, 并且把条目移动到最前面.
+	bool lookup(boost::uint64_t hash, std::string & provider, std::string & result,
+		detail::shared_reportbad & reportbad)
+	{
+		index_map::iterator it = m_index.find(hash);
+		if (it == m_index.end())
+			return false;
+
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		provider = it->second->provider;
+		result = it->second->result;
+		reportbad = it->second->reportbad;
+		return true;
+	}
+
+	// 插入识别结果, 返回缓存命中的时候和这次共用的 reportbad.
+	detail::shared_reportbad insert(boost::uint64_t hash, const std::string & provider,
+		const std::string & result, const boost::function<void()> & reportbad)
+	{
+		detail::shared_reportbad once(reportbad);
+
+		if (m_capacity == 0 || is_known_bad(hash, result))
+			return once;
+
+		index_map::iterator it = m_index.find(hash);
+		if (it != m_index.end())
+		{
+			m_lru.erase(it->second);
+			m_index.erase(it);
+		}
+
+		entry e;
+		e.hash = hash;
+		e.provider = provider;
+		e.result = result;
+		e.reportbad = once;
+		m_lru.push_front(e);
+		m_index[hash] = m_lru.begin();
+		shrink();
+
+		return once;
+	}
+
+	// result 被报告是错误的.
+	void report_bad(boost::uint64_t hash, const std::string & result)
+	{
+		index_map::iterator it = m_index.find(hash);
+		if (it != m_index.end() && boost::algorithm::iequals(it->second->result, result))
+		{
+			m_lru.erase(it->second);
+			m_index.erase(it);
+		}
+
+		negative_entry & n = m_negative[hash];
+		n.result = result;
+		n.expires = boost::posix_time::microsec_clock::universal_time() + m_negative_ttl;
+	}
+
+	std::size_t size() const
+	{
+		return m_lru.size();
+	}
+
+private:
+	bool is_known_bad(boost::uint64_t hash, const std::string & result)
+	{
+		negative_map::iterator it = m_negative.find(hash);
+		if (it == m_negative.end())
+			return false;
+
+		if (it->second.expires < boost::posix_time::microsec_clock::universal_time())
+		{
+			m_negative.erase(it);
+			return false;
+		}
+		return boost::algorithm::iequals(it->second.result, result);
+	}
+
+	void shrink()
+	{
+		while (m_lru.size() > m_capacity)
+		{
+			m_index.erase(m_lru.back().hash);
+			m_lru.pop_back();
+		}
+
+		// 过期的 negative 条目顺便清理掉, 免得无限增长.
+		if (m_negative.size() > m_capacity)
+		{
+			boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+			for (negative_map::iterator it = m_negative.begin(); it != m_negative.end(); )
+			{
+				if (it->second.expires < now)
+					it = m_negative.erase(it);
+				else
+					++it;
+			}
+		}
+	}
+
+private:
+	std::size_t m_capacity;
+	boost::posix_time::time_duration m_negative_ttl;
+
+	lru_list m_lru;
+	index_map m_index;
+	negative_map m_negative;
+};
+
+} // namespace detail
+
+/*
+ * result_cache 是一个以图片 hash 为 key 的 LRU 缓存, 可以在多个线程里同时使用.
+ *
+ * 按 hash 分成 shard_count 片, 每片有自己的锁和自己的 LRU, 容量平均分配,
+ * 不同图片的查找和插入基本不会抢同一把锁. 淘汰是按片进行的, 整体上近似 LRU.
+ *
+ * 被 reportbad 的结果会从缓存中删除, 并在 negative_ttl 时间内记住这个错误的结果,
+ * 期间同一张图片再识别出同样的结果也不会放进缓存.
+ */
+class result_cache : boost::noncopyable{
+public:
+	enum { shard_count = 16 };
+
+	explicit result_cache(std::size_t capacity = 1024,
+		boost::posix_time::time_duration negative_ttl = boost::posix_time::minutes(10))
+	{
+		for (int i = 0; i < shard_count; i++)
+			m_shards[i].cache = boost::make_shared<detail::result_cache_shard>(shard_capacity(capacity), negative_ttl);
+	}
+
+	void set_capacity(std::size_t capacity)
+	{
+		for (int i = 0; i < shard_count; i++)
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_shards[i].mutex);
+			m_shards[i].cache->set_capacity(shard_capacity(capacity));
+		}
+	}
+
+	// 命中的话返回 true, 并且把条目移动到最前面.
+	bool lookup(boost::uint64_t hash, std::string & provider, std::string & result,
+		detail::shared_reportbad & reportbad)
+	{
+		shard & s = shard_of(hash);
+		boost::asio::detail::mutex::scoped_lock l(s.mutex);
+		return s.cache->lookup(hash, provider, result, reportbad);
+	}
+
+	// 插入识别结果, 返回缓存命中的时候和这次共用的 reportbad.
+	detail::shared_reportbad insert(boost::uint64_t hash, const std::string & provider,
+		const std::string & result, const boost::function<void()> & reportbad)
+	{
+		shard & s = shard_of(hash);
+		boost::asio::detail::mutex::scoped_lock l(s.mutex);
+		return s.cache->insert(hash, provider, result, reportbad);
+	}
+
+	// result 被报告是错误的.
+	void report_bad(boost::uint64_t hash, const std::string & result)
+	{
+		shard & s = shard_of(hash);
+		boost::asio::detail::mutex::scoped_lock l(s.mutex);
+		s.cache->report_bad(hash, result);
+	}
+
+	std::size_t size() const
+	{
+		std::size_t size = 0;
+		for (int i = 0; i < shard_count; i++)
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_shards[i].mutex);
+			size += m_shards[i].cache->size();
+		}
+		return size;
+	}
+
+private:
+	struct shard{
+		mutable boost::asio::detail::mutex mutex;
+		boost::shared_ptr<detail::result_cache_shard> cache;
+	};
+
+	static std::size_t shard_capacity(std::size_t capacity)
+	{
+		return (capacity + shard_count - 1) / shard_count;
+	}
+
+	// FNV 的低位混得不够好, 用高位选分片.
+	shard & shard_of(boost::uint64_t hash)
+	{
+		return m_shards[(hash >> 60) % shard_count];
+	}
+
+private:
+	shard m_shards[shard_count];
+};
+
+namespace detail{
+
+// 交给 handler 的 reportbad, 先把结果从缓存中踢掉, 再向服务商报告.
+struct cache_reportbad_op{
+	cache_reportbad_op(boost::weak_ptr<result_cache> cache, boost::uint64_t hash,
+		const std::string & result, const shared_reportbad & reportbad)
+		: m_state(boost::make_shared<const state>(cache, hash, result, reportbad))
+	{
+	}
+
+	void operator()() const
+	{
+		if (boost::shared_ptr<result_cache> cache = m_state->cache.lock())
+			cache->report_bad(m_state->hash, m_state->result);
+		m_state->reportbad();
+	}
+
+private:
+	// 一路拷贝给调用者的只有这个指针, 放得进 boost::function 自带的缓冲区.
+	struct state{
+		state(boost::weak_ptr<result_cache> _cache, boost::uint64_t _hash,
+			const std::string & _result, const shared_reportbad & _reportbad)
+			: cache(_cache), hash(_hash), result(_result), reportbad(_reportbad)
+		{
+		}
+
+		boost::weak_ptr<result_cache> cache;
+		boost::uint64_t hash;
+		std::string result;
+		shared_reportbad reportbad;
+	};
+
+	boost::shared_ptr<const state> m_state;
+};
+
+} // namespace detail
+
+} // namespace decaptcha
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "decaptcha.hpp"
+
+namespace decaptcha{
+
+// sharded_deCAPTCHA::stats 返回的所有分片的汇总.
+struct sharded_stats{
+	sharded_stats()
+		: shards(0), submitted(0), succeeded(0), failed(0), pending(0)
+	{
+	}
+
+	std::size_t shards;
+	boost::uint64_t submitted, succeeded, failed, pending;
+	// 从提交到识别完成的耗时, 所有分片最近的样本合在一起算. 样本不够是 not_a_date_time.
+	boost::posix_time::time_duration latency_p50, latency_p90;
+};
+
+namespace detail{
+
+// 一个分片: 自己的线程, 自己的 io_service, 上面跑一个 deCAPTCHA.
+struct decaptcha_shard : boost::enable_shared_from_this<decaptcha_shard>, boost::noncopyable{
+	decaptcha_shard()
+		: work(new boost::asio::io_service::work(io_service)), decaptcha(io_service),
+		  submitted(0), succeeded(0), failed(0)
+	{
+	}
+
+	void start(std::size_t cpu)
+	{
+		thread = boost::thread(boost::bind(&decaptcha_shard::run, this, cpu));
+	}
+
+	// 等已经提交的识别都结束才停下来的话可能要等好几分钟, 所以直接停.
+	void stop()
+	{
+		work.reset();
+		io_service.stop();
+		if (thread.joinable())
+			thread.join();
+	}
+
+	void run(std::size_t cpu)
+	{
+#if defined(__linux__)
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+		io_service.run();
+	}
+
+	boost::asio::io_service io_service;
+	boost::scoped_ptr<boost::asio::io_service::work> work;
+	deCAPTCHA decaptcha;
+	boost::thread thread;
+
+	boost::atomic<boost::uint64_t> submitted, succeeded, failed;
+	decoder_stats latency;
+};
+
+/*
+ * 在分片的线程里调用 reportbad.
+ * 调用者可能在 sharded_deCAPTCHA 析构之后才调用, 所以只持有分片的 weak_ptr, 分片已经没了就不报告.
+ */
+struct shard_reportbad_op{
+	shard_reportbad_op(boost::weak_ptr<decaptcha_shard> shard, const boost::function<void()> & reportbad)
+		: m_shard(shard), m_reportbad(reportbad)
+	{
+	}
+
+	void operator()() const
+	{
+		boost::shared_ptr<decaptcha_shard> shard = m_shard.lock();
+		if (shard)
+			shard->io_service.post(m_reportbad);
+	}
+
+	boost::weak_ptr<decaptcha_shard> m_shard;
+	boost::function<void()> m_reportbad;
+};
+
+// 分片识别完成, 记下统计, 再把结果送回调用者的 io_service.
+template<class Handler>
+struct shard_completion_op{
+	shard_completion_op(boost::asio::io_service & io_service, decaptcha_shard & shard, Handler handler)
+		: m_io_service(io_service), m_shard(shard), m_handler(handler),
+		  m_start(boost::posix_time::microsec_clock::universal_time())
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
+	{
+		if (ec)
+		{
+			m_shard.failed.fetch_add(1, boost::memory_order_relaxed);
+		}
+		else
+		{
+			m_shard.succeeded.fetch_add(1, boost::memory_order_relaxed);
+			m_shard.latency.record_latency(boost::posix_time::microsec_clock::universal_time() - m_start);
+		}
+
+		if (reportbad)
+			reportbad = shard_reportbad_op(m_shard.shared_from_this(), reportbad);
+
+		m_io_service.post(
+			boost::asio::detail::bind_handler(m_handler, ec, provider, result, reportbad)
+		);
+	}
+
+	boost::asio::io_service & m_io_service;
+	decaptcha_shard & m_shard;
+	Handler m_handler;
+	boost::posix_time::ptime m_start;
+};
+
+// 在分片的线程里提交, 检查图片, 查缓存和预处理这些计算都不占调用者的线程.
+template<class Handler>
+struct shard_submit_op{
+	shard_submit_op(decaptcha_shard & shard, const std::string & buffer,
+			const cancel_token & cancel, const shard_completion_op<Handler> & completion)
+		: m_shard(shard), m_buffer(buffer), m_cancel(cancel), m_completion(completion)
+	{
+	}
+
+	void operator()()
+	{
+		m_shard.decaptcha.async_decaptcha(m_buffer, m_cancel, m_completion);
+	}
+
+	decaptcha_shard & m_shard;
+	std::string m_buffer;
+	cancel_token m_cancel;
+	shard_completion_op<Handler> m_completion;
+};
+
+} // namespace detail
+
+// 验证码分配到哪个分片.
+enum shard_routing{
+	// 按图片的 hash, 同一张图片总是在同一个分片, 缓存和合并识别都能生效.
+	// 选分片的 hash 要在调用者的线程里算, 图片大的话用 route_round_robin 更省调用者的时间.
+	route_by_hash,
+	// 轮流分配, 负载最平均.
+	route_round_robin,
+};
+
+/*
+ * sharded_deCAPTCHA 开 N 个互不相干的 deCAPTCHA, 每个有自己的线程和 io_service,
+ * 所以连接池, 时间轮, 结果缓存这些也都是各自一份, 线程之间没有争用.
+ * 一个 io_service 多个线程 run 的方式, 线程一多就会卡在 reactor 的锁上, 这个可以按核数扩展.
+ *
+ * 解码器绑定在 io_service 上, 所以每个分片要用自己的 io_service 构造自己的解码器,
+ * 由 setup 负责, 每个分片调用一次:
+ *
+ * void setup(boost::asio::io_service & io_service, deCAPTCHA & decaptcha)
+ * {
+ * 		decaptcha.add_decoder(decoder::antigate_decoder(io_service, key, host));
+ * }
+ *
+ * handler 的签名和 deCAPTCHA::async_decaptcha 一样, 在构造时传入的 io_service 里调用.
+ * 拿到的 reportbad 可以在任何线程调用, 会转到分片的线程里执行, sharded_deCAPTCHA 析构以后调用不做任何事.
+ */
+class sharded_deCAPTCHA : boost::noncopyable{
+public:
+	typedef boost::function<void (boost::asio::io_service &, deCAPTCHA &)> setup_function;
+
+	// shards 为 0 的时候使用 CPU 核数.
+	sharded_deCAPTCHA(boost::asio::io_service & io_service, const setup_function & setup,
+			std::size_t shards = 0, shard_routing routing = route_by_hash)
+		: m_io_service(io_service), m_routing(routing), m_next(0)
+	{
+		if (shards == 0)
+			shards = (std::max)(boost::thread::hardware_concurrency(), 1u);
+
+		std::size_t cpus = (std::max)(boost::thread::hardware_concurrency(), 1u);
+		for (std::size_t i = 0; i < shards; i++)
+		{
+			boost::shared_ptr<detail::decaptcha_shard> shard = boost::make_shared<detail::decaptcha_shard>();
+			setup(shard->io_service, shard->decaptcha);
+			m_shards.push_back(shard);
+		}
+
+		// 线程在 setup 全部完成之后才启动, setup 里不用担心线程安全.
+		for (std::size_t i = 0; i < m_shards.size(); i++)
+			m_shards[i]->start(i % cpus);
+	}
+
+	// 还没完成的识别直接丢弃, handler 不会被调用.
+	~sharded_deCAPTCHA()
+	{
+		for (std::size_t i = 0; i < m_shards.size(); i++)
+			m_shards[i]->stop();
+	}
+
+	std::size_t shard_count() const
+	{
+		return m_shards.size();
+	}
+
+	template<class Handler>
+	void async_decaptcha(const std::string & buf, Handler handler)
+	{
+		async_decaptcha(buf, cancel_token(), handler);
+	}
+
+	// cancel 可以在任何线程取消.
+	template<class Handler>
+	void async_decaptcha(const std::string & buf, const cancel_token & cancel, Handler handler)
+	{
+		detail::decaptcha_shard & shard = pick_shard(buf);
+		shard.submitted.fetch_add(1, boost::memory_order_relaxed);
+		shard.io_service.post(
+			detail::shard_submit_op<Handler>(shard, buf, cancel,
+				detail::shard_completion_op<Handler>(m_io_service, shard, handler))
+		);
+	}
+
+	// 汇总所有分片的统计, 任何线程都可以调用.
+	sharded_stats stats() const
+	{
+		sharded_stats s;
+		std::vector<boost::int64_t> samples;
+
+		s.shards = m_shards.size();
+		for (std::size_t i = 0; i < m_shards.size(); i++)
+		{
+			const detail::decaptcha_shard & shard = *m_shards[i];
+			boost::uint64_t submitted = shard.submitted.load(boost::memory_order_relaxed);
+			boost::uint64_t succeeded = shard.succeeded.load(boost::memory_order_relaxed);
+			boost::uint64_t failed = shard.failed.load(boost::memory_order_relaxed);
+
+			s.submitted += submitted;
+			s.succeeded += succeeded;
+			s.failed += failed;
+			// 计数器各自读的, 读的过程中正好有完成的话可能对不上.
+			if (submitted > succeeded + failed)
+				s.pending += submitted - succeeded - failed;
+			shard.latency.copy_samples(samples);
+		}
+
+		s.latency_p50 = decoder_stats::percentile_of(samples, 0.5);
+		s.latency_p90 = decoder_stats::percentile_of(samples, 0.9);
+		return s;
+	}
+
+private:
+	detail::decaptcha_shard & pick_shard(const std::string & buf)
+	{
+		std::size_t n;
+		if (m_routing == route_by_hash)
+			n = static_cast<std::size_t>(image_hash(buf) % m_shards.size());
+		else
+			n = m_next.fetch_add(1, boost::memory_order_relaxed) % m_shards.size();
+		return *m_shards[n];
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	std::vector<boost::shared_ptr<detail::decaptcha_shard> > m_shards;
+	shard_routing m_routing;
+	boost::atomic<std::size_t> m_next;
+};
+
+} // namespace decaptcha
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <map>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "cancel_token.hpp"
+
+namespace decaptcha{
+namespace detail{
+
+class flight_table;
+
+/*
+ * flight 表示一张图片正在进行的一次识别.
+ *
+ * 同一张图片的所有 async_decaptcha 调用都挂在同一个 flight 上, 共享识别结果.
+ * 单个等待者取消的时候只有它自己的 handler 收到 operation_aborted,
+ * 最后一个等待者也取消了, 才真正取消这次识别.
+ *
+ * attach, complete 和取消都可能来自不同的线程, 由 m_mutex 保护.
+ * 已经结束的 flight 不能再挂新的等待者, attach 返回 false.
+ */
+class flight : boost::noncopyable, public boost::enable_shared_from_this<flight>{
+public:
+	typedef boost::function<
+			void (boost::system::error_code ec, std::string provider, std::string result, boost::function<void()>)
+		> handler_type;
+
+	flight(boost::asio::io_service & io_service, boost::weak_ptr<flight_table> table,
+		boost::uint64_t hash, const cancel_token & solve)
+		: m_io_service(io_service), m_table(table), m_hash(hash), m_solve(solve),
+		  m_next_waiter(0), m_done(false)
+	{
+	}
+
+	bool attach(const handler_type & handler, const cancel_token & cancel)
+	{
+		std::size_t id;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			if (m_done)
+				return false;
+
+			id = m_next_waiter ++;
+			m_waiters[id] = handler;
+		}
+
+		// 已经取消了的话会立即回调 detach, 不能拿着锁.
+		boost::weak_ptr<flight> self(shared_from_this());
+		cancel.on_cancel(
+			boost::function<void()>(boost::bind(&flight::detach_waiter, self, id)),
+			self
+		);
+		return true;
+	}
+
+	// 识别结束, 把结果交给每一个等待者.
+	void complete(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
+	{
+		std::map<std::size_t, handler_type> waiters;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			if (m_done)
+				return;
+
+			m_done = true;
+			waiters.swap(m_waiters);
+		}
+		remove_from_table();
+
+		for (std::map<std::size_t, handler_type>::iterator it = waiters.begin(); it != waiters.end(); ++it)
+		{
+			m_io_service.post(
+				boost::asio::detail::bind_handler(it->second, ec, provider, result, reportbad)
+			);
+		}
+	}
+
+private:
+	static void detach_waiter(boost::weak_ptr<flight> weak_self, std::size_t id)
+	{
+		if (boost::shared_ptr<flight> self = weak_self.lock())
+			self->detach(id);
+	}
+
+	void detach(std::size_t id)
+	{
+		handler_type handler;
+		bool abandoned;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			std::map<std::size_t, handler_type>::iterator it = m_waiters.find(id);
+			if (m_done || it == m_waiters.end())
+				return;
+
+			handler.swap(it->second);
+			m_waiters.erase(it);
+
+			// 没人要了, 取消识别. 新的调用者不能再挂到这个 flight 上.
+			abandoned = m_waiters.empty();
+			if (abandoned)
+				m_done = true;
+		}
+
+		m_io_service.post(
+			boost::asio::detail::bind_handler(handler,
+				boost::system::error_code(boost::asio::error::operation_aborted),
+				std::string("deCAPTCHA"), std::string(), boost::function<void()>())
+		);
+
+		if (abandoned)
+		{
+			remove_from_table();
+			m_solve.cancel();
+		}
+	}
+
+	void remove_from_table();
+
+private:
+	boost::asio::io_service & m_io_service;
+	boost::weak_ptr<flight_table> m_table;
+	const boost::uint64_t m_hash;
+	cancel_token m_solve;
+
+	boost::asio::detail::mutex m_mutex;
+	std::map<std::size_t, handler_type> m_waiters;
+	std::size_t m_next_waiter;
+	bool m_done;
+};
+
+// 正在识别的图片, 以图片 hash 为 key.
+class flight_table : boost::noncopyable{
+public:
+	boost::shared_ptr<flight> find(boost::uint64_t hash) const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		table_type::const_iterator it = m_flights.find(hash);
+		if (it == m_flights.end())
+			return boost::shared_ptr<flight>();
+		return it->second;
+	}
+
+	// 已经有了的话不插入, 返回表里的那个.
+	boost::shared_ptr<flight> insert(boost::uint64_t hash, boost::shared_ptr<flight> f)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<flight> & slot = m_flights[hash];
+		if (!slot)
+			slot = f;
+		return slot;
+	}
+
+	void erase(boost::uint64_t hash, const flight * f)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		table_type::iterator it = m_flights.find(hash);
+		if (it != m_flights.end() && it->second.get() == f)
+			m_flights.erase(it);
+	}
+
+	std::size_t size() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_flights.size();
+	}
+
+private:
+	typedef boost::unordered_map<boost::uint64_t, boost::shared_ptr<flight> > table_type;
+	mutable boost::asio::detail::mutex m_mutex;
+	table_type m_flights;
+};
+
+inline void flight::remove_from_table()
+{
+	if (boost::shared_ptr<flight_table> table = m_table.lock())
+		table->erase(m_hash, this);
+}
+
+// 识别操作的 handler, 把结果转交给 flight.
+class flight_handler{
+public:
+	explicit flight_handler(boost::shared_ptr<flight> f)
+		: m_flight(f)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad) const
+	{
+		m_flight->complete(ec, provider, result, reportbad);
+	}
+
+private:
+	boost::shared_ptr<flight> m_flight;
+};
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/detail/mutex.hpp>
+
+namespace decaptcha{
+namespace detail{
+
+// 清空 streambuf 里的数据, 已经分配的内存留着下次用.
+inline void reset_streambuf(boost::asio::streambuf & buffer)
+{
+	buffer.consume(buffer.size());
+}
+
+class streambuf_pool_impl
+	: boost::noncopyable, public boost::enable_shared_from_this<streambuf_pool_impl>
+{
+	// 借出去的 streambuf 被释放的时候, 还回池子.
+	struct give_back_op{
+		boost::weak_ptr<streambuf_pool_impl> pool;
+
+		void operator()(boost::asio::streambuf * buffer)
+		{
+			if (boost::shared_ptr<streambuf_pool_impl> p = pool.lock())
+				p->give_back(buffer);
+			else
+				delete buffer;
+		}
+	};
+
+public:
+	streambuf_pool_impl()
+		: m_max_idle(256), m_max_capacity(64 * 1024), m_shutdown(false)
+	{
+	}
+
+	~streambuf_pool_impl()
+	{
+		for (std::size_t i = 0; i < m_idle.size(); i++)
+			delete m_idle[i];
+	}
+
+	boost::shared_ptr<boost::asio::streambuf> acquire()
+	{
+		boost::asio::streambuf * buffer = 0;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			if (!m_idle.empty())
+			{
+				buffer = m_idle.back();
+				m_idle.pop_back();
+			}
+		}
+
+		if (!buffer)
+			buffer = new boost::asio::streambuf;
+
+		give_back_op op;
+		op.pool = shared_from_this();
+		return boost::shared_ptr<boost::asio::streambuf>(buffer, op);
+	}
+
+	void set_max_idle(std::size_t max_idle)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		m_max_idle = max_idle;
+	}
+
+	std::size_t idle_count() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_idle.size();
+	}
+
+	void shutdown()
+	{
+		std::vector<boost::asio::streambuf *> idle;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			m_shutdown = true;
+			idle.swap(m_idle);
+		}
+
+		for (std::size_t i = 0; i < idle.size(); i++)
+			delete idle[i];
+	}
+
+private:
+	// 借出去的 streambuf 可能在任意线程释放.
+	void give_back(boost::asio::streambuf * buffer)
+	{
+		reset_streambuf(*buffer);
+
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			// 收过大响应的不留, 免得一直占着内存.
+			if (!m_shutdown && m_idle.size() < m_max_idle && buffer->capacity() <= m_max_capacity)
+			{
+				m_idle.push_back(buffer);
+				return;
+			}
+		}
+
+		delete buffer;
+	}
+
+private:
+	mutable boost::asio::detail::mutex m_mutex;
+	std::vector<boost::asio::streambuf *> m_idle;
+
+	std::size_t m_max_idle;
+	const std::size_t m_max_capacity;
+	bool m_shutdown;
+};
+
+} // namespace detail
+
+/*
+ * streambuf_pool 保存用过的 streambuf, 每个 io_service 一个, 所有解码器共用.
+ *
+ * op 开始的时候借一个, 每次轮询之前 reset_streambuf 清空了接着用, 最后一个指针释放的时候自动还回来.
+ * 还回来的 streambuf 保留已经分配的内存, 稳定运行以后上传和轮询的响应都不用再分配内存.
+ * 最多保留 max_idle 个, 容量超过 64KB 的直接释放.
+ * 可以在多个线程里同时借还.
+ */
+class streambuf_pool
+	: public boost::asio::detail::service_base<streambuf_pool>
+{
+public:
+	explicit streambuf_pool(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<streambuf_pool>(io_service),
+		  m_impl(boost::make_shared<detail::streambuf_pool_impl>())
+	{
+	}
+
+	boost::shared_ptr<boost::asio::streambuf> acquire()
+	{
+		return m_impl->acquire();
+	}
+
+	void set_max_idle(std::size_t max_idle)
+	{
+		m_impl->set_max_idle(max_idle);
+	}
+
+	std::size_t idle_count() const
+	{
+		return m_impl->idle_count();
+	}
+
+private:
+	void shutdown_service()
+	{
+		m_impl->shutdown();
+	}
+
+private:
+	boost::shared_ptr<detail::streambuf_pool_impl> m_impl;
+};
+
+namespace detail{
+
+inline boost::shared_ptr<boost::asio::streambuf> acquire_streambuf(boost::asio::io_service & io_service)
+{
+	return boost::asio::use_service<streambuf_pool>(io_service).acquire();
+}
+
+} // namespace detail
+} // namespace decaptcha
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <cstddef>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/future.hpp>
+
+#include "decaptcha.hpp"
+
+namespace decaptcha{
+
+// submission_queue::submit 返回的 future 里的结果.
+struct decaptcha_result{
+	boost::system::error_code ec;
+	std::string provider;
+	std::string result;
+	// 识别错误的时候调用, 可以在任何线程调用.
+	boost::function<void()> reportbad;
+};
+
+namespace detail{
+
+/*
+ * 有界的无锁队列, 多个线程 push, 一个线程 pop.
+ *
+ * 每个格子带一个序号: 序号等于写位置说明格子空着可以写, 等于写位置 + 1 说明写好了可以读.
+ * 写的线程用 CAS 抢写位置, 抢到了再填格子, 最后发布序号, 不需要锁.
+ */
+template<class T>
+class mpsc_ring : boost::noncopyable{
+	struct cell{
+		boost::atomic<std::size_t> sequence;
+		T value;
+	};
+
+public:
+	// capacity 向上取整到 2 的幂.
+	explicit mpsc_ring(std::size_t capacity)
+		: m_head(0), m_tail(0)
+	{
+		std::size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		m_mask = size - 1;
+		m_cells = new cell[size];
+		for (std::size_t i = 0; i < size; i++)
+			m_cells[i].sequence.store(i, boost::memory_order_relaxed);
+	}
+
+	~mpsc_ring()
+	{
+		delete [] m_cells;
+	}
+
+	std::size_t capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	// 满了返回 false.
+	bool push(const T & value)
+	{
+		std::size_t pos = m_tail.load(boost::memory_order_relaxed);
+		for (;;)
+		{
+			cell & c = m_cells[pos & m_mask];
+			std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(c.sequence.load(boost::memory_order_acquire) - pos);
+			if (diff == 0)
+			{
+				if (m_tail.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed))
+				{
+					c.value = value;
+					c.sequence.store(pos + 1, boost::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = m_tail.load(boost::memory_order_relaxed);
+			}
+		}
+	}
+
+	// 只能在一个线程里调用. 空的或者下一个还没写完返回 false.
+	bool pop(T & value)
+	{
+		cell & c = m_cells[m_head & m_mask];
+		if (c.sequence.load(boost::memory_order_acquire) != m_head + 1)
+			return false;
+
+		value = c.value;
+		c.value = T();
+		c.sequence.store(m_head + m_mask + 1, boost::memory_order_release);
+		m_head++;
+		return true;
+	}
+
+private:
+	cell * m_cells;
+	std::size_t m_mask;
+	// 只有读的线程用.
+	std::size_t m_head;
+	char m_pad[64];
+	boost::atomic<std::size_t> m_tail;
+};
+
+// 把结果写进 promise.
+struct promise_handler{
+	explicit promise_handler(boost::shared_ptr<boost::promise<decaptcha_result> > promise)
+		: m_promise(promise)
+	{
+	}
+
+	void operator()(boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad) const
+	{
+		decaptcha_result r;
+		r.ec = ec;
+		r.provider = provider;
+		r.result = result;
+		r.reportbad = reportbad;
+		m_promise->set_value(r);
+	}
+
+	boost::shared_ptr<boost::promise<decaptcha_result> > m_promise;
+};
+
+} // namespace detail
+
+/*
+ * submission_queue 让不是跑 io_service 的线程 (比如爬虫线程) 提交验证码.
+ *
+ * 提交只是把验证码放进一个有界的无锁队列, 不加锁也不分配 asio 的 handler.
+ * 队列从空变成非空的时候才 post 一次, io_service 的线程醒来一次取出一批
+ * (最多 batch_size 个) 交给 deCAPTCHA, 取完了再睡. 所以提交得越密, 每个验证码分摊的唤醒越少.
+ *
+ * 结果可以用回调拿 (在 io_service 的线程里调用, 回调自己要注意线程安全),
+ * 也可以用 future 拿. deCAPTCHA 和 io_service 要比 submission_queue 活得久.
+ */
+class submission_queue : boost::noncopyable{
+public:
+	typedef boost::function<
+			void (boost::system::error_code ec, std::string provider, std::string result, boost::function<void()> reportbad)
+		> callback_type;
+
+private:
+	struct job{
+		std::string buffer;
+		cancel_token cancel;
+		callback_type callback;
+	};
+
+	struct impl : boost::noncopyable{
+		impl(boost::asio::io_service & _io_service, deCAPTCHA & _decaptcha, std::size_t capacity, std::size_t _batch_size)
+			: io_service(_io_service), strand(_io_service), decaptcha(_decaptcha), queue(capacity),
+			  batch_size((std::max)(_batch_size, std::size_t(1))), scheduled(false)
+		{
+		}
+
+		boost::asio::io_service & io_service;
+		// io_service 有多个线程 run 的时候, 保证同一时间只有一个 drain 在取.
+		boost::asio::io_service::strand strand;
+		deCAPTCHA & decaptcha;
+		detail::mpsc_ring<job> queue;
+		const std::size_t batch_size;
+		// 已经 post 了 drain 还没开始取的时候, 新提交的不用再 post.
+		boost::atomic<bool> scheduled;
+	};
+
+public:
+	submission_queue(boost::asio::io_service & io_service, deCAPTCHA & decaptcha,
+			std::size_t capacity = 4096, std::size_t batch_size = 64)
+		: m_impl(boost::make_shared<impl>(boost::ref(io_service), boost::ref(decaptcha), capacity, batch_size))
+	{
+	}
+
+	std::size_t capacity() const
+	{
+		return m_impl->queue.capacity();
+	}
+
+	// 任何线程都可以调用. 队列满了返回 false, callback 不会被调用.
+	bool try_submit(const std::string & buffer, const callback_type & callback, const cancel_token & cancel = cancel_token())
+	{
+		job j;
+		j.buffer = buffer;
+		j.cancel = cancel;
+		j.callback = callback;
+		if (!m_impl->queue.push(j))
+			return false;
+
+		schedule(m_impl);
+		return true;
+	}
+
+	// 任何线程都可以调用. 队列满了 future 里直接是 boost::asio::error::no_buffer_space.
+	boost::unique_future<decaptcha_result> submit(const std::string & buffer, const cancel_token & cancel = cancel_token())
+	{
+		boost::shared_ptr<boost::promise<decaptcha_result> > promise = boost::make_shared<boost::promise<decaptcha_result> >();
+
+		if (!try_submit(buffer, detail::promise_handler(promise), cancel))
+		{
+			decaptcha_result r;
+			r.ec = boost::asio::error::no_buffer_space;
+			r.provider = "deCAPTCHA";
+			promise->set_value(r);
+		}
+
+		// 已经有结果了也可以 get_future. 直接返回临时对象, C++03 下 unique_future 不能拷贝, 也不能 move 一个具名变量.
+		return promise->get_future();
+	}
+
+private:
+	static void schedule(const boost::shared_ptr<impl> & i)
+	{
+		if (!i->scheduled.exchange(true, boost::memory_order_acq_rel))
+			i->strand.post(boost::bind(&submission_queue::drain, i));
+	}
+
+	static void drain(boost::shared_ptr<impl> i)
+	{
+		// 先清标志再取, 取的过程中新提交的会自己再 post 一次, 不会漏掉.
+		i->scheduled.store(false, boost::memory_order_release);
+
+		job j;
+		std::size_t n = 0;
+		while (n < i->batch_size && i->queue.pop(j))
+		{
+			i->decaptcha.async_decaptcha(j.buffer, j.cancel, j.callback);
+			n++;
+		}
+
+		// 一批取满了, 剩下的让别的 handler 先跑一下再接着取.
+		if (n == i->batch_size)
+			schedule(i);
+	}
+
+private:
+	boost::shared_ptr<impl> m_impl;
+};
+
+} // namespace decaptcha
@@ -0,0 +1,502 @@
+/*
+ * Copyright (C) 2013  微蔡 <microcai@fedoraproject.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/in_place_factory.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace decaptcha{
+namespace detail{
+
+class timer_wheel_impl;
+
+// 挂在时间轮上的一个定时器, 侵入式双向链表的节点.
+class wheel_entry : boost::noncopyable{
+public:
+	wheel_entry()
+		: m_prev(0), m_next(0), m_list(0), m_expiry(0)
+	{
+	}
+
+	virtual ~wheel_entry()
+	{
+	}
+
+	bool is_linked() const
+	{
+		return m_list != 0;
+	}
+
+	// 到期 (ec 为空) 或者被取消.
+	virtual void fire(const boost::system::error_code & ec) = 0;
+
+	// 时间轮关闭的时候调用, 只销毁 handler 不调用.
+	virtual void destroy() = 0;
+
+private:
+	friend class timer_wheel_impl;
+
+	wheel_entry * m_prev;
+	wheel_entry * m_next;
+	wheel_entry ** m_list;
+	boost::uint64_t m_expiry;
+};
+
+/*
+ * 分层时间轮.
+ *
+ * 4 层, 每层 64 个槽, 最底层一个槽是一个 tick. 插入和删除都是 O(1) 的链表操作, 不分配内存.
+ * 整个时间轮只用一个 deadline_timer, 有定时器挂着的时候每个 tick 醒来一次,
+ * 把到期的槽整个取下来一起处理. 上层的槽转到的时候, 把里面的定时器重新分到下层.
+ *
+ * 链表由 m_mutex 保护, 可以在多个线程里同时挂定时器. 到期的定时器先在锁里取下来,
+ * 出了锁再调用 handler, handler 里可以直接再挂上去.
+ */
+class timer_wheel_impl
+	: boost::noncopyable, public boost::enable_shared_from_this<timer_wheel_impl>
+{
+	enum { slot_bits = 6, slot_count = 1 << slot_bits, slot_mask = slot_count - 1, level_count = 4 };
+
+public:
+	explicit timer_wheel_impl(boost::asio::io_service & io_service)
+		: m_io_service(io_service), m_timer(io_service),
+		  m_tick(boost::posix_time::milliseconds(100)),
+		  m_start(boost::posix_time::microsec_clock::universal_time()),
+		  m_current(0), m_size(0), m_running(false), m_shutdown(false)
+	{
+		for (int level = 0; level < level_count; level++)
+			for (int slot = 0; slot < slot_count; slot++)
+				m_slots[level][slot] = 0;
+	}
+
+	boost::asio::io_service & get_io_service()
+	{
+		return m_io_service;
+	}
+
+	// 在 delay 之后触发 e, e 已经挂着的话先取下来.
+	void schedule(wheel_entry * e, boost::posix_time::time_duration delay)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+
+		if (e->is_linked())
+		{
+			unlink(e);
+			m_size --;
+		}
+
+		boost::uint64_t now = now_tick();
+		if (m_size == 0)
+			m_current = now;
+
+		boost::int64_t ticks = (delay.total_microseconds() + m_tick.total_microseconds() - 1) / m_tick.total_microseconds();
+		e->m_expiry = now + static_cast<boost::uint64_t>((std::max)(ticks, boost::int64_t(1)));
+
+		place(e);
+		m_size ++;
+
+		start();
+	}
+
+	// 挂着的话取下来并返回 true, 已经到期或者没有挂着返回 false.
+	bool remove(wheel_entry * e)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		if (!e->is_linked())
+			return false;
+
+		unlink(e);
+		m_size --;
+		return true;
+	}
+
+	std::size_t size() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_size;
+	}
+
+	boost::posix_time::time_duration resolution() const
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		return m_tick;
+	}
+
+	// 只能在没有定时器挂着的时候修改.
+	void set_resolution(boost::posix_time::time_duration tick)
+	{
+		boost::asio::detail::mutex::scoped_lock l(m_mutex);
+		if (m_size != 0 || tick <= boost::posix_time::time_duration())
+			return;
+
+		m_tick = tick;
+		m_start = boost::posix_time::microsec_clock::universal_time();
+		m_current = 0;
+	}
+
+	void shutdown()
+	{
+		std::vector<wheel_entry*> pending;
+		{
+			boost::asio::detail::mutex::scoped_lock l(m_mutex);
+			m_shutdown = true;
+
+			boost::system::error_code ignore_ec;
+			m_timer.cancel(ignore_ec);
+
+			for (int level = 0; level < level_count; level++)
+			{
+				for (int slot = 0; slot < slot_count; slot++)
+				{
+					while (wheel_entry * e = m_slots[level][slot])
+					{
+						unlink(e);
+						pending.push_back(e);
+					}
+				}
+			}
+			m_size = 0;
+		}
+
+		// 销毁 handler 的时候会析构 wheel_timer, 要重新拿锁.
+		for (std::size_t i = 0; i < pending.size(); i++)
+			pending[i]->destroy();
+	}
+
+private:
+	boost::uint64_t now_tick() const
+	{
+		boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - m_start;
+		return static_cast<boost::uint64_t>(elapsed.total_microseconds() / m_tick.total_microseconds());
+	}
+
+	static void link(wheel_entry ** list, wheel_entry * e)
+	{
+		e->m_list = list;
+		e->m_prev = 0;
+		e->m_next = *list;
+		if (*list)
+			(*list)->m_prev = e;
+		*list = e;
+	}
+
+	static void unlink(wheel_entry * e)
+	{
+		if (e->m_prev)
+			e->m_prev->m_next = e->m_next;
+		else
+			*e->m_list = e->m_next;
+		if (e->m_next)
+			e->m_next->m_prev = e->m_prev;
+
+		e->m_prev = e->m_next = 0;
+		e->m_list = 0;
+	}
+
+	// 按照离到期还有多少 tick 放到对应的层.
+	void place(wheel_entry * e)
+	{
+		// 转下来的时候正好到期的, 放到马上要处理的那个槽.
+		boost::uint64_t expiry = (std::max)(e->m_expiry, m_current);
+
+		boost::uint64_t delta = expiry - m_current;
+		int level = 0;
+		while (level < level_count - 1 && delta >= (boost::uint64_t(1) << (slot_bits * (level + 1))))
+			level ++;
+
+		// 超出最上层范围的放在最上层最远的槽, 转到的时候再往下分.
+		if (delta >= (boost::uint64_t(1) << (slot_bits * level_count)))
+			expiry = m_current + (boost::uint64_t(1) << (slot_bits * level_count)) - 1;
+
+		link(&m_slots[level][(expiry >> (slot_bits * level)) & slot_mask], e);
+	}
+
+	// 把上层的一个槽重新分到下层.
+	void cascade(int level)
+	{
+		wheel_entry * list = m_slots[level][(m_current >> (slot_bits * level)) & slot_mask];
+		m_slots[level][(m_current >> (slot_bits * level)) & slot_mask] = 0;
+
+		while (wheel_entry * e = list)
+		{
+			list = e->m_next;
+			e->m_prev = e->m_next = 0;
+			e->m_list = 0;
+			place(e);
+		}
+	}
+
+	// 到期的定时器放进 expired, 由调用者在锁外面触发.
+	void advance(boost::uint64_t target, std::vector<wheel_entry*> & expired_entries)
+	{
+		while (m_current < target && m_size > 0)
+		{
+			m_current ++;
+
+			for (int level = 1; level < level_count; level++)
+			{
+				if ((m_current & ((boost::uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+					break;
+				cascade(level);
+			}
+
+			// 到期的整个槽取下来.
+			wheel_entry * expired = m_slots[0][m_current & slot_mask];
+			m_slots[0][m_current & slot_mask] = 0;
+			for (wheel_entry * e = expired; e; e = e->m_next)
+				e->m_list = &expired;
+
+			while (wheel_entry * e = expired)
+			{
+				unlink(e);
+				m_size --;
+				expired_entries.push_back(e);
+			}
+		}
+
+		if (m_size == 0)
+			m_current = target;
+	}
+
+	void start()
+	{
+		if (m_running || m_shutdown || m_size == 0)
+			return;
+
+		m_running = true;
+		m_timer.expires_at(m_start + tick_duration(m_current + 1));
+		m_timer.async_wait(
+			boost::bind(&timer_wheel_impl::handle_tick,
+				boost::weak_ptr<timer_wheel_impl>(shared_from_this()), boost::asio::placeholders::error)
+		);
+	}
+
+	boost::posix_time::time_duration tick_duration(boost::uint64_t ticks) const
+	{
+		return boost::posix_time::microseconds(static_cast<boost::int64_t>(ticks) * m_tick.total_microseconds());
+	}
+
+	static void handle_tick(boost::weak_ptr<timer_wheel_impl> weak_wheel, boost::system::error_code ec)
+	{
+		boost::shared_ptr<timer_wheel_impl> wheel = weak_wheel.lock();
+		if (!wheel)
+			return;
+
+		std::vector<wheel_entry*> expired;
+		{
+			boost::asio::detail::mutex::scoped_lock l(wheel->m_mutex);
+
+			wheel->m_running = false;
+			if (ec || wheel->m_shutdown)
+				return;
+
+			expired.swap(wheel->m_expired);
+			wheel->advance(wheel->now_tick(), expired);
+			wheel->start();
+		}
+
+		// 取下来的定时器别人已经取消不了了, handler 还在节点里, 节点不会被释放.
+		for (std::size_t i = 0; i < expired.size(); i++)
+			expired[i]->fire(boost::system::error_code());
+
+		// 留着下一个 tick 用, 免得每次都分配.
+		expired.clear();
+		boost::asio::detail::mutex::scoped_lock l(wheel->m_mutex);
+		if (wheel->m_expired.capacity() < expired.capacity())
+			wheel->m_expired.swap(expired);
+	}
+
+private:
+	boost::asio::io_service & m_io_service;
+	mutable boost::asio::detail::mutex m_mutex;
+	boost::asio::deadline_timer m_timer;
+	std::vector<wheel_entry*> m_expired;
+
+	boost::posix_time::time_duration m_tick;
+	boost::posix_time::ptime m_start;
+	boost::uint64_t m_current;
+
+	wheel_entry * m_slots[level_count][slot_count];
+	std::size_t m_size;
+
+	bool m_running;
+	bool m_shutdown;
+};
+
+} // namespace detail
+
+/*
+ * timer_wheel 是所有解码器共用的时间轮, 每个 io_service 一个.
+ *
+ * 轮询的时候用 wheel_timer 代替 deadline_timer, 几万个验证码同时在等待也只有一个
+ * asio 定时器. 精度是 resolution (默认 100ms), 对几秒钟的轮询间隔足够了.
+ */
+class timer_wheel
+	: public boost::asio::detail::service_base<timer_wheel>
+{
+public:
+	explicit timer_wheel(boost::asio::io_service & io_service)
+		: boost::asio::detail::service_base<timer_wheel>(io_service),
+		  m_impl(boost::make_shared<detail::timer_wheel_impl>(boost::ref(io_service)))
+	{
+	}
+
+	std::size_t size() const
+	{
+		return m_impl->size();
+	}
+
+	boost::posix_time::time_duration resolution() const
+	{
+		return m_impl->resolution();
+	}
+
+	// 只在没有定时器挂着的时候生效.
+	void set_resolution(boost::posix_time::time_duration tick)
+	{
+		m_impl->set_resolution(tick);
+	}
+
+	boost::shared_ptr<detail::timer_wheel_impl> impl() const
+	{
+		return m_impl;
+	}
+
+private:
+	void shutdown_service()
+	{
+		m_impl->shutdown();
+	}
+
+private:
+	boost::shared_ptr<detail::timer_wheel_impl> m_impl;
+};
+
+/*
+ * wheel_timer 是挂在 timer_wheel 上的定时器, 用法和 deadline_timer 一样.
+ *
+ * handler 的类型在编译期固定, 节点在构造的时候就分配好了, 之后每次 async_wait
+ * 只是把 handler 拷贝进来挂到链表上, 不再分配内存. 同一时间只能有一个 async_wait.
+ */
+template<class Handler>
+class wheel_timer : public detail::wheel_entry{
+public:
+	explicit wheel_timer(boost::asio::io_service & io_service)
+		: m_wheel(boost::asio::use_service<timer_wheel>(io_service).impl())
+	{
+	}
+
+	~wheel_timer()
+	{
+		if (boost::shared_ptr<detail::timer_wheel_impl> wheel = m_wheel.lock())
+			wheel->remove(this);
+	}
+
+	void expires_from_now(boost::posix_time::time_duration delay)
+	{
+		m_delay = delay;
+	}
+
+	void async_wait(const Handler & handler)
+	{
+		boost::shared_ptr<detail::timer_wheel_impl> wheel = m_wheel.lock();
+		if (!wheel)
+			return;
+
+		// op 不能赋值, 只能原地构造.
+		m_handler = boost::in_place(handler);
+		wheel->schedule(this, m_delay);
+	}
+
+	std::size_t cancel(boost::system::error_code & ec)
+	{
+		ec = boost::system::error_code();
+
+		// 已经到期取下来了的话, handler 归 fire 所有.
+		boost::shared_ptr<detail::timer_wheel_impl> wheel = m_wheel.lock();
+		if (!wheel || !wheel->remove(this))
+			return 0;
+
+		Handler handler(*m_handler);
+		m_handler = boost::none;
+		wheel->get_io_service().post(
+			boost::asio::detail::bind_handler(handler, boost::system::error_code(boost::asio::error::operation_aborted))
+		);
+		return 1;
+	}
+
+private:
+	void fire(const boost::system::error_code & ec)
+	{
+		// handler 里通常会再次 async_wait, 先把它拿出来.
+		Handler handler(*m_handler);
+		m_handler = boost::none;
+		handler(ec);
+	}
+
+	void destroy()
+	{
+		// handler 里的 op 可能持有这个定时器, 先换出来, 最后再析构.
+		if (!m_handler)
+			return;
+		Handler handler(*m_handler);
+		m_handler = boost::none;
+	}
+
+private:
+	boost::weak_ptr<detail::timer_wheel_impl> m_wheel;
+	boost::posix_time::time_duration m_delay;
+	boost::optional<Handler> m_handler;
+};
+
+namespace detail{
+
+/*
+ * 协程 op 的 operator() 是 (ec, bytes_transfered), wheel_timer 的 handler 是 (ec).
+ * 时间轮在自己的 tick 里触发, 转到 op 的 strand 里再调用 op.
+ */
+template<class Op>
+struct wait_handler{
+	wait_handler(const Op & op, boost::shared_ptr<boost::asio::io_service::strand> strand)
+		: m_op(op), m_strand(strand)
+	{
+	}
+
+	void operator()(const boost::system::error_code & ec)
+	{
+		m_strand->dispatch(boost::asio::detail::bind_handler(m_op, ec, std::size_t(0)));
+	}
+
+	Op m_op;
+	boost::shared_ptr<boost::asio::io_service::strand> m_strand;
+};
+
+} // namespace detail
+} // namespace decaptcha